@@ -0,0 +1,117 @@
+//
+//  liborbisfs.h
+//  liborbisfs
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef liborbisfs_h
+#define liborbisfs_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    liborbisfs is built with hidden visibility, only this interface is exported
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC visibility push(default)
+#endif
+
+/*
+    Stable C interface for reading OrbisFS images in-process.
+
+    All functions return 0 (or a non-negative count) on success and a negative errno value on failure,
+    orbisfs_last_error() describes the last failure of the calling thread.
+    A read-only image handle may be used from multiple threads at the same time.
+ */
+
+#define LIBORBISFS_API_VERSION 1
+
+#define ORBISFS_ROOT_INO 2
+
+typedef struct orbisfs_image orbisfs_image;
+
+typedef struct {
+    uint32_t ino;
+    uint32_t mode;          //including S_IFMT bits
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t blocks;        //allocated blocks of orbisfs_block_size() bytes
+    uint32_t _reserved;
+    uint64_t size;
+    uint64_t ctime;         //seconds since 1970
+    uint64_t mtime;
+    uint64_t atime;
+} orbisfs_stat;
+
+typedef struct {
+    uint64_t logical;       //offset inside the file
+    uint64_t physical;      //offset inside the image file (including the offset passed to orbisfs_open)
+    uint64_t length;
+} orbisfs_extent;
+
+/*
+    Return non-zero to stop iterating, orbisfs_readdir returns that value then
+ */
+typedef int (*orbisfs_readdir_cb)(void *ctx, const char *name, const orbisfs_stat *st);
+
+/*
+    Version of the library, compare against LIBORBISFS_API_VERSION
+ */
+int orbisfs_api_version(void);
+
+/*
+    Human readable description of the last error on the calling thread, never NULL
+ */
+const char *orbisfs_last_error(void);
+
+/*
+    Opens the filesystem starting at offset inside the image at path, flags must be 0
+ */
+int orbisfs_open(const char *path, uint64_t offset, uint32_t flags, orbisfs_image **out);
+void orbisfs_close(orbisfs_image *img);
+
+uint32_t orbisfs_block_size(orbisfs_image *img);
+
+/*
+    Finds name inside the directory parent
+ */
+int orbisfs_lookup(orbisfs_image *img, uint32_t parent, const char *name, uint32_t *ino);
+
+/*
+    Resolves an absolute path
+ */
+int orbisfs_resolve(orbisfs_image *img, const char *path, uint32_t *ino);
+
+int orbisfs_stat_ino(orbisfs_image *img, uint32_t ino, orbisfs_stat *st);
+
+/*
+    Calls cb for every entry of the directory ino, sorted by name, without "." and ".."
+ */
+int orbisfs_readdir(orbisfs_image *img, uint32_t ino, orbisfs_readdir_cb cb, void *ctx);
+
+/*
+    Reads up to len bytes at offset of the regular file ino, returns the number of bytes read
+ */
+int64_t orbisfs_pread(orbisfs_image *img, uint32_t ino, void *buf, size_t len, uint64_t offset);
+
+/*
+    Physical location of the range [offset, offset+len) of the regular file ino.
+    Fills up to maxExtents extents and returns the total number of extents, which may be larger.
+ */
+int64_t orbisfs_extents(orbisfs_image *img, uint32_t ino, uint64_t offset, uint64_t len, orbisfs_extent *extents, size_t maxExtents);
+
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC visibility pop
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* liborbisfs_h */
@@ -0,0 +1,77 @@
+//
+//  OrbisFSBitmap.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSBitmap.hpp"
+
+#include <libgeneral/macros.h>
+
+using namespace orbisFSTool;
+
+#pragma mark OrbisFSBitmap
+OrbisFSBitmap::OrbisFSBitmap(uint64_t bits)
+: _bits(bits), _wordsCnt((bits+63)/64)
+, _words(nullptr)
+{
+    _words = new std::atomic<uint64_t>[_wordsCnt ? _wordsCnt : 1];
+    reset();
+}
+
+OrbisFSBitmap::~OrbisFSBitmap(){
+    if (_words) {
+        delete [] _words; _words = nullptr;
+    }
+}
+
+#pragma mark OrbisFSBitmap public
+uint64_t OrbisFSBitmap::size(){
+    return _bits;
+}
+
+bool OrbisFSBitmap::set(uint64_t bit){
+    retassure(bit < _bits, "bit %llu out of bounds",bit);
+    uint64_t mask = 1ULL << (bit & 63);
+    return (_words[bit >> 6].fetch_or(mask, std::memory_order_relaxed) & mask) != 0;
+}
+
+bool OrbisFSBitmap::clear(uint64_t bit){
+    retassure(bit < _bits, "bit %llu out of bounds",bit);
+    uint64_t mask = 1ULL << (bit & 63);
+    return (_words[bit >> 6].fetch_and(~mask, std::memory_order_relaxed) & mask) != 0;
+}
+
+bool OrbisFSBitmap::test(uint64_t bit){
+    retassure(bit < _bits, "bit %llu out of bounds",bit);
+    return (_words[bit >> 6].load(std::memory_order_relaxed) >> (bit & 63)) & 1;
+}
+
+uint64_t OrbisFSBitmap::getWord(uint64_t bit){
+    if (bit >= _bits) return 0;
+    uint64_t idx = bit >> 6;
+    uint32_t shift = bit & 63;
+    uint64_t ret = _words[idx].load(std::memory_order_relaxed) >> shift;
+    if (shift && idx+1 < _wordsCnt) {
+        ret |= _words[idx+1].load(std::memory_order_relaxed) << (64-shift);
+    }
+    if (_bits - bit < 64) {
+        ret &= (1ULL << (_bits - bit)) - 1;
+    }
+    return ret;
+}
+
+uint64_t OrbisFSBitmap::count(){
+    uint64_t ret = 0;
+    for (uint64_t i=0; i<_wordsCnt; i++) {
+        ret += __builtin_popcountll(_words[i].load(std::memory_order_relaxed));
+    }
+    return ret;
+}
+
+void OrbisFSBitmap::reset(){
+    for (uint64_t i=0; i<_wordsCnt; i++) {
+        _words[i].store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,51 @@
+//
+//  OrbisFSBitmap.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSBitmap_hpp
+#define OrbisFSBitmap_hpp
+
+#include <atomic>
+
+#include <stdint.h>
+
+namespace orbisFSTool {
+
+/*
+    Fixed size bitmap which can safely be updated from multiple threads at once.
+ */
+class OrbisFSBitmap {
+    const uint64_t _bits;
+    const uint64_t _wordsCnt;
+    std::atomic<uint64_t> *_words;
+    
+public:
+    OrbisFSBitmap(uint64_t bits);
+    OrbisFSBitmap(const OrbisFSBitmap &cpy) = delete;
+    ~OrbisFSBitmap();
+    
+    uint64_t size();
+    
+    /*
+        returns the previous value of the bit
+     */
+    bool set(uint64_t bit);
+    bool clear(uint64_t bit);
+    bool test(uint64_t bit);
+    
+    /*
+        returns 64 bits starting at bit (need not be word aligned)
+        bits beyond the end of the bitmap read as zero
+     */
+    uint64_t getWord(uint64_t bit);
+    
+    uint64_t count();
+    void reset();
+};
+
+}
+
+#endif /* OrbisFSBitmap_hpp */
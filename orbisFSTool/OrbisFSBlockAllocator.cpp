@@ -10,6 +10,8 @@
 
 #include <libgeneral/macros.h>
 
+#include <string.h>
+
 using namespace orbisFSTool;
 
 #pragma mark OrbisFSBlockAllocator
@@ -110,5 +112,86 @@ void OrbisFSBlockAllocator::freeBlock(uint32_t blkNum){
 }
 
 uint32_t OrbisFSBlockAllocator::allocateBlock(){
-    reterror("TODO");
+    return allocateBlocks(1).at(0);
+}
+
+std::vector<uint32_t> OrbisFSBlockAllocator::allocateBlocks(uint32_t count){
+    std::vector<uint32_t> ret;
+    uint64_t freeBlocks = getFreeBlocksNum();
+    retassure(freeBlocks >= count, "Not enough free blocks, requested %d but only %llu are available",count,freeBlocks);
+    ret.reserve(count);
+    
+    uint32_t maxEntries = _blockSize / sizeof(*_info);
+    uint32_t baseBlk = 0;
+    for (uint32_t i=0; i<maxEntries && ret.size() < count; i++) {
+        OrbisFSAllocatorInfoElem_t *ci = &_info[i];
+        if (ci->bitmapBlk.type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
+        if (ci->freeBlocks) {
+            uint8_t *bitmap = getBlock(ci->bitmapBlk.blk);
+            for (uint32_t z=0; z<ci->totalBlocks && ret.size() < count; z++) {
+                if ((z & 63) == 0 && z+64 <= ci->totalBlocks) {
+                    /*
+                        Skip fully allocated regions a word at a time
+                     */
+                    uint64_t w = 0;
+                    memcpy(&w, &bitmap[z >> 3], sizeof(w));
+                    if (!w) {
+                        z += 63;
+                        continue;
+                    }
+                }
+                uint32_t blkIdx = z >> 3;
+                uint32_t blkOff = z & 7;
+                if (((bitmap[blkIdx] >> blkOff) & 1) == 0) continue;
+                if (baseBlk + z == 0) continue; //never hand out the superblock
+                bitmap[blkIdx] &= ~(1<<blkOff);
+                ci->freeBlocks--;
+                ret.push_back(baseBlk + z);
+            }
+        }
+        baseBlk += ci->totalBlocks;
+    }
+    retassure(ret.size() == count, "Failed to allocate %d blocks, bitmaps only had %zu free blocks",count,ret.size());
+    return ret;
+}
+
+void OrbisFSBlockAllocator::iterateOverAllocatedBlocks(std::function<void(uint32_t first, uint32_t count)> callback){
+    uint32_t maxEntries = _blockSize / sizeof(*_info);
+    uint32_t baseBlk = 0;
+    uint32_t runStart = 0;
+    uint32_t runLen = 0;
+    for (uint32_t i=0; i<maxEntries; i++) {
+        OrbisFSAllocatorInfoElem_t *ci = &_info[i];
+        if (ci->bitmapBlk.type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
+        uint8_t *bitmap = getBlock(ci->bitmapBlk.blk);
+        for (uint32_t z=0; z<ci->totalBlocks; z++) {
+            if ((z & 63) == 0 && z+64 <= ci->totalBlocks) {
+                /*
+                    Whole words of free or used blocks are handled at once
+                 */
+                uint64_t w = 0;
+                memcpy(&w, &bitmap[z >> 3], sizeof(w));
+                if (w == ~0ULL) {
+                    if (runLen) callback(runStart, runLen);
+                    runLen = 0;
+                    z += 63;
+                    continue;
+                }else if (!w) {
+                    if (!runLen) runStart = baseBlk + z;
+                    runLen += 64;
+                    z += 63;
+                    continue;
+                }
+            }
+            if ((bitmap[z >> 3] >> (z & 7)) & 1) {
+                if (runLen) callback(runStart, runLen);
+                runLen = 0;
+            }else{
+                if (!runLen) runStart = baseBlk + z;
+                runLen++;
+            }
+        }
+        baseBlk += ci->totalBlocks;
+    }
+    if (runLen) callback(runStart, runLen);
 }
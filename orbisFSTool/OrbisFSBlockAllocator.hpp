@@ -12,7 +12,9 @@
 
 #include <libgeneral/Mem.hpp>
 
+#include <functional>
 #include <map>
+#include <vector>
 
 #include <stdint.h>
 
@@ -37,6 +39,17 @@ public:
     bool isBlockFree(uint32_t blkNum);
     void freeBlock(uint32_t blkNum);
     uint32_t allocateBlock();
+    
+    /*
+        Allocates count blocks in a single pass over the bitmaps.
+        Blocks are handed out in ascending order, so they are contiguous whenever possible.
+     */
+    std::vector<uint32_t> allocateBlocks(uint32_t count);
+    
+    /*
+        Calls back with {first, count} for every run of allocated blocks, in ascending order
+     */
+    void iterateOverAllocatedBlocks(std::function<void(uint32_t first, uint32_t count)> callback);
 };
 
 }
@@ -0,0 +1,131 @@
+//
+//  OrbisFSBufferedFile.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSBufferedFile.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <string.h>
+
+using namespace orbisFSTool;
+
+#pragma mark OrbisFSBufferedFile
+OrbisFSBufferedFile::OrbisFSBufferedFile(std::shared_ptr<OrbisFSFile> file, uint64_t maxDirtyBytes)
+: _file(file)
+, _maxDirtyBytes(maxDirtyBytes)
+, _dirtyBytes{0}
+, _readahead(_file.get())
+{
+    retassure(_file, "No file given");
+}
+
+OrbisFSBufferedFile::~OrbisFSBufferedFile(){
+    try {
+        flush();
+    } catch (tihmstar::exception &e) {
+        error("Failed to flush %llu dirty bytes, data is lost!",_dirtyBytes.load());
+        e.dump();
+    }
+}
+
+#pragma mark OrbisFSBufferedFile private
+void OrbisFSBufferedFile::flushLocked(){
+    if (!_dirty.size()) return;
+    _file->pwriteRanges(_dirty);
+    _dirty.clear();
+    _dirtyBytes = 0;
+}
+
+#pragma mark OrbisFSBufferedFile public
+std::shared_ptr<OrbisFSFile> OrbisFSBufferedFile::getFile(){
+    return _file;
+}
+
+uint64_t OrbisFSBufferedFile::size(){
+    std::unique_lock<std::mutex> ul(_lock);
+    uint64_t ret = _file->size();
+    if (_dirty.size()) {
+        auto &last = *_dirty.rbegin();
+        if (last.first + last.second.size() > ret) ret = last.first + last.second.size();
+    }
+    return ret;
+}
+
+size_t OrbisFSBufferedFile::pread(void *buf, size_t len, uint64_t offset){
+    if (_dirtyBytes.load(std::memory_order_relaxed)) flush();
+    _readahead.access(offset, len);
+    
+    /*
+        OrbisFSFile reads stop at block boundaries, callers here expect full reads
+     */
+    size_t didRead = 0;
+    size_t curRead = 0;
+    while (didRead < len && (curRead = _file->pread((uint8_t*)buf+didRead, len-didRead, offset+didRead))) {
+        didRead += curRead;
+    }
+    return didRead;
+}
+
+size_t OrbisFSBufferedFile::pwrite(const void *buf, size_t len, uint64_t offset){
+    if (!len) return 0;
+    const uint8_t *src = (const uint8_t *)buf;
+    const uint64_t end = offset + len;
+    std::unique_lock<std::mutex> ul(_lock);
+    
+    /*
+        Find the first range touching [offset, end] and merge everything up to end into it
+     */
+    auto it = _dirty.upper_bound(offset);
+    if (it != _dirty.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second.size() >= offset) it = prev;
+    }
+    
+    uint64_t start = offset;
+    std::vector<uint8_t> data;
+    if (it != _dirty.end() && it->first <= offset) {
+        start = it->first;
+        data = std::move(it->second);
+        _dirtyBytes -= data.size();
+        it = _dirty.erase(it);
+    }
+    while (it != _dirty.end() && it->first <= end) {
+        uint64_t relOffset = it->first - start;
+        if (data.size() < relOffset + it->second.size()) data.resize(relOffset + it->second.size());
+        memcpy(&data[relOffset], it->second.data(), it->second.size());
+        _dirtyBytes -= it->second.size();
+        it = _dirty.erase(it);
+    }
+    if (data.size() < end - start) data.resize(end - start);
+    memcpy(&data[offset - start], src, len);
+    _dirtyBytes += data.size();
+    _dirty.emplace_hint(it, start, std::move(data));
+    
+    if (_dirtyBytes > _maxDirtyBytes) flushLocked();
+    return len;
+}
+
+void OrbisFSBufferedFile::resize(uint64_t size){
+    std::unique_lock<std::mutex> ul(_lock);
+    flushLocked();
+    _file->resize(size);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> OrbisFSBufferedFile::getPhysicalExtents(uint64_t offset, uint64_t len){
+    if (_dirtyBytes.load(std::memory_order_relaxed)) flush();
+    _readahead.access(offset, len);
+    return _file->getPhysicalExtents(offset, len);
+}
+
+OrbisFSReadahead::Stats OrbisFSBufferedFile::getReadaheadStats(){
+    return _readahead.getStats();
+}
+
+void OrbisFSBufferedFile::flush(){
+    std::unique_lock<std::mutex> ul(_lock);
+    flushLocked();
+}
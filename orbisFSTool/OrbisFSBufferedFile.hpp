@@ -0,0 +1,63 @@
+//
+//  OrbisFSBufferedFile.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSBufferedFile_hpp
+#define OrbisFSBufferedFile_hpp
+
+#include "OrbisFSFile.hpp"
+#include "OrbisFSReadahead.hpp"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Open file handle used by the FUSE frontends.
+    Writes are collected as merged dirty ranges and only hit the image on flush(),
+    which does one batched allocation and a single inode update for all of them.
+    Reads are fed into a readahead detector which prefetches upcoming blocks.
+ */
+class OrbisFSBufferedFile {
+    std::shared_ptr<OrbisFSFile> _file;
+    const uint64_t _maxDirtyBytes;
+
+    std::mutex _lock;
+    std::map<uint64_t, std::vector<uint8_t>> _dirty; //offset -> data, never overlapping or adjacent
+    std::atomic<uint64_t> _dirtyBytes;
+    
+    OrbisFSReadahead _readahead;
+    
+    void flushLocked();
+public:
+    OrbisFSBufferedFile(std::shared_ptr<OrbisFSFile> file, uint64_t maxDirtyBytes = 64*1024*1024);
+    ~OrbisFSBufferedFile();
+    
+    std::shared_ptr<OrbisFSFile> getFile();
+    
+    uint64_t size();
+    size_t pread(void *buf, size_t len, uint64_t offset);
+    size_t pwrite(const void *buf, size_t len, uint64_t offset);
+    void resize(uint64_t size);
+    std::vector<std::pair<uint64_t, uint64_t>> getPhysicalExtents(uint64_t offset, uint64_t len);
+    
+    OrbisFSReadahead::Stats getReadaheadStats();
+    
+    /*
+        Writes all dirty ranges to the image
+     */
+    void flush();
+};
+
+}
+#endif /* OrbisFSBufferedFile_hpp */
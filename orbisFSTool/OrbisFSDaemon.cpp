@@ -0,0 +1,360 @@
+//
+//  OrbisFSDaemon.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSDaemon.hpp"
+#include "OrbisFSException.hpp"
+#include "OrbisFSExtractor.hpp"
+#include "OrbisFSHash.hpp"
+#include "OrbisFSListWriter.hpp"
+#include "OrbisFSTrace.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define MAX_REQUEST_SIZE 0x10000
+#define READ_PIPE_SIZE (1024*1024) //only a hint, the kernel may cap it
+
+using namespace orbisFSTool;
+
+static void sendAll(int fd, const std::string &str){
+    writeAll(fd, str.data(), str.size());
+}
+
+static void sendError(int fd, int err, const char *msg){
+    std::string line = "ERR " + std::to_string(err) + " " + msg;
+    for (auto &c : line) {
+        if (c == '\n') c = ' ';
+    }
+    sendAll(fd, line + "\n");
+}
+
+#pragma mark OrbisFSDaemon
+OrbisFSDaemon::OrbisFSDaemon(std::vector<std::shared_ptr<OrbisFSImage>> images, const char *socketPath, unsigned threads)
+: _images(images), _socketPath(socketPath), _threads(threads)
+, _listenfd(-1), _stopPipe{-1,-1}
+{
+    struct sockaddr_un addr = {};
+    retassure(_socketPath.size() < sizeof(addr.sun_path), "Socket path '%s' is too long",socketPath);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path)-1);
+
+    {
+        /*
+            Only replace stale sockets, never regular files
+         */
+        struct stat st = {};
+        if (!lstat(socketPath, &st)) {
+            retassure(S_ISSOCK(st.st_mode), "'%s' exists and is not a socket",socketPath);
+            unlink(socketPath);
+        }
+    }
+
+    retassure(!pipe(_stopPipe), "Failed to create pipe");
+    retassure((_listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "Failed to create socket errno=%d (%s)",errno,strerror(errno));
+    fcntl(_listenfd, F_SETFD, FD_CLOEXEC);
+    {
+        mode_t oldMask = umask(0177); //socket is only accessible by us
+        int err = bind(_listenfd, (struct sockaddr*)&addr, sizeof(addr));
+        umask(oldMask);
+        retassure(!err, "Failed to bind '%s' errno=%d (%s)",socketPath,errno,strerror(errno));
+    }
+    retassure(!listen(_listenfd, SOMAXCONN), "Failed to listen errno=%d (%s)",errno,strerror(errno));
+
+    /*
+        Clients going away must not kill us
+     */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+OrbisFSDaemon::~OrbisFSDaemon(){
+    if (_listenfd != -1) unlink(_socketPath.c_str());
+    safeClose(_listenfd);
+    safeClose(_stopPipe[0]);
+    safeClose(_stopPipe[1]);
+}
+
+#pragma mark OrbisFSDaemon private
+void OrbisFSDaemon::handleConnection(int fd){
+    cleanup([&]{
+        /*
+            Erase before closing, once closed accept() may hand out the same fd number again
+         */
+        std::unique_lock<std::mutex> ul(_connectionsLock);
+        _connections.erase(fd);
+        close(fd);
+        _connectionsCond.notify_all();
+    });
+    try {
+        OrbisFSListWriter writer(fd, OrbisFSListWriter::kFormatNDJSON);
+        std::string pending;
+        char buf[0x1000];
+        while (true) {
+            size_t lineEnd = pending.find('\n');
+            if (lineEnd == std::string::npos) {
+                if (pending.size() > MAX_REQUEST_SIZE) {
+                    sendError(fd, E2BIG, "Request too large");
+                    return;
+                }
+                ssize_t didRead = read(fd, buf, sizeof(buf));
+                if (didRead < 0 && errno == EINTR) continue;
+                if (didRead <= 0) return;
+                pending.append(buf, didRead);
+                continue;
+            }
+
+            std::vector<std::string> args;
+            {
+                size_t pos = 0;
+                while (true) {
+                    size_t next = pending.find('\t', pos);
+                    if (next == std::string::npos || next > lineEnd) next = lineEnd;
+                    args.push_back(pending.substr(pos, next - pos));
+                    if (next == lineEnd) break;
+                    pos = next + 1;
+                }
+                pending.erase(0, lineEnd + 1);
+            }
+
+            bool replied = false;
+            try {
+                handleRequest(fd, args, writer, replied);
+            } catch (tihmstar::OrbisFSFileNotFound &e) {
+                if (replied) return; //can't tell the client anymore, the stream is out of sync
+                sendError(fd, ENOENT, e.what());
+            } catch (tihmstar::exception &e) {
+                if (replied) return;
+                sendError(fd, EIO, e.what());
+            }
+        }
+    } catch (tihmstar::exception &e) {
+        //client went away
+    }
+}
+
+void OrbisFSDaemon::handleRequest(int fd, const std::vector<std::string> &args, OrbisFSListWriter &writer, bool &replied){
+    OrbisFSTrace::Span span("daemon.request");
+    const std::string &cmd = args[0];
+
+    if (cmd == "PING") {
+        sendAll(fd, "OK\n\n");
+        return;
+    }
+
+    if (args.size() < 3) return sendError(fd, EINVAL, "Missing arguments");
+    OrbisFSImage *img = NULL;
+    {
+        char *end = NULL;
+        unsigned long idx = strtoul(args[1].c_str(), &end, 10);
+        if (!args[1].size() || *end || idx >= _images.size()) return sendError(fd, EINVAL, "Bad image index");
+        img = _images[idx].get();
+    }
+    const std::string &path = args[2];
+    OrbisFSInode_t node = img->getInodeForPath(path);
+
+    if (cmd == "STAT") {
+        replied = true;
+        sendAll(fd, "OK\n");
+        writer.addEntry(path, node);
+        writer.flush();
+        sendAll(fd, "\n");
+    }else if (cmd == "LIST") {
+        if (!S_ISDIR(node.fileMode)) return sendError(fd, ENOTDIR, "Not a directory");
+        bool recursive = args.size() > 3 && args[3] == "r";
+        replied = true;
+        sendAll(fd, "OK\n");
+        img->iterateOverFilesInFolder(path, recursive, [&](std::string curPath, OrbisFSInode_t curNode){
+            if (curPath.size() > 1 && curPath.back() == '/') curPath.pop_back();
+            writer.addEntry(curPath, curNode);
+        });
+        writer.flush();
+        sendAll(fd, "\n");
+    }else if (cmd == "HASH") {
+        if (!S_ISREG(node.fileMode)) return sendError(fd, EISDIR, "Not a regular file");
+        uint32_t algos = OrbisFSHash::availableAlgos();
+        OrbisFSHash hash(algos);
+        img->openFileID(node.inodeNum)->iterateOverData(0, node.filesize, [&](const void *data, size_t len){
+            hash.update(data, len);
+        });
+        OrbisFSHash::Digest d = hash.finalize();
+        std::string reply = "OK\n";
+        if (algos & OrbisFSHash::kHashSHA256) reply += "sha256 " + OrbisFSHash::hexForSHA256(d) + "\n";
+        reply += "xxh64 " + OrbisFSHash::hexForXXH64(d) + "\n\n";
+        sendAll(fd, reply);
+    }else if (cmd == "READ") {
+        if (!S_ISREG(node.fileMode)) return sendError(fd, EISDIR, "Not a regular file");
+        replied = true;
+        sendRead(fd, img, node);
+    }else if (cmd == "EXTRACT") {
+        if (args.size() < 4 || !args[3].size()) return sendError(fd, EINVAL, "Missing output directory");
+        if (!S_ISDIR(node.fileMode)) return sendError(fd, ENOTDIR, "Not a directory");
+        OrbisFSExtractor extractor(img, _threads);
+        extractor.extractTree(path, args[3].c_str());
+        sendAll(fd, "OK\n\n");
+    }else{
+        sendError(fd, ENOSYS, "Unknown command");
+    }
+}
+
+/*
+    Clients may never drain the pipe, so writes to it are non-blocking and also wake up on stop()
+ */
+void OrbisFSDaemon::waitForPipe(int pfd){
+    while (true) {
+        struct pollfd fds[2] = {};
+        fds[0].fd = pfd;
+        fds[0].events = POLLOUT;
+        fds[1].fd = _stopPipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            retassure(errno == EINTR, "poll failed errno=%d (%s)",errno,strerror(errno));
+            continue;
+        }
+        retassure(!fds[1].revents, "Shutting down");
+        if (fds[0].revents) return;
+    }
+}
+
+void OrbisFSDaemon::writePipe(int pfd, const void *buf, size_t len){
+    const uint8_t *p = (const uint8_t*)buf;
+    while (len) {
+        ssize_t didWrite = write(pfd, p, len);
+        if (didWrite < 0 && errno == EINTR) continue;
+        if (didWrite < 0 && errno == EAGAIN) {
+            waitForPipe(pfd);
+            continue;
+        }
+        retassure(didWrite > 0, "Failed to write to client pipe errno=%d (%s)",errno,strerror(errno));
+        p += didWrite;
+        len -= didWrite;
+    }
+}
+
+void OrbisFSDaemon::sendRead(int fd, OrbisFSImage *img, const OrbisFSInode_t &node){
+    int p[2] = {-1,-1};
+    cleanup([&]{
+        safeClose(p[0]);
+        safeClose(p[1]);
+    });
+    retassure(!pipe(p), "Failed to create pipe");
+#ifdef F_SETPIPE_SZ
+    fcntl(p[1], F_SETPIPE_SZ, READ_PIPE_SIZE);
+#endif
+    fcntl(p[1], F_SETFL, fcntl(p[1], F_GETFL) | O_NONBLOCK);
+
+    {
+        std::string header = "OK " + std::to_string(node.filesize) + "\n";
+        struct iovec iov = {};
+        iov.iov_base = (void*)header.data();
+        iov.iov_len = header.size();
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control = {};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &p[0], sizeof(int));
+        ssize_t didSend = 0;
+        while ((didSend = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR);
+        retassure(didSend == (ssize_t)header.size(), "Failed to send read reply errno=%d (%s)",errno,strerror(errno));
+        safeClose(p[0]); //the client has its own copy now
+    }
+
+    auto f = img->openFileID(node.inodeNum);
+    uint64_t sent = 0;
+#ifdef __linux__
+    /*
+        Move the data from the page cache into the pipe without copying it through userspace,
+        compressed images have no fd with the file data
+     */
+    const int imgfd = img->getFd();
+    const uint64_t fdOffset = img->getFdOffset();
+    if (imgfd != -1) {
+        for (auto &e : f->getPhysicalExtents(0, node.filesize)) {
+            loff_t off = fdOffset + e.first;
+            uint64_t remaining = e.second;
+            while (remaining) {
+                ssize_t didSplice = splice(imgfd, &off, p[1], NULL, remaining, SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                if (didSplice < 0 && errno == EINTR) continue;
+                if (didSplice < 0 && errno == EAGAIN) {
+                    waitForPipe(p[1]);
+                    continue;
+                }
+                if (didSplice < 0 && !sent && (errno == EINVAL || errno == ENOSYS)) break; //not supported for this file, copy instead
+                retassure(didSplice > 0, "Failed to splice file data errno=%d (%s)",errno,strerror(errno));
+                remaining -= didSplice;
+                sent += didSplice;
+            }
+            if (remaining) break;
+        }
+    }
+#endif
+    if (sent < node.filesize) {
+        f->iterateOverData(sent, node.filesize - sent, [&](const void *data, size_t len){
+            writePipe(p[1], data, len);
+        });
+    }
+}
+
+#pragma mark OrbisFSDaemon public
+void OrbisFSDaemon::loop(){
+    info("Serving %zu images on '%s'",_images.size(),_socketPath.c_str());
+    while (true) {
+        struct pollfd fds[2] = {};
+        fds[0].fd = _listenfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = _stopPipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            retassure(errno == EINTR, "poll failed errno=%d (%s)",errno,strerror(errno));
+            continue;
+        }
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int cfd = accept(_listenfd, NULL, NULL);
+        if (cfd == -1) continue;
+        fcntl(cfd, F_SETFD, FD_CLOEXEC);
+        {
+            std::unique_lock<std::mutex> ul(_connectionsLock);
+            _connections.insert(cfd);
+        }
+        std::thread(&OrbisFSDaemon::handleConnection, this, cfd).detach();
+    }
+
+    /*
+        Kick out everyone who is still connected and wait until their threads left
+     */
+    info("Shutting down");
+    std::unique_lock<std::mutex> ul(_connectionsLock);
+    for (int cfd : _connections) shutdown(cfd, SHUT_RDWR);
+    _connectionsCond.wait(ul, [this]{return _connections.empty();});
+}
+
+void OrbisFSDaemon::stop(){
+    if (write(_stopPipe[1], "", 1) < 0) {
+        //nothing we could do from a signal handler
+    }
+}
@@ -0,0 +1,76 @@
+//
+//  OrbisFSDaemon.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSDaemon_hpp
+#define OrbisFSDaemon_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+class OrbisFSListWriter;
+
+/*
+    Serves requests for already opened images over a Unix socket, every connection gets its own thread.
+
+    Requests are single lines of tab separated fields, <image> is the index of the image (0 is -i):
+        PING
+        STAT    <image> <path>
+        LIST    <image> <path> [r]      children of path (recursive with 'r')
+        HASH    <image> <path>
+        READ    <image> <path>
+        EXTRACT <image> <path> <outdir> directory tree to outdir on the host
+    Replies start with one line:
+        ERR <errno> <message>
+        OK                              followed by payload lines and an empty line
+        OK <size>                       READ only, carries the read end of a pipe (SCM_RIGHTS)
+                                        which delivers exactly <size> bytes of file data
+    STAT and LIST payloads are NDJSON lines as written by --list-format ndjson,
+    HASH payload lines are "<algo> <hex>".
+ */
+class OrbisFSDaemon {
+    std::vector<std::shared_ptr<OrbisFSImage>> _images;
+    std::string _socketPath;
+    unsigned _threads;
+    int _listenfd;
+    int _stopPipe[2];
+
+    std::mutex _connectionsLock;
+    std::condition_variable _connectionsCond;
+    std::set<int> _connections;
+
+    void handleConnection(int fd);
+    void handleRequest(int fd, const std::vector<std::string> &args, OrbisFSListWriter &writer, bool &replied);
+    void sendRead(int fd, OrbisFSImage *img, const OrbisFSInode_t &node);
+    void waitForPipe(int pfd);
+    void writePipe(int pfd, const void *buf, size_t len);
+public:
+    OrbisFSDaemon(std::vector<std::shared_ptr<OrbisFSImage>> images, const char *socketPath, unsigned threads = 0);
+    ~OrbisFSDaemon();
+
+    /*
+        Accepts connections until stop() is called, then waits for all connections to finish
+     */
+    void loop();
+
+    /*
+        Async-signal-safe
+     */
+    void stop();
+};
+
+}
+#endif /* OrbisFSDaemon_hpp */
@@ -0,0 +1,216 @@
+//
+//  OrbisFSDedup.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSDedup.hpp"
+#include "OrbisFSHash.hpp"
+#include "OrbisFSWorkPool.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/stat.h>
+#include <stdlib.h>
+
+#define DEDUP_TASK_BLOCKS 1024
+#define DEDUP_LOAD_FACTOR_PERCENT 70
+
+using namespace orbisFSTool;
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "table entries need to be plain 64bit words");
+
+static double percent(uint64_t part, uint64_t total){
+    return total ? part * 100.0 / total : 0;
+}
+
+#pragma mark OrbisFSDedup
+OrbisFSDedup::OrbisFSDedup(unsigned threads)
+: _threads(threads)
+, _table(NULL), _tableMask(0)
+, _uniqueBlocks(0)
+{
+    //
+}
+
+OrbisFSDedup::~OrbisFSDedup(){
+    safeFree(_table);
+}
+
+#pragma mark OrbisFSDedup private
+void OrbisFSDedup::insert(uint64_t key){
+    uint64_t idx = (key >> 1) & _tableMask;
+    while (true) {
+        uint64_t cur = _table[idx].load(std::memory_order_relaxed);
+        if (!cur) {
+            if (_table[idx].compare_exchange_strong(cur, key)) {
+                _uniqueBlocks++;
+                return;
+            }
+            //somebody else took the slot, look at what they put there
+        }
+        if ((cur & ~1ULL) == key) {
+            if (!(cur & 1)) _table[idx].fetch_or(1);
+            return;
+        }
+        if (cur) idx = (idx + 1) & _tableMask;
+    }
+}
+
+bool OrbisFSDedup::isDuplicate(uint64_t key){
+    uint64_t idx = (key >> 1) & _tableMask;
+    while (true) {
+        uint64_t cur = _table[idx].load(std::memory_order_relaxed);
+        retassure(cur, "Block hash is missing from the table");
+        if ((cur & ~1ULL) == key) return cur & 1;
+        idx = (idx + 1) & _tableMask;
+    }
+}
+
+uint64_t OrbisFSDedup::keyForBlock(const ImageInfo &ii, uint32_t blk){
+    auto it = std::upper_bound(ii.runs.begin(), ii.runs.end(), blk, [](uint32_t b, const std::pair<uint32_t, uint32_t> &r)->bool{
+        return b < r.first;
+    });
+    if (it == ii.runs.begin()) return 0;
+    --it;
+    if (blk - it->first >= it->second) return 0;
+    return ii.blockKeys[ii.runRanks[it - ii.runs.begin()] + (blk - it->first)];
+}
+
+#pragma mark OrbisFSDedup public
+void OrbisFSDedup::addImage(OrbisFSImage *img, std::string name){
+    retassure(!_table, "Can't add images after analyzing");
+    _images.push_back({img, name, {}, {}, {}, 0});
+}
+
+void OrbisFSDedup::analyze(size_t topFiles){
+    retassure(_images.size(), "No images to analyze");
+    auto tstart = std::chrono::steady_clock::now();
+    uint64_t totalBlocks = 0;
+    
+    /*
+        Keys are only kept for allocated blocks, free space costs nothing
+     */
+    for (auto &ii : _images) {
+        ii.runs.clear();
+        ii.runRanks.clear();
+        ii.allocatedBlocks = 0;
+        ii.img->_blockAllocator->iterateOverAllocatedBlocks([&](uint32_t first, uint32_t count){
+            ii.runs.push_back({first, count});
+        });
+        std::sort(ii.runs.begin(), ii.runs.end());
+        ii.runRanks.reserve(ii.runs.size());
+        for (auto &r : ii.runs) {
+            ii.runRanks.push_back(ii.allocatedBlocks);
+            ii.allocatedBlocks += r.second;
+        }
+        ii.blockKeys.assign(ii.allocatedBlocks, 0);
+        totalBlocks += ii.allocatedBlocks;
+    }
+    
+    {
+        uint64_t tableSize = 1024;
+        while (tableSize * DEDUP_LOAD_FACTOR_PERCENT / 100 < totalBlocks) tableSize <<= 1;
+        safeFree(_table);
+        retassure(_table = (std::atomic<uint64_t>*)calloc(tableSize, sizeof(*_table)), "Failed to allocate hash table with %llu entries",tableSize);
+        _tableMask = tableSize - 1;
+        _uniqueBlocks = 0;
+        info("Hashing %llu allocated blocks of %zu images (hash table %llu MiB)",totalBlocks,_images.size(),tableSize*sizeof(*_table) >> 20);
+    }
+    
+    OrbisFSWorkPool pool(_threads);
+    for (auto &image : _images) {
+        ImageInfo *ii = &image;
+        for (size_t k=0; k<ii->runs.size(); k++) {
+            const std::pair<uint32_t, uint32_t> r = ii->runs[k];
+            for (uint64_t first = r.first; first < (uint64_t)r.first + r.second; first += DEDUP_TASK_BLOCKS) {
+                uint32_t count = (uint32_t)std::min<uint64_t>(DEDUP_TASK_BLOCKS, (uint64_t)r.first + r.second - first);
+                uint64_t keyIdx = ii->runRanks[k] + (first - r.first);
+                pool.push([this,ii,first,count,keyIdx](unsigned worker){
+                    const uint32_t blockSize = ii->img->getBlocksize();
+                    for (uint32_t b = 0; b < count; b++) {
+                        uint32_t blk = (uint32_t)first + b;
+                        OrbisFSHash h(OrbisFSHash::kHashXXH64);
+                        ii->img->iterateOverRaw((uint64_t)blk * blockSize, blockSize, [&](const void *data, size_t len){
+                            h.update(data, len);
+                        });
+                        uint64_t key = h.finalize().xxh64 & ~1ULL;
+                        if (!key) key = 2;
+                        ii->blockKeys[keyIdx + b] = key;
+                        insert(key);
+                    }
+                });
+            }
+        }
+    }
+    pool.wait();
+    retassure(!pool.failedTasks(), "Failed to hash %llu block ranges",pool.failedTasks());
+    
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Hashed %llu blocks in %.3f sec using %u threads (%.2f MB/s)",
+         totalBlocks, secs, pool.threads(), totalBlocks*(double)_images.front().img->getBlocksize()/secs/1e6);
+    
+    /*
+        Per image
+     */
+    for (auto &ii : _images) {
+        uint64_t dups = 0;
+        for (uint64_t key : ii.blockKeys) {
+            if (key && isDuplicate(key)) dups++;
+        }
+        printf("%s: %llu allocated blocks, %llu (%.1f%%) duplicated, %llu (%.1f%%) unique\n",
+               ii.name.c_str(), ii.allocatedBlocks, dups, percent(dups, ii.allocatedBlocks),
+               ii.allocatedBlocks - dups, percent(ii.allocatedBlocks - dups, ii.allocatedBlocks));
+    }
+    
+    /*
+        Per file, only the ones with the most duplicated data are reported
+     */
+    if (topFiles) {
+        struct FileDups {
+            std::string name;
+            uint64_t blocks;
+            uint64_t dups;
+        };
+        std::vector<FileDups> files;
+        for (auto &ii : _images) {
+            ii.img->iterateOverFilesInFolder("/", true, [&](std::string path, OrbisFSInode_t node){
+                if (!S_ISREG(node.fileMode) || !node.filesize) return;
+                FileDups fd = {ii.name + ":" + path, 0, 0};
+                const uint64_t blockSize = ii.img->getBlocksize();
+                for (auto &e : ii.img->openFileID(node.inodeNum)->getPhysicalExtents(0, node.filesize)) {
+                    for (uint64_t blk = e.first / blockSize; blk < (e.first + e.second + blockSize - 1) / blockSize; blk++) {
+                        uint64_t key = keyForBlock(ii, (uint32_t)blk);
+                        fd.blocks++;
+                        if (key && isDuplicate(key)) fd.dups++;
+                    }
+                }
+                if (!fd.dups) return;
+                files.push_back(fd);
+                if (files.size() > topFiles*2) {
+                    std::nth_element(files.begin(), files.begin() + topFiles, files.end(), [](const FileDups &a, const FileDups &b){
+                        return a.dups > b.dups;
+                    });
+                    files.resize(topFiles);
+                }
+            });
+        }
+        std::sort(files.begin(), files.end(), [](const FileDups &a, const FileDups &b){
+            return a.dups > b.dups;
+        });
+        if (files.size() > topFiles) files.resize(topFiles);
+        if (files.size()) printf("Files with the most duplicated blocks:\n");
+        for (auto &f : files) {
+            printf("  %10llu/%-10llu (%5.1f%%) %s\n",f.dups,f.blocks,percent(f.dups, f.blocks),f.name.c_str());
+        }
+    }
+    
+    uint64_t unique = _uniqueBlocks.load();
+    printf("Total: %llu blocks, %llu unique, dedup ratio %.2f (%.1f%% could be saved)\n",
+           totalBlocks, unique, unique ? (double)totalBlocks / unique : 0, percent(totalBlocks - unique, totalBlocks));
+}
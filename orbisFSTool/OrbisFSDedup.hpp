@@ -0,0 +1,65 @@
+//
+//  OrbisFSDedup.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSDedup_hpp
+#define OrbisFSDedup_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Block level deduplication analysis across a set of images.
+    Every allocated block (according to the allocator bitmaps) is hashed with XXH64 and inserted into a
+    lock-free open addressing table of 8 byte entries: the hash with the lowest bit used as "seen more than once" flag.
+    The table is sized up front from the allocator counts, so it never needs to grow.
+ */
+class OrbisFSDedup {
+    struct ImageInfo {
+        OrbisFSImage *img; //not owned
+        std::string name;
+        std::vector<std::pair<uint32_t, uint32_t>> runs; //allocated {first, count}, ascending
+        std::vector<uint64_t> runRanks; //index in blockKeys of the first block of every run
+        std::vector<uint64_t> blockKeys; //one per allocated block, in block order
+        uint64_t allocatedBlocks;
+    };
+    
+    std::vector<ImageInfo> _images;
+    unsigned _threads;
+    
+    std::atomic<uint64_t> *_table;
+    uint64_t _tableMask;
+    std::atomic<uint64_t> _uniqueBlocks;
+    
+    void insert(uint64_t key);
+    bool isDuplicate(uint64_t key);
+
+    /*
+        0 for blocks the allocator doesn't consider allocated
+     */
+    static uint64_t keyForBlock(const ImageInfo &ii, uint32_t blk);
+public:
+    OrbisFSDedup(unsigned threads = 0);
+    ~OrbisFSDedup();
+    
+    void addImage(OrbisFSImage *img, std::string name);
+    
+    /*
+        Hashes all images and prints duplicate ratios per image, for the topFiles files with the most duplicated data and in aggregate
+     */
+    void analyze(size_t topFiles = 20);
+};
+
+}
+#endif /* OrbisFSDedup_hpp */
@@ -0,0 +1,261 @@
+//
+//  OrbisFSDiff.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSDiff.hpp"
+#include "OrbisFSWorkPool.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include <sys/stat.h>
+#include <string.h>
+
+#define DIFF_CHUNK_SIZE (64*1024*1024) //large files are compared in chunks on multiple workers
+
+using namespace orbisFSTool;
+
+static std::string childPath(const std::string &dir, const std::string &name){
+    if (dir.size() && dir.back() == '/') return dir + name;
+    return dir + "/" + name;
+}
+
+static std::string metadataChanges(const OrbisFSInode_t &a, const OrbisFSInode_t &b){
+    std::string ret;
+    auto add = [&](const char *field){
+        if (ret.size()) ret += ",";
+        ret += field;
+    };
+    if ((a.fileMode & 07777) != (b.fileMode & 07777)) add("mode");
+    if (a.uid != b.uid) add("uid");
+    if (a.gid != b.gid) add("gid");
+    if (S_ISREG(a.fileMode)) {
+        /*
+            Directory times change with every entry, they would only be noise
+         */
+        if (a.filesize != b.filesize) add("size");
+        if (a.modDate != b.modDate) add("mtime");
+    }
+    return ret;
+}
+
+/*
+    Copies the data out, pointers handed out by iterateOverData are only valid inside the callback
+    (compressed images evict frames) and a block may be split across several of them
+ */
+static void readAt(OrbisFSFile *f, uint64_t offset, uint8_t *buf, size_t len){
+    size_t didRead = 0;
+    size_t curRead = 0;
+    while (didRead < len && (curRead = f->pread(buf+didRead, len-didRead, offset+didRead))) {
+        didRead += curRead;
+    }
+    retassure(didRead == len, "Failed to read 0x%zx bytes at offset 0x%llx",len,offset);
+}
+
+static void mergeRanges(std::vector<std::pair<uint64_t, uint64_t>> &ranges){
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<uint64_t, uint64_t>> ret;
+    for (auto &r : ranges) {
+        if (ret.size() && ret.back().first + ret.back().second >= r.first) {
+            uint64_t end = std::max(ret.back().first + ret.back().second, r.first + r.second);
+            ret.back().second = end - ret.back().first;
+        }else{
+            ret.push_back(r);
+        }
+    }
+    ranges.swap(ret);
+}
+
+#pragma mark OrbisFSDiff
+OrbisFSDiff::OrbisFSDiff(OrbisFSImage *oldImg, OrbisFSImage *newImg, unsigned threads)
+: _old(oldImg), _new(newImg), _threads(threads)
+, _files(0), _skippedFiles(0), _comparedBytes(0)
+{
+    //
+}
+
+#pragma mark OrbisFSDiff private
+void OrbisFSDiff::addChange(Change change){
+    std::unique_lock<std::mutex> ul(_changesLock);
+    _changes.push_back(std::move(change));
+}
+
+void OrbisFSDiff::addTree(ChangeType type, OrbisFSImage *img, const std::string &path, const OrbisFSInode_t &node){
+    if (!S_ISDIR(node.fileMode)) {
+        addChange({type, path, "", {}});
+        return;
+    }
+    img->iterateOverFilesInFolder(path, true, [&](std::string curPath, OrbisFSInode_t node){
+        addChange({type, curPath, "", {}});
+    });
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> OrbisFSDiff::compareData(OrbisFSFile *oldFile, OrbisFSFile *newFile, uint64_t offset, uint64_t len){
+    std::vector<std::pair<uint64_t, uint64_t>> ret;
+    const uint32_t blockSize = _old->getBlocksize();
+    uint64_t end = offset + len;
+    std::vector<uint8_t> oldBuf(blockSize);
+    std::vector<uint8_t> newBuf(blockSize);
+    const uint8_t *a = oldBuf.data();
+    const uint8_t *b = newBuf.data();
+    while (offset < end) {
+        size_t curLen = (size_t)std::min<uint64_t>(blockSize - (offset % blockSize), end - offset);
+        readAt(oldFile, offset, oldBuf.data(), curLen);
+        readAt(newFile, offset, newBuf.data(), curLen);
+        if (memcmp(a, b, curLen)) {
+            /*
+                Narrow the block down to the bytes which actually differ
+             */
+            size_t first = 0;
+            size_t last = curLen;
+            while (a[first] == b[first]) first++;
+            while (a[last-1] == b[last-1]) last--;
+            ret.push_back({offset + first, last - first});
+        }
+        offset += curLen;
+    }
+    _comparedBytes += len;
+    return ret;
+}
+
+#pragma mark OrbisFSDiff public
+std::vector<OrbisFSDiff::Change> OrbisFSDiff::diff(std::string path){
+    retassure(_old->getBlocksize() == _new->getBlocksize(), "Images have different block sizes");
+    OrbisFSInode_t oldRoot = _old->getInodeForPath(path);
+    OrbisFSInode_t newRoot = _new->getInodeForPath(path);
+    retassure(S_ISDIR(oldRoot.fileMode) && S_ISDIR(newRoot.fileMode), "'%s' is not a directory in both images",path.c_str());
+
+    _changes.clear();
+    OrbisFSWorkPool pool(_threads);
+    std::function<void(std::string, uint32_t, uint32_t)> processDir;
+    std::function<void(std::string, OrbisFSInode_t, OrbisFSInode_t)> processFile;
+    auto tstart = std::chrono::steady_clock::now();
+
+    processFile = [&](std::string curPath, OrbisFSInode_t oldNode, OrbisFSInode_t newNode){
+        _files++;
+        std::string metadata = metadataChanges(oldNode, newNode);
+        std::shared_ptr<OrbisFSFile> oldFile = _old->openFileID(oldNode.inodeNum);
+        std::shared_ptr<OrbisFSFile> newFile = _new->openFileID(newNode.inodeNum);
+        uint64_t oldSize = oldNode.filesize;
+        uint64_t newSize = newNode.filesize;
+        uint64_t commonSize = std::min(oldSize, newSize);
+
+        if (!metadata.size() && oldNode.modCnt == newNode.modCnt
+            && oldFile->getPhysicalExtents(0, oldSize) == newFile->getPhysicalExtents(0, newSize)) {
+            /*
+                Never rewritten, don't bother looking at the data
+             */
+            _skippedFiles++;
+            return;
+        }
+
+        struct FileDiff {
+            std::mutex lock;
+            Change change;
+            std::atomic<uint64_t> remainingChunks;
+        };
+        std::shared_ptr<FileDiff> fd = std::make_shared<FileDiff>();
+        fd->change = {kChangeModified, curPath, metadata, {}};
+        if (newSize > commonSize) fd->change.ranges.push_back({commonSize, newSize - commonSize});
+
+        auto finish = [this](std::shared_ptr<FileDiff> fd){
+            mergeRanges(fd->change.ranges);
+            if (fd->change.metadata.size() || fd->change.ranges.size()) addChange(std::move(fd->change));
+        };
+
+        uint64_t chunks = (commonSize + DIFF_CHUNK_SIZE - 1) / DIFF_CHUNK_SIZE;
+        if (chunks <= 1) {
+            auto ranges = compareData(oldFile.get(), newFile.get(), 0, commonSize);
+            fd->change.ranges.insert(fd->change.ranges.end(), ranges.begin(), ranges.end());
+            finish(fd);
+            return;
+        }
+        fd->remainingChunks = chunks;
+        for (uint64_t i=0; i<chunks; i++) {
+            uint64_t offset = i*DIFF_CHUNK_SIZE;
+            uint64_t len = std::min<uint64_t>(DIFF_CHUNK_SIZE, commonSize - offset);
+            pool.push([this,fd,oldFile,newFile,offset,len,finish](unsigned worker){
+                auto ranges = compareData(oldFile.get(), newFile.get(), offset, len);
+                {
+                    std::unique_lock<std::mutex> ul(fd->lock);
+                    fd->change.ranges.insert(fd->change.ranges.end(), ranges.begin(), ranges.end());
+                }
+                if (--fd->remainingChunks == 0) finish(fd);
+            });
+        }
+    };
+
+    processDir = [&](std::string curPath, uint32_t oldDir, uint32_t newDir){
+        auto oldChildren = _old->listFilesInFolder(oldDir);
+        auto newChildren = _new->listFilesInFolder(newDir);
+
+        /*
+            Both lists are sorted by name, walk them side by side
+         */
+        auto o = oldChildren.begin();
+        auto n = newChildren.begin();
+        while (o != oldChildren.end() || n != newChildren.end()) {
+            if (n == newChildren.end() || (o != oldChildren.end() && o->first < n->first)) {
+                addTree(kChangeRemoved, _old, childPath(curPath, o->first), o->second);
+                ++o;
+                continue;
+            }
+            if (o == oldChildren.end() || n->first < o->first) {
+                addTree(kChangeAdded, _new, childPath(curPath, n->first), n->second);
+                ++n;
+                continue;
+            }
+
+            std::string p = childPath(curPath, n->first);
+            OrbisFSInode_t oldNode = o->second;
+            OrbisFSInode_t newNode = n->second;
+            ++o; ++n;
+            if (S_ISDIR(oldNode.fileMode) != S_ISDIR(newNode.fileMode)) {
+                addTree(kChangeRemoved, _old, p, oldNode);
+                addTree(kChangeAdded, _new, p, newNode);
+            }else if (S_ISDIR(newNode.fileMode)) {
+                std::string metadata = metadataChanges(oldNode, newNode);
+                if (metadata.size()) addChange({kChangeModified, p, metadata, {}});
+                uint32_t oldNum = oldNode.inodeNum;
+                uint32_t newNum = newNode.inodeNum;
+                pool.push([&processDir,p,oldNum,newNum](unsigned worker){
+                    processDir(p, oldNum, newNum);
+                });
+            }else{
+                pool.push([&processFile,p,oldNode,newNode](unsigned worker){
+                    processFile(p, oldNode, newNode);
+                });
+            }
+        }
+    };
+
+    {
+        std::string metadata = metadataChanges(oldRoot, newRoot);
+        if (metadata.size()) addChange({kChangeModified, path, metadata, {}});
+        uint32_t oldNum = oldRoot.inodeNum;
+        uint32_t newNum = newRoot.inodeNum;
+        pool.push([&processDir,path,oldNum,newNum](unsigned worker){
+            processDir(path, oldNum, newNum);
+        });
+    }
+    pool.wait();
+    retassure(!pool.failedTasks(), "Failed to compare %llu entries",pool.failedTasks());
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Compared %llu files (%llu unchanged by metadata, %llu bytes compared) in %.3f sec using %u threads, found %zu changes",
+         _files.load(), _skippedFiles.load(), _comparedBytes.load(), secs, pool.threads(), _changes.size());
+
+    std::vector<Change> ret;
+    ret.swap(_changes);
+    std::sort(ret.begin(), ret.end(), [](const Change &a, const Change &b)->bool{
+        return a.path < b.path;
+    });
+    return ret;
+}
@@ -0,0 +1,67 @@
+//
+//  OrbisFSDiff.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSDiff_hpp
+#define OrbisFSDiff_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Structural diff of two images.
+    Both trees are walked side by side on a work pool. Files with identical metadata and identical
+    physical block lists are considered unchanged without looking at their data,
+    everything else is compared block by block straight from the image mappings.
+ */
+class OrbisFSDiff {
+public:
+    enum ChangeType : char {
+        kChangeAdded    = 'A',
+        kChangeRemoved  = 'D',
+        kChangeModified = 'M'
+    };
+    struct Change {
+        ChangeType type;
+        std::string path;
+        std::string metadata;   //comma separated list of changed inode fields
+        std::vector<std::pair<uint64_t, uint64_t>> ranges; //changed {offset, length} in the new file
+    };
+private:
+    OrbisFSImage *_old; //not owned
+    OrbisFSImage *_new; //not owned
+    unsigned _threads;
+
+    std::mutex _changesLock;
+    std::vector<Change> _changes;
+
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _skippedFiles;
+    std::atomic<uint64_t> _comparedBytes;
+
+    void addChange(Change change);
+    void addTree(ChangeType type, OrbisFSImage *img, const std::string &path, const OrbisFSInode_t &node);
+    std::vector<std::pair<uint64_t, uint64_t>> compareData(OrbisFSFile *oldFile, OrbisFSFile *newFile, uint64_t offset, uint64_t len);
+public:
+    OrbisFSDiff(OrbisFSImage *oldImg, OrbisFSImage *newImg, unsigned threads = 0);
+
+    /*
+        Returns all changes below path, sorted by path
+     */
+    std::vector<Change> diff(std::string path = "/");
+};
+
+}
+#endif /* OrbisFSDiff_hpp */
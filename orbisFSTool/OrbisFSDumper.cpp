@@ -0,0 +1,354 @@
+//
+//  OrbisFSDumper.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSDumper.hpp"
+#include "OrbisFSSeekableZstd.hpp"
+#include "OrbisFSTrace.hpp"
+#include "OrbisFSWorkPool.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#   include <zstd.h>
+#endif //HAVE_ZSTD
+
+#define DUMP_CHUNK_SIZE (8*1024*1024)
+#define DUMP_MAX_FRAME_BLOCKS 1024
+#define DUMP_FRAMES_PER_WORKER 4 //frames in flight per worker, bounds memory while the writer catches up
+
+using namespace orbisFSTool;
+
+#pragma mark helper
+/*
+    Makes sure the range reads back as zeros, without allocating space if the filesystem can help it
+ */
+static void punchHole(int fd, uint64_t offset, uint64_t len){
+    if (!len) return;
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len)) return;
+    retassure(errno == EOPNOTSUPP || errno == ENOSYS, "Failed to punch hole at 0x%llx errno=%d (%s)",offset,errno,strerror(errno));
+#elif defined(F_PUNCHHOLE)
+    struct fpunchhole ph = {};
+    ph.fp_offset = offset;
+    ph.fp_length = len;
+    if (!fcntl(fd, F_PUNCHHOLE, &ph)) return;
+    retassure(errno == ENOTSUP || errno == EINVAL, "Failed to punch hole at 0x%llx errno=%d (%s)",offset,errno,strerror(errno));
+#endif
+    static const uint8_t zeros[0x10000] = {};
+    while (len) {
+        size_t curLen = (size_t)std::min<uint64_t>(len, sizeof(zeros));
+        pwriteAll(fd, zeros, curLen, offset);
+        offset += curLen;
+        len -= curLen;
+    }
+}
+
+static void putLE32(std::vector<uint8_t> &buf, uint32_t val){
+    for (int i=0; i<4; i++) buf.push_back((uint8_t)(val >> (8*i)));
+}
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *createCompressContext(int level){
+    ZSTD_CCtx *cctx = NULL;
+    retassure(cctx = ZSTD_createCCtx(), "Failed to create zstd compression context");
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    return cctx;
+}
+
+static size_t compressFrame(ZSTD_CCtx *cctx, const void *src, size_t len, std::vector<uint8_t> &dst){
+    size_t bound = ZSTD_compressBound(len);
+    if (dst.size() < bound) dst.resize(bound);
+    size_t ret = ZSTD_compress2(cctx, dst.data(), dst.size(), src, len);
+    retassure(!ZSTD_isError(ret), "Failed to compress frame: %s",ZSTD_getErrorName(ret));
+    return ret;
+}
+#endif //HAVE_ZSTD
+
+#pragma mark OrbisFSDumper
+OrbisFSDumper::OrbisFSDumper(OrbisFSImage *img, unsigned threads)
+: _img(img), _threads(threads)
+, _copiedBytes(0)
+{
+    //
+}
+
+#pragma mark OrbisFSDumper private
+std::vector<std::pair<uint64_t, uint64_t>> OrbisFSDumper::usedRanges(){
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    std::vector<std::pair<uint64_t, uint64_t>> ret;
+    const uint64_t blockSize = _img->getBlocksize();
+    const uint64_t size = _img->_memsize;
+    _img->_blockAllocator->iterateOverAllocatedBlocks([&](uint32_t first, uint32_t count){
+        ranges.push_back({first * blockSize, count * blockSize});
+    });
+    uint64_t covered = _img->_blockAllocator->getTotalBlockNum() * blockSize;
+    if (covered < size) ranges.push_back({covered, size - covered});
+
+    /*
+        The superblock isn't marked as used in the bitmaps, so keep all metadata it links to explicitly
+     */
+    {
+        OrbisFSSuperblock_t *sb = _img->_superblock;
+        ranges.push_back({0, blockSize});
+        ranges.push_back({sb->diskinfoLnk.blk * blockSize, blockSize});
+        ranges.push_back({sb->blockAllocatorLnk.blk * blockSize, blockSize});
+        OrbisFSAllocatorInfoElem_t *aie = (OrbisFSAllocatorInfoElem_t*)_img->getBlock(sb->blockAllocatorLnk.blk);
+        for (uint32_t i=0; i<blockSize / sizeof(*aie); i++) {
+            if (aie[i].bitmapBlk.type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
+            ranges.push_back({aie[i].bitmapBlk.blk * blockSize, blockSize});
+        }
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    for (auto &r : ranges) {
+        if (r.first >= size) break;
+        uint64_t end = std::min(r.first + r.second, size);
+        if (ret.size() && ret.back().first + ret.back().second >= r.first) {
+            ret.back().second = std::max(ret.back().first + ret.back().second, end) - ret.back().first;
+        }else{
+            ret.push_back({r.first, end - r.first});
+        }
+    }
+    return ret;
+}
+
+#pragma mark OrbisFSDumper public
+void OrbisFSDumper::dumpSparse(const char *outPath){
+    auto tstart = std::chrono::steady_clock::now();
+    const uint64_t size = _img->_memsize;
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = usedRanges();
+    uint64_t usedBytes = 0;
+    for (auto &r : ranges) usedBytes += r.second;
+    info("Dumping %llu MiB used of %llu MiB to '%s'",usedBytes >> 20,size >> 20,outPath);
+
+    retassure((fd = open(outPath, O_WRONLY | O_CREAT, 0644)) != -1, "Failed to open '%s' errno=%d (%s)",outPath,errno,strerror(errno));
+    uint64_t oldSize = size;
+    {
+        struct stat st = {};
+        retassure(!fstat(fd, &st), "Failed to stat '%s'",outPath);
+        if (S_ISREG(st.st_mode)) {
+            oldSize = st.st_size;
+            retassure(!ftruncate(fd, size), "Failed to resize '%s' to 0x%llx bytes errno=%d (%s)",outPath,size,errno,strerror(errno));
+        }
+    }
+
+    /*
+        Everything the file grew by is a hole already, only stale data before oldSize needs punching
+     */
+    {
+        uint64_t pos = 0;
+        for (size_t i=0; i<=ranges.size(); i++) {
+            uint64_t next = i < ranges.size() ? ranges[i].first : size;
+            if (next > pos && pos < oldSize) punchHole(fd, pos, std::min(next, oldSize) - pos);
+            if (i < ranges.size()) pos = ranges[i].first + ranges[i].second;
+        }
+    }
+
+    _copiedBytes = 0;
+    {
+        OrbisFSWorkPool pool(_threads);
+        std::vector<std::vector<uint8_t>> buffers(pool.threads());
+        for (auto &r : ranges) {
+            for (uint64_t offset = r.first; offset < r.first + r.second; offset += DUMP_CHUNK_SIZE) {
+                size_t len = (size_t)std::min<uint64_t>(DUMP_CHUNK_SIZE, r.first + r.second - offset);
+                pool.push([this,&buffers,fd,offset,len](unsigned worker){
+                    OrbisFSTrace::Span span("dump.chunk", "len", len);
+                    std::vector<uint8_t> &buf = buffers[worker];
+                    if (buf.size() < len) buf.resize(DUMP_CHUNK_SIZE);
+                    _img->readRaw(offset, buf.data(), len);
+                    pwriteAll(fd, buf.data(), len, offset);
+                    _copiedBytes += len;
+                });
+            }
+        }
+        pool.wait();
+        retassure(!pool.failedTasks(), "Failed to copy %llu chunks",pool.failedTasks());
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Dumped %llu MiB in %.3f sec (%.1f MiB/s)",_copiedBytes.load() >> 20,secs,(_copiedBytes.load() / (1024.0*1024.0)) / secs);
+}
+
+void OrbisFSDumper::dumpCompressed(const char *outPath, uint32_t frameBlocks, int level){
+#ifndef HAVE_ZSTD
+    reterror("Compressed dumps need zstd support, which this build doesn't have");
+#else
+    retassure(frameBlocks && frameBlocks <= DUMP_MAX_FRAME_BLOCKS, "Frames need to have between 1 and %d blocks",DUMP_MAX_FRAME_BLOCKS);
+    auto tstart = std::chrono::steady_clock::now();
+    const uint64_t size = _img->_memsize;
+    const uint64_t frameSize = (uint64_t)frameBlocks * _img->getBlocksize();
+    const size_t framesCnt = (size_t)((size + frameSize - 1) / frameSize);
+    int fd = -1;
+    ZSTD_CCtx *zeroCctx = NULL;
+    std::vector<ZSTD_CCtx*> cctxs;
+    cleanup([&]{
+        for (auto c : cctxs) ZSTD_freeCCtx(c);
+        safeFreeCustom(zeroCctx, ZSTD_freeCCtx);
+        safeClose(fd);
+    });
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = usedRanges();
+    uint64_t usedBytes = 0;
+    for (auto &r : ranges) usedBytes += r.second;
+    info("Compressing %llu MiB used of %llu MiB into %zu frames of %llu KiB to '%s'",usedBytes >> 20,size >> 20,framesCnt,frameSize >> 10,outPath);
+
+    retassure((fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to open '%s' errno=%d (%s)",outPath,errno,strerror(errno));
+
+    struct Slot {
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> out;
+        size_t outSize;
+        bool zero;
+        bool done;
+        std::string error;
+    };
+
+    std::vector<Slot> slots;
+    std::mutex slotsLock;
+    std::condition_variable slotsCond;
+
+    /*
+        Queued frames write into the slots, so the pool needs to be destroyed (and drained) before them
+     */
+    OrbisFSWorkPool pool(_threads);
+    const size_t window = pool.threads() * DUMP_FRAMES_PER_WORKER;
+    slots.resize(window);
+    cctxs.resize(pool.threads(), NULL);
+
+    size_t rangeIdx = 0;
+    auto submit = [&](size_t frame){
+        Slot &s = slots[frame % window];
+        const uint64_t start = frame * frameSize;
+        const uint64_t len = std::min(frameSize, size - start);
+
+        /*
+            Pieces of used ranges inside this frame, relative to its start
+         */
+        std::vector<std::pair<uint64_t, uint64_t>> pieces;
+        while (rangeIdx < ranges.size() && ranges[rangeIdx].first + ranges[rangeIdx].second <= start) rangeIdx++;
+        for (size_t i = rangeIdx; i < ranges.size() && ranges[i].first < start + len; i++) {
+            uint64_t pStart = std::max(ranges[i].first, start);
+            uint64_t pEnd = std::min(ranges[i].first + ranges[i].second, start + len);
+            pieces.push_back({pStart - start, pEnd - pStart});
+        }
+
+        {
+            std::unique_lock<std::mutex> ul(slotsLock);
+            s.zero = !pieces.size();
+            s.done = s.zero;
+            s.error.clear();
+        }
+        if (s.zero) return;
+
+        Slot *slot = &s;
+        pool.push([this,slot,frame,start,len,pieces,frameSize,level,&cctxs,&slotsLock,&slotsCond](unsigned worker){
+            Slot &s = *slot;
+            try {
+                OrbisFSTrace::Span span("dump.compressFrame", "frame", frame);
+                if (!cctxs[worker]) cctxs[worker] = createCompressContext(level);
+                if (s.in.size() < len) s.in.resize(frameSize);
+                uint64_t pos = 0;
+                for (auto &p : pieces) {
+                    memset(&s.in[pos], 0, p.first - pos);
+                    _img->readRaw(start + p.first, &s.in[p.first], p.second);
+                    pos = p.first + p.second;
+                }
+                memset(&s.in[pos], 0, len - pos);
+                s.outSize = compressFrame(cctxs[worker], s.in.data(), len, s.out);
+            } catch (tihmstar::exception &e) {
+                s.error = e.what();
+            } catch (std::exception &e) {
+                s.error = e.what();
+            } catch (...) {
+                s.error = "Unknown error";
+            }
+            {
+                std::unique_lock<std::mutex> ul(slotsLock);
+                s.done = true;
+            }
+            slotsCond.notify_all();
+        });
+    };
+
+    std::map<uint64_t, std::vector<uint8_t>> zeroFrames; //by decompressed length, only the last frame may be shorter
+    std::vector<std::pair<uint32_t, uint32_t>> table;
+    table.reserve(framesCnt);
+    uint64_t outOffset = 0;
+    size_t submitted = 0;
+    size_t zeroFramesCnt = 0;
+    for (size_t frame = 0; frame < framesCnt; frame++) {
+        while (submitted < framesCnt && submitted < frame + window) submit(submitted++);
+        Slot &s = slots[frame % window];
+        {
+            std::unique_lock<std::mutex> ul(slotsLock);
+            slotsCond.wait(ul, [&]{return s.done;});
+        }
+        retassure(!s.error.size(), "Failed to compress frame %zu: %s",frame,s.error.c_str());
+        const uint64_t len = std::min(frameSize, size - frame * frameSize);
+        const uint8_t *data = s.out.data();
+        size_t dataLen = s.outSize;
+        if (s.zero) {
+            std::vector<uint8_t> &z = zeroFrames[len];
+            if (!z.size()) {
+                if (!zeroCctx) zeroCctx = createCompressContext(level);
+                std::vector<uint8_t> zeros(len);
+                z.resize(compressFrame(zeroCctx, zeros.data(), len, z));
+            }
+            data = z.data();
+            dataLen = z.size();
+            zeroFramesCnt++;
+        }
+        pwriteAll(fd, data, dataLen, outOffset);
+        outOffset += dataLen;
+        table.push_back({(uint32_t)dataLen, (uint32_t)len});
+    }
+    pool.wait();
+
+    /*
+        Seek table in a skippable frame, plain zstd tools just skip it
+     */
+    {
+        std::vector<uint8_t> seekTable;
+        seekTable.reserve(8 + table.size()*8 + ZSTD_SEEKABLE_FOOTER_SIZE);
+        putLE32(seekTable, ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+        putLE32(seekTable, (uint32_t)(table.size()*8 + ZSTD_SEEKABLE_FOOTER_SIZE));
+        for (auto &e : table) {
+            putLE32(seekTable, e.first);
+            putLE32(seekTable, e.second);
+        }
+        putLE32(seekTable, (uint32_t)table.size());
+        seekTable.push_back(0); //no per frame checksums, the frames carry their own
+        putLE32(seekTable, ZSTD_SEEKABLE_MAGIC);
+        pwriteAll(fd, seekTable.data(), seekTable.size(), outOffset);
+        outOffset += seekTable.size();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Compressed %llu MiB to %llu MiB (%zu frames, %zu without used blocks) in %.3f sec (%.1f MiB/s) using %u threads",
+         size >> 20,outOffset >> 20,framesCnt,zeroFramesCnt,secs,(usedBytes / (1024.0*1024.0)) / secs,pool.threads());
+#endif //HAVE_ZSTD
+}
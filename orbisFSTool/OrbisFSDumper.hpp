@@ -0,0 +1,54 @@
+//
+//  OrbisFSDumper.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSDumper_hpp
+#define OrbisFSDumper_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Copies an image, reading only the blocks the allocator bitmaps mark as used.
+    Everything past the range covered by the bitmaps is treated as used, unused blocks read back as zeros.
+ */
+class OrbisFSDumper {
+    OrbisFSImage *_img; //not owned
+    unsigned _threads;
+
+    std::atomic<uint64_t> _copiedBytes;
+
+    /*
+        {offset, len} in bytes, ascending
+     */
+    std::vector<std::pair<uint64_t, uint64_t>> usedRanges();
+public:
+    OrbisFSDumper(OrbisFSImage *img, unsigned threads = 0);
+
+    /*
+        Writes a sparse image of the same size to outPath, used blocks end up at the same offsets.
+        Unused ranges are holes, an existing outPath gets them punched out.
+     */
+    void dumpSparse(const char *outPath);
+
+    /*
+        Writes a seekable zstd dump (see OrbisFSSeekableZstd) with one frame per frameBlocks blocks.
+        Frames are compressed on all workers and written in order. Frames without used blocks
+        are never read, they all share one precompressed zero frame.
+     */
+    void dumpCompressed(const char *outPath, uint32_t frameBlocks = 16, int level = 3);
+};
+
+}
+#endif /* OrbisFSDumper_hpp */
@@ -0,0 +1,446 @@
+//
+//  OrbisFSExtractor.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSExtractor.hpp"
+#include "OrbisFSTrace.hpp"
+#include "utils.hpp"
+#include "OrbisFSWorkPool.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define EXTRACT_BUFFER_SIZE (1024*1024)
+#define PHYSICAL_RUN_MAX_SIZE (8*1024*1024)
+#define PHYSICAL_RUN_MAX_GAP (256*1024)  //reading over a small gap is cheaper than seeking
+#define PHYSICAL_RUNS_IN_FLIGHT 4
+
+using namespace orbisFSTool;
+
+static void timesForNode(const OrbisFSInode_t &node, struct timespec times[2]){
+    times[0].tv_sec = (time_t)node.accessDate;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = (time_t)node.modDate;
+    times[1].tv_nsec = 0;
+}
+
+namespace {
+/*
+    An extracted directory, kept open while tasks create entries inside of it.
+    Mode and times are applied once the last task let go, otherwise creating children would change them again.
+ */
+struct OutDir {
+    int fd;
+    OrbisFSInode_t node;
+    
+    OutDir(int fd_, const OrbisFSInode_t &node_) : fd(fd_), node(node_) {}
+    ~OutDir(){
+        struct timespec times[2];
+        timesForNode(node, times);
+        fchmod(fd, node.fileMode & 07777);
+        futimens(fd, times);
+        close(fd);
+    }
+};
+
+/*
+    A piece of a file at a physical location in the image
+ */
+struct PhysicalPiece {
+    uint64_t physOffset;
+    uint64_t len;
+    uint64_t fileOffset;
+    uint32_t file;
+};
+
+struct PhysicalFile {
+    std::string relPath;
+    OrbisFSInode_t node;
+    uint64_t remainingPieces;
+    int fd;
+};
+
+/*
+    A contiguous range of the image, read in one go, with the pieces that fall into it
+ */
+struct PhysicalRun {
+    uint64_t physOffset;
+    std::vector<uint8_t> data;
+    std::vector<PhysicalPiece> pieces;
+};
+}
+
+static bool isSafeName(const std::string &name){
+    return name.size() && name != "." && name != ".." && name.find('/') == std::string::npos;
+}
+
+static void raiseOpenFileLimit(){
+    /*
+        Every directory or file with pending work holds an fd, allow as many as we can get
+     */
+    struct rlimit rl = {};
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int openOutputDir(const char *outPath){
+    int fd = -1;
+    if (mkdir(outPath, 0700) && errno != EEXIST) {
+        reterror("Failed to create output directory '%s' errno=%d (%s)",outPath,errno,strerror(errno));
+    }
+    retassure((fd = open(outPath, O_RDONLY | O_DIRECTORY)) != -1, "Failed to open output directory '%s' errno=%d (%s)",outPath,errno,strerror(errno));
+    return fd;
+}
+
+#pragma mark OrbisFSExtractor
+OrbisFSExtractor::OrbisFSExtractor(OrbisFSImage *img, unsigned threads)
+: _img(img)
+, _threads(threads)
+, _files{0}, _dirs{0}, _bytes{0}, _failed{0}
+{
+    retassure(_img, "No image given");
+}
+
+#pragma mark OrbisFSExtractor private
+void OrbisFSExtractor::extractFileAt(int dirfd, const std::string &name, const OrbisFSInode_t &node, uint8_t *buf, size_t bufSize){
+    OrbisFSTrace::Span span("extract.file", "inode", node.inodeNum);
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    
+    retassure((fd = openat(dirfd, name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600)) != -1, "Failed to create '%s' errno=%d (%s)",name.c_str(),errno,strerror(errno));
+    
+    auto f = _img->openFileID(node.inodeNum);
+    uint64_t size = f->size();
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t fill = 0;
+        size_t didRead = 0;
+        while (fill < bufSize && (didRead = f->pread(buf+fill, bufSize-fill, offset+fill))) {
+            fill += didRead;
+        }
+        retassure(fill, "Failed to read '%s' at offset 0x%llx",name.c_str(),offset);
+        writeAll(fd, buf, fill);
+        offset += fill;
+    }
+    
+    {
+        struct timespec times[2];
+        timesForNode(node, times);
+        retassure(!fchmod(fd, node.fileMode & 07777), "Failed to set mode of '%s'",name.c_str());
+        retassure(!futimens(fd, times), "Failed to set times of '%s'",name.c_str());
+    }
+    _files++;
+    _bytes += size;
+}
+
+#pragma mark OrbisFSExtractor public
+void OrbisFSExtractor::extractTree(std::string path, const char *outPath){
+    OrbisFSInode_t root = _img->getInodeForPath(path);
+    retassure(S_ISDIR(root.fileMode), "'%s' is not a directory",path.c_str());
+    
+    raiseOpenFileLimit();
+    int rootfd = openOutputDir(outPath);
+    
+    OrbisFSWorkPool pool(_threads);
+    std::vector<std::vector<uint8_t>> buffers(pool.threads());
+    std::function<void(std::shared_ptr<OutDir> dir)> processDir;
+    auto tstart = std::chrono::steady_clock::now();
+    
+    processDir = [&](std::shared_ptr<OutDir> dir){
+        auto children = _img->listFilesInFolder(dir->node.inodeNum);
+        
+        /*
+            Create all subdirectories of this level in one go, their contents get queued as separate tasks
+         */
+        for (auto &c : children) {
+            const std::string name = c.first;
+            const OrbisFSInode_t node = c.second;
+            if (!isSafeName(name)) {
+                error("Skipping entry with invalid name '%s'",name.c_str());
+                _failed++;
+                continue;
+            }
+            
+            if (S_ISDIR(node.fileMode)) {
+                if (mkdirat(dir->fd, name.c_str(), 0700) && errno != EEXIST) {
+                    error("Failed to create directory '%s' errno=%d (%s)",name.c_str(),errno,strerror(errno));
+                    _failed++;
+                    continue;
+                }
+                _dirs++;
+                pool.push([&processDir,dir,name,node,this](unsigned worker){
+                    int fd = -1;
+                    retassure((fd = openat(dir->fd, name.c_str(), O_RDONLY | O_DIRECTORY)) != -1, "Failed to open directory '%s' errno=%d (%s)",name.c_str(),errno,strerror(errno));
+                    processDir(std::make_shared<OutDir>(fd, node));
+                });
+            }else if (S_ISREG(node.fileMode)) {
+                pool.push([&buffers,dir,name,node,this](unsigned worker){
+                    std::vector<uint8_t> &buf = buffers[worker];
+                    if (!buf.size()) buf.resize(EXTRACT_BUFFER_SIZE);
+                    extractFileAt(dir->fd, name, node, buf.data(), buf.size());
+                });
+            }else{
+                error("Skipping '%s' with unsupported file mode 0%o",name.c_str(),node.fileMode);
+                _failed++;
+            }
+        }
+    };
+    
+    _dirs++;
+    {
+        std::shared_ptr<OutDir> rootDir = std::make_shared<OutDir>(rootfd, root);
+        pool.push([&processDir,rootDir](unsigned worker){
+            processDir(rootDir);
+        });
+    }
+    pool.wait();
+    
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Extracted %llu files and %llu directories (%llu bytes) in %.3f sec using %u threads (%.2f MB/s, %.0f files/s)",
+         _files.load(), _dirs.load(), _bytes.load(), secs, pool.threads(), _bytes/secs/1e6, _files/secs);
+    _failed += pool.failedTasks();
+    retassure(!_failed, "Failed to extract %llu entries",_failed.load());
+}
+
+void OrbisFSExtractor::extractTreePhysicalOrder(std::string path, const char *outPath){
+    OrbisFSInode_t root = _img->getInodeForPath(path);
+    retassure(S_ISDIR(root.fileMode), "'%s' is not a directory",path.c_str());
+    
+    int rootfd = -1;
+    std::vector<PhysicalFile> files;
+    std::vector<std::pair<std::string, OrbisFSInode_t>> dirs;
+    std::vector<PhysicalPiece> pieces;
+    cleanup([&]{
+        for (auto &f : files) {
+            safeClose(f.fd);
+        }
+        safeClose(rootfd);
+    });
+    
+    raiseOpenFileLimit();
+    rootfd = openOutputDir(outPath);
+    auto tstart = std::chrono::steady_clock::now();
+    
+    auto finishFile = [&](PhysicalFile &f){
+        struct timespec times[2];
+        timesForNode(f.node, times);
+        retassure(!fchmod(f.fd, f.node.fileMode & 07777), "Failed to set mode of '%s'",f.relPath.c_str());
+        retassure(!futimens(f.fd, times), "Failed to set times of '%s'",f.relPath.c_str());
+        safeClose(f.fd);
+        _files++;
+        _bytes += f.node.filesize;
+    };
+    
+    /*
+        Pass 1: create the directory tree and collect where the data of every file lives
+     */
+    {
+        std::string prefix = path;
+        if (prefix.back() != '/') prefix += '/';
+        _dirs++;
+        _img->iterateOverFilesInFolder(path, true, [&](std::string curPath, OrbisFSInode_t node){
+            if (curPath.size() > 1 && curPath.back() == '/') curPath.pop_back();
+            if (curPath.size() <= prefix.size()) return; //that's the root we are extracting to
+            std::string relPath = curPath.substr(prefix.size());
+            
+            for (size_t pos = 0, next = 0; pos <= relPath.size(); pos = next+1) {
+                next = relPath.find('/', pos);
+                if (next == std::string::npos) next = relPath.size();
+                if (!isSafeName(relPath.substr(pos, next-pos))) {
+                    error("Skipping entry with invalid path '%s'",relPath.c_str());
+                    _failed++;
+                    return;
+                }
+            }
+            
+            if (S_ISDIR(node.fileMode)) {
+                if (mkdirat(rootfd, relPath.c_str(), 0700) && errno != EEXIST) {
+                    error("Failed to create directory '%s' errno=%d (%s)",relPath.c_str(),errno,strerror(errno));
+                    _failed++;
+                    return;
+                }
+                dirs.push_back({relPath, node});
+                _dirs++;
+            }else if (S_ISREG(node.fileMode)) {
+                uint32_t fileIdx = (uint32_t)files.size();
+                files.push_back({relPath, node, 0, -1});
+                if (!node.filesize) {
+                    PhysicalFile &f = files.back();
+                    retassure((f.fd = openat(rootfd, relPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600)) != -1, "Failed to create '%s' errno=%d (%s)",relPath.c_str(),errno,strerror(errno));
+                    finishFile(f);
+                    return;
+                }
+                uint64_t fileOffset = 0;
+                for (auto &e : _img->openFileID(node.inodeNum)->getPhysicalExtents(0, node.filesize)) {
+                    /*
+                        Split huge extents, so no single piece exceeds a run
+                     */
+                    for (uint64_t off = 0; off < e.second; off += PHYSICAL_RUN_MAX_SIZE) {
+                        uint64_t len = std::min<uint64_t>(e.second - off, PHYSICAL_RUN_MAX_SIZE);
+                        pieces.push_back({e.first + off, len, fileOffset, fileIdx});
+                        fileOffset += len;
+                        files[fileIdx].remainingPieces++;
+                    }
+                }
+            }else{
+                error("Skipping '%s' with unsupported file mode 0%o",relPath.c_str(),node.fileMode);
+                _failed++;
+            }
+        });
+    }
+    
+    std::sort(pieces.begin(), pieces.end(), [](const PhysicalPiece &a, const PhysicalPiece &b){
+        return a.physOffset < b.physOffset;
+    });
+    
+    /*
+        Pass 2: read the image in ascending order, while a second thread writes out the pieces
+     */
+    std::mutex runLock;
+    std::condition_variable runCond;
+    std::deque<std::unique_ptr<PhysicalRun>> fullRuns;
+    std::vector<std::unique_ptr<PhysicalRun>> freeRuns;
+    bool readerDone = false;
+    uint64_t reads = 0;
+    uint64_t readBytes = 0;
+    
+    {
+        std::thread writer([&]{
+            while (true) {
+                std::unique_ptr<PhysicalRun> run;
+                {
+                    std::unique_lock<std::mutex> ul(runLock);
+                    while (!fullRuns.size() && !readerDone) runCond.wait(ul);
+                    if (!fullRuns.size()) break;
+                    run = std::move(fullRuns.front());
+                    fullRuns.pop_front();
+                }
+                runCond.notify_all();
+            
+                for (auto &p : run->pieces) {
+                    PhysicalFile &f = files[p.file];
+                    if (!f.remainingPieces) continue; //file failed earlier
+                    try {
+                        if (f.fd == -1) {
+                            retassure((f.fd = openat(rootfd, f.relPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600)) != -1, "Failed to create '%s' errno=%d (%s)",f.relPath.c_str(),errno,strerror(errno));
+                        }
+                        const uint8_t *data = &run->data[p.physOffset - run->physOffset];
+                        pwriteAll(f.fd, data, p.len, p.fileOffset);
+                        if (--f.remainingPieces == 0) finishFile(f);
+                    } catch (tihmstar::exception &e) {
+                        e.dump();
+                        f.remainingPieces = 0;
+                        _failed++;
+                    }
+                }
+            
+                {
+                    std::unique_lock<std::mutex> ul(runLock);
+                    freeRuns.push_back(std::move(run));
+                }
+            }
+        });
+        cleanup([&]{
+            {
+                std::unique_lock<std::mutex> ul(runLock);
+                readerDone = true;
+            }
+            runCond.notify_all();
+            if (writer.joinable()) writer.join();
+        });
+    
+        {
+    #ifdef POSIX_FADV_SEQUENTIAL
+            if (_img->getFd() != -1) posix_fadvise(_img->getFd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+            for (size_t i=0; i<pieces.size();) {
+                std::unique_ptr<PhysicalRun> run;
+                {
+                    std::unique_lock<std::mutex> ul(runLock);
+                    while (fullRuns.size() >= PHYSICAL_RUNS_IN_FLIGHT) runCond.wait(ul);
+                    if (freeRuns.size()) {
+                        run = std::move(freeRuns.back());
+                        freeRuns.pop_back();
+                    }
+                }
+                if (!run) run.reset(new PhysicalRun);
+                run->pieces.clear();
+            
+                /*
+                    Grow the run while the next piece is close enough behind it
+                 */
+                run->physOffset = pieces[i].physOffset;
+                uint64_t runEnd = run->physOffset;
+                while (i < pieces.size()) {
+                    const PhysicalPiece &p = pieces[i];
+                    uint64_t pieceEnd = p.physOffset + p.len;
+                    if (run->pieces.size()) {
+                        if (p.physOffset > runEnd + PHYSICAL_RUN_MAX_GAP) break;
+                        if (std::max(runEnd, pieceEnd) - run->physOffset > PHYSICAL_RUN_MAX_SIZE) break;
+                    }
+                    run->pieces.push_back(p);
+                    if (pieceEnd > runEnd) runEnd = pieceEnd;
+                    i++;
+                }
+            
+                run->data.resize(runEnd - run->physOffset);
+                {
+                    OrbisFSTrace::Span span("extract.readRun", "len", run->data.size());
+                    _img->readRaw(run->physOffset, run->data.data(), run->data.size());
+                }
+                reads++;
+                readBytes += run->data.size();
+            
+                {
+                    std::unique_lock<std::mutex> ul(runLock);
+                    fullRuns.push_back(std::move(run));
+                }
+                runCond.notify_all();
+            }
+        }
+    }
+    
+    /*
+        Directories get their mode and times last, deepest first
+     */
+    for (auto d = dirs.rbegin(); d != dirs.rend(); ++d) {
+        struct timespec times[2];
+        timesForNode(d->second, times);
+        fchmodat(rootfd, d->first.c_str(), d->second.fileMode & 07777, 0);
+        utimensat(rootfd, d->first.c_str(), times, 0);
+    }
+    {
+        struct timespec times[2];
+        timesForNode(root, times);
+        fchmod(rootfd, root.fileMode & 07777);
+        futimens(rootfd, times);
+    }
+    
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Extracted %llu files and %llu directories (%llu bytes) in %.3f sec using %llu ascending reads of %.1f KiB on average (%.2f MB/s, %.0f files/s)",
+         _files.load(), _dirs.load(), _bytes.load(), secs, reads, reads ? readBytes/1024.0/reads : 0.0, _bytes/secs/1e6, _files/secs);
+    retassure(!_failed, "Failed to extract %llu entries",_failed.load());
+}
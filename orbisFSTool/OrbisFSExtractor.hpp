@@ -0,0 +1,52 @@
+//
+//  OrbisFSExtractor.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSExtractor_hpp
+#define OrbisFSExtractor_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Recreates a directory tree of the image on the host.
+    Directories are walked and files are written by a work-stealing pool,
+    everything is created relative to directory fds so no path is ever resolved twice.
+ */
+class OrbisFSExtractor {
+    OrbisFSImage *_img; //not owned
+    unsigned _threads;
+    
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _dirs;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _failed;
+    
+    void extractFileAt(int dirfd, const std::string &name, const OrbisFSInode_t &node, uint8_t *buf, size_t bufSize);
+public:
+    OrbisFSExtractor(OrbisFSImage *img, unsigned threads = 0);
+    
+    /*
+        Extracts the directory at path (inside the image) to outPath, creating outPath if needed
+     */
+    void extractTree(std::string path, const char *outPath);
+    
+    /*
+        Same result as extractTree, but collects the physical extents of all files first
+        and reads them in ascending order, which keeps rotational disks streaming
+     */
+    void extractTreePhysicalOrder(std::string path, const char *outPath);
+};
+
+}
+#endif /* OrbisFSExtractor_hpp */
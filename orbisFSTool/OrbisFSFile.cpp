@@ -8,16 +8,45 @@
 #include "OrbisFSFile.hpp"
 #include "OrbisFSException.hpp"
 #include "OrbisFSImage.hpp"
+#include "OrbisFSStats.hpp"
+#include "OrbisFSTrace.hpp"
 #include "utils.hpp"
 
 #include <libgeneral/macros.h>
 
+#include <mutex>
+
 #include <sys/stat.h>
+#include <string.h>
+#include <time.h>
 
 #define ARRAYOF(a) (sizeof(a)/sizeof(*a))
 
 using namespace orbisFSTool;
 
+#pragma mark helpers
+static uint32_t fatStagesForBlocks(uint64_t blocks, uint64_t linkElemsPerPage){
+    uint64_t capacity = sizeof(OrbisFSInode_t::dataLnk)/sizeof(OrbisFSChainLink_t);
+    for (uint32_t stages = 1; stages < 4; stages++) {
+        if (blocks <= capacity) return stages;
+        capacity *= linkElemsPerPage;
+    }
+    reterror("%llu blocks would need more than 3 fat stages",blocks);
+}
+
+static uint64_t fatBlocksForBlocks(uint64_t blocks, uint32_t stages, uint64_t linkElemsPerPage){
+    /*
+        Every stage below the inode needs one fat block per linkElemsPerPage entries of the stage beneath it
+     */
+    uint64_t ret = 0;
+    uint64_t perFat = 1;
+    for (uint32_t i=1; i<stages; i++) {
+        perFat *= linkElemsPerPage;
+        ret += (blocks + perFat-1)/perFat;
+    }
+    return ret;
+}
+
 #pragma mark OrbisFSFile
 OrbisFSFile::OrbisFSFile(OrbisFSImage *parent, OrbisFSInode_t *node, bool noFilemodeChecks)
 : _parent(parent)
@@ -26,39 +55,58 @@ OrbisFSFile::OrbisFSFile(OrbisFSImage *parent, OrbisFSInode_t *node, bool noFile
 , _offset(0)
 {
     retassure(noFilemodeChecks || S_ISREG(node->fileMode), "Can't open node %d, which not a regular file",_node->inodeNum);
-    {
-        /*
-            Notify parent, that we exist now
-         */
-        std::unique_lock<std::mutex> ul(_parent->_referencesLck);
-        ++_parent->_references;
-    }
+    /*
+        Notify parent, that we exist now
+     */
+    _parent->_references.fetch_add(1, std::memory_order_relaxed);
 }
 
 OrbisFSFile::~OrbisFSFile(){
-    {
-        /*
-            Tell parent we are leaving
-         */
-        std::unique_lock<std::mutex> ul(_parent->_referencesLck);
-        --_parent->_references;
+    /*
+        Tell parent we are leaving, it only cares once everybody left
+     */
+    if (_parent->_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
         _parent->_unrefEvent.notifyAll();
     }
 }
 
+#pragma mark helper
+namespace {
+/*
+    Holds the FAT lock of an image for the current scope, does nothing for NULL
+ */
+class FatLockGuard {
+    pthread_rwlock_t *_lock;
+public:
+    FatLockGuard(pthread_rwlock_t *lock, bool exclusive) : _lock(lock){
+        if (!_lock) return;
+        if (exclusive) {
+            pthread_rwlock_wrlock(_lock);
+        }else{
+            pthread_rwlock_rdlock(_lock);
+        }
+    }
+    ~FatLockGuard(){
+        if (_lock) pthread_rwlock_unlock(_lock);
+    }
+};
+}
+
 #pragma mark OrbisFSFile private
-uint8_t *OrbisFSFile::getDataBlock(uint64_t num){
+uint32_t OrbisFSFile::getDataBlockNum(uint64_t num){
     retassure(_node->fatStages, "File has no data");
     const uint32_t linkElemsPerPage = _blockSize/sizeof(OrbisFSChainLink_t);
+    OrbisFSStats::record(OrbisFSStats::kOpFatWalk, _node->fatStages);
 
     retassure(_node->dataLnk[0].type == ORBIS_FS_CHAINLINK_TYPE_LINK, "bad dataLnk type 0x%02x",_node->dataLnk[0].type);
     if (_node->fatStages == 1){
         retassure(num < ARRAYOF(_node->dataLnk), "1 level stage lookup out of bounds");
         retassure(_node->dataLnk[num].type == ORBIS_FS_CHAINLINK_TYPE_LINK, "bad dataLnk type 0x%02x",_node->dataLnk[num].type);
-        return _parent->getBlock(_node->dataLnk[num].blk);
+        return _node->dataLnk[num].blk;
     }
     
     OrbisFSChainLink_t *fat = NULL;
+    uint32_t blk = 0;
     for (int i=_node->fatStages-1; i>=0; i--) {
         uint64_t elemsInThisStage = 1;
         for (int z=0; z<i; z++) elemsInThisStage *= linkElemsPerPage;
@@ -69,16 +117,21 @@ uint8_t *OrbisFSFile::getDataBlock(uint64_t num){
             //this is the first level lookup
             retassure(curIdx < ARRAYOF(_node->dataLnk), "1 level lookup out of bounds");
             retassure(_node->dataLnk[curIdx].type == ORBIS_FS_CHAINLINK_TYPE_LINK, "bad dataLnk type 0x%02x",_node->dataLnk[curIdx].type);
-            fat = (OrbisFSChainLink_t*)_parent->getBlock(_node->dataLnk[curIdx].blk);
+            blk = _node->dataLnk[curIdx].blk;
         }else{
             //this is further level lookup
             retassure(curIdx < linkElemsPerPage, "Trying to access out of bounds block on stage %d lookup",_node->fatStages-(i-1));
             fat = &fat[curIdx];
             retassure(fat->type == ORBIS_FS_CHAINLINK_TYPE_LINK, "bad fat type 0x%02x",fat->type);
-            fat = (OrbisFSChainLink_t*)_parent->getBlock(fat->blk);
+            blk = fat->blk;
         }
+        if (i) fat = (OrbisFSChainLink_t*)_parent->getBlock(blk);
     }
-    return (uint8_t*)fat;
+    return blk;
+}
+
+uint8_t *OrbisFSFile::getDataBlock(uint64_t num){
+    return _parent->getBlock(getDataBlockNum(num));
 }
 
 uint8_t *OrbisFSFile::getDataForOffset(uint64_t offset){
@@ -91,32 +144,38 @@ uint8_t *OrbisFSFile::getDataForOffset(uint64_t offset){
     return &blk[blkOffset];
 }
 
-std::vector<uint32_t> OrbisFSFile::getAllAllocatedBlocks(){
+void OrbisFSFile::iterateOverFatBlocks(OrbisFSChainLink_t *fat, uint32_t elems, uint32_t stage, std::function<void(uint32_t blk)> &callback){
     const uint32_t linkElemsPerPage = _blockSize/sizeof(OrbisFSChainLink_t);
-    std::vector<uint32_t> ret;
-    if (!_node->fatStages){
-        return {};
-    }else if (_node->fatStages == 1) {
-        for (int i=0; i<ARRAYOF(_node->dataLnk); i++) {
-            if (_node->dataLnk[i].type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
-            ret.push_back(_node->dataLnk[i].blk);
+    for (uint32_t i=0; i<elems; i++) {
+        if (fat[i].type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
+        callback(fat[i].blk);
+        if (stage > 1) {
+            /*
+                This link points to another FAT, walk that one too
+             */
+            iterateOverFatBlocks((OrbisFSChainLink_t*)_parent->getBlock(fat[i].blk), linkElemsPerPage, stage-1, callback);
         }
-    }else if (_node->fatStages == 2){
-        reterror("TODO");
+    }
+}
 
-    }else if (_node->fatStages == 3){
-        
-        reterror("TODO");
-    }else{
-        reterror("%d fat stages currently not supported",_node->fatStages);
+void OrbisFSFile::iterateOverAllAllocatedBlocks(std::function<void(uint32_t blk)> callback){
+    if (_node->fatStages) {
+        retassure(_node->fatStages < 4, "%d fat stages currently not supported",_node->fatStages);
+        iterateOverFatBlocks(_node->dataLnk, ARRAYOF(_node->dataLnk), _node->fatStages, callback);
     }
     
     //also count resource blocks
     for (int i=0; i<ARRAYOF(_node->resourceLnk); i++) {
         if (_node->resourceLnk[i].type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
-        ret.push_back(_node->resourceLnk[i].blk);
+        callback(_node->resourceLnk[i].blk);
     }
-    
+}
+
+std::vector<uint32_t> OrbisFSFile::getAllAllocatedBlocks(){
+    std::vector<uint32_t> ret;
+    iterateOverAllAllocatedBlocks([&ret](uint32_t blk){
+        ret.push_back(blk);
+    });
     return ret;
 }
 
@@ -200,8 +259,47 @@ void OrbisFSFile::popLastAllocatedBlock(){
     }
 }
 
+void OrbisFSFile::linkDataBlock(uint64_t num, uint32_t blk, std::function<uint32_t()> &nextBlock){
+    const uint32_t linkElemsPerPage = _blockSize/sizeof(OrbisFSChainLink_t);
+    OrbisFSChainLink_t *fat = NULL;
+    for (int i=_node->fatStages-1; i>=0; i--) {
+        uint64_t elemsInThisStage = 1;
+        for (int z=0; z<i; z++) elemsInThisStage *= linkElemsPerPage;
+        uint32_t curIdx = (uint32_t)(num / elemsInThisStage);
+        num %= elemsInThisStage;
+        
+        OrbisFSChainLink_t *tgt = NULL;
+        if (!fat) {
+            retassure(curIdx < ARRAYOF(_node->dataLnk), "1 level link out of bounds");
+            tgt = &_node->dataLnk[curIdx];
+        }else{
+            retassure(curIdx < linkElemsPerPage, "Trying to link out of bounds block on stage %d",_node->fatStages-(i-1));
+            tgt = &fat[curIdx];
+        }
+        
+        if (!i) {
+            tgt->blk = blk;
+            tgt->type = ORBIS_FS_CHAINLINK_TYPE_LINK;
+            return;
+        }
+        
+        if (tgt->type != ORBIS_FS_CHAINLINK_TYPE_LINK) {
+            /*
+                First block behind this link, it needs a fresh fat
+             */
+            uint32_t fatBlk = nextBlock();
+            memset(_parent->getBlock(fatBlk), 0xFF, _blockSize);
+            tgt->blk = fatBlk;
+            tgt->type = ORBIS_FS_CHAINLINK_TYPE_LINK;
+        }
+        fat = (OrbisFSChainLink_t*)_parent->getBlock(tgt->blk);
+    }
+    reterror("File has no fat stages");
+}
+
 void OrbisFSFile::shrink(uint64_t subBytes){
     retassure(_node->filesize >= subBytes, "trying to shrink more bytes than available");
+    FatLockGuard fl(&_parent->_fatLock, true);
     while (subBytes) {
         uint64_t lastBlockFill = _node->filesize & (_blockSize-1);
         if (!lastBlockFill && _node->filesize >= _blockSize) lastBlockFill = _blockSize;
@@ -216,7 +314,87 @@ void OrbisFSFile::shrink(uint64_t subBytes){
 }
 
 void OrbisFSFile::grow(uint64_t addBytes){
-    reterror("TODO");
+    const uint32_t linkElemsPerPage = _blockSize/sizeof(OrbisFSChainLink_t);
+    const uint64_t oldSize = _node->filesize;
+    const uint64_t newSize = oldSize + addBytes;
+    const uint64_t oldBlocks = (oldSize + _blockSize-1)/_blockSize;
+    const uint64_t newBlocks = (newSize + _blockSize-1)/_blockSize;
+    FatLockGuard fl(&_parent->_fatLock, true);
+    
+    if (uint64_t tailOffset = oldSize & (_blockSize-1)) {
+        /*
+            shrink leaves stale bytes behind the end of file, the grown range must read back as zeros
+         */
+        uint64_t tailLen = _blockSize - tailOffset;
+        if (tailLen > addBytes) tailLen = addBytes;
+        memset(getDataBlock(oldBlocks-1)+tailOffset, 0, tailLen);
+    }
+    
+    if (newBlocks > oldBlocks) {
+        uint32_t oldStages = _node->fatStages;
+        uint32_t newStages = fatStagesForBlocks(newBlocks, linkElemsPerPage);
+        if (newStages < oldStages) newStages = oldStages;
+        uint64_t needBlocks = (newBlocks - oldBlocks)
+                            + fatBlocksForBlocks(newBlocks, newStages, linkElemsPerPage)
+                            - fatBlocksForBlocks(oldBlocks, oldStages, linkElemsPerPage);
+        retassure(needBlocks <= UINT32_MAX, "Trying to grow by too many blocks");
+        
+        /*
+            Allocate data and fat blocks in one go, so the allocator can hand out a contiguous run
+         */
+        std::vector<uint32_t> blocks = _parent->allocateBlocks((uint32_t)needBlocks);
+        size_t usedBlocks = 0;
+        std::function<uint32_t()> nextBlock = [&]()->uint32_t{
+            retassure(usedBlocks < blocks.size(), "Ran out of preallocated blocks");
+            return blocks[usedBlocks++];
+        };
+        
+        if (!_node->fatStages) {
+            memset(_node->dataLnk, 0xFF, sizeof(_node->dataLnk));
+            _node->fatStages = 1;
+        }
+        while (_node->fatStages < newStages) {
+            /*
+                Move the links of the inode down into a new fat, which becomes the first link
+             */
+            uint32_t fatBlk = nextBlock();
+            uint8_t *fat = _parent->getBlock(fatBlk);
+            memset(fat, 0xFF, _blockSize);
+            memcpy(fat, _node->dataLnk, sizeof(_node->dataLnk));
+            memset(_node->dataLnk, 0xFF, sizeof(_node->dataLnk));
+            _node->dataLnk[0].blk = fatBlk;
+            _node->dataLnk[0].type = ORBIS_FS_CHAINLINK_TYPE_LINK;
+            _node->fatStages++;
+        }
+        
+        for (uint64_t i=oldBlocks; i<newBlocks; i++) {
+            uint32_t blk = nextBlock();
+            memset(_parent->getBlock(blk), 0, _blockSize);
+            linkDataBlock(i, blk, nextBlock);
+        }
+        retassure(usedBlocks == blocks.size(), "Allocated %zu blocks, but only used %zu",blocks.size(),usedBlocks);
+        _node->usedBlocks += (uint32_t)blocks.size();
+    }
+    _node->filesize = newSize;
+}
+
+size_t OrbisFSFile::writeData(const void *buf, size_t len, uint64_t offset){
+    retassure(offset + len <= _node->filesize, "trying to write data beyond filesize");
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t didWrite = 0;
+    while (didWrite < len) {
+        uint64_t blkOffset = (offset+didWrite) & (_blockSize-1); //always a power of 2
+        size_t curLen = _blockSize - blkOffset;
+        if (curLen > len-didWrite) curLen = len-didWrite;
+        memcpy(getDataForOffset(offset+didWrite), &src[didWrite], curLen);
+        didWrite += curLen;
+    }
+    return didWrite;
+}
+
+void OrbisFSFile::markModified(){
+    _node->modCnt++;
+    _node->modDate = time(NULL);
 }
 
 #pragma mark OrbisFSFile public
@@ -238,28 +416,101 @@ size_t OrbisFSFile::write(const void *buf, size_t len){
 }
 
 size_t OrbisFSFile::pread(void *buf, size_t len, uint64_t offset){
-    if (_offset >= _node->filesize) return 0;
-    if (_offset + len >= _node->filesize) len = _node->filesize-_offset;
+    OrbisFSTrace::Span span("file.read", "len", len);
+    /*
+        Read-only images never change their FATs, writeable ones may be growing or shrinking this file on another thread
+     */
+    FatLockGuard fl(_parent->isWriteable() ? &_parent->_fatLock : NULL, false);
+    if (offset >= _node->filesize) return 0;
+    if (offset + len >= _node->filesize) len = _node->filesize-offset;
         
     uint32_t dataBlock = (uint32_t)(offset/_blockSize);
     offset &= (_blockSize-1); //always a power of 2
     
     if (offset + len > _blockSize) len = _blockSize-offset;
     
-    uint8_t *block = getDataBlock(dataBlock);
-    memcpy(buf, &block[offset], len);
+    /*
+        Data goes through iterateOverRaw, so compressed images don't keep file contents decompressed
+     */
+    uint8_t *dst = (uint8_t*)buf;
+    _parent->iterateOverRaw((uint64_t)getDataBlockNum(dataBlock) * _blockSize + offset, len, [&](const void *data, size_t curLen){
+        memcpy(dst, data, curLen);
+        dst += curLen;
+    });
     return len;
 }
 
 size_t OrbisFSFile::pwrite(const void *buf, size_t len, uint64_t offset){
-    reterror("TODO");
+    retassure(_parent->isWriteable(), "Image is not writeable");
+    if (!len) return 0;
+    std::unique_lock<std::mutex> ul(_parent->_writeLock);
+    if (offset + len > _node->filesize) grow(offset + len - _node->filesize);
+    size_t didWrite = writeData(buf, len, offset);
+    markModified();
+    return didWrite;
 }
 
 void OrbisFSFile::resize(uint64_t size){
+    retassure(_parent->isWriteable(), "Image is not writeable");
+    std::unique_lock<std::mutex> ul(_parent->_writeLock);
     if (size < _node->filesize) {
         shrink(_node->filesize-size);
     }else if (size > _node->filesize){
         grow(size-_node->filesize);
+    }else{
+        return;
+    }
+    markModified();
+}
+
+void OrbisFSFile::pwriteRanges(const std::map<uint64_t, std::vector<uint8_t>> &ranges){
+    if (!ranges.size()) return;
+    retassure(_parent->isWriteable(), "Image is not writeable");
+    std::unique_lock<std::mutex> ul(_parent->_writeLock);
+    uint64_t end = 0;
+    for (auto &r : ranges) {
+        if (r.first + r.second.size() > end) end = r.first + r.second.size();
+    }
+    if (end > _node->filesize) grow(end - _node->filesize);
+    for (auto &r : ranges) {
+        writeData(r.second.data(), r.second.size(), r.first);
+    }
+    markModified();
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> OrbisFSFile::getPhysicalExtents(uint64_t offset, uint64_t len){
+    std::vector<std::pair<uint64_t, uint64_t>> ret;
+    FatLockGuard fl(_parent->isWriteable() ? &_parent->_fatLock : NULL, false);
+    if (offset >= _node->filesize) return ret;
+    if (len > _node->filesize - offset) len = _node->filesize - offset;
+    
+    while (len) {
+        uint64_t blkOffset = offset & (_blockSize-1); //always a power of 2
+        uint64_t curLen = _blockSize - blkOffset;
+        if (curLen > len) curLen = len;
+        uint64_t physOffset = (uint64_t)getDataBlockNum(offset/_blockSize) * _blockSize + blkOffset;
+        
+        if (ret.size() && ret.back().first + ret.back().second == physOffset) {
+            ret.back().second += curLen;
+        }else{
+            ret.push_back({physOffset, curLen});
+        }
+        offset += curLen;
+        len -= curLen;
+    }
+    return ret;
+}
+
+void OrbisFSFile::prefetch(uint64_t offset, uint64_t len){
+    for (auto &e : getPhysicalExtents(offset, len)) {
+        _parent->prefetch(e.first, e.second);
+    }
+}
+
+void OrbisFSFile::iterateOverData(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback){
+    OrbisFSTrace::Span span("file.iterateData", "len", len);
+    for (auto &e : getPhysicalExtents(offset, len)) {
+        _parent->iterateOverRaw(e.first, e.second, callback);
     }
 }
 
@@ -291,8 +542,11 @@ size_t OrbisFSFile::resource_pread(void *buf, size_t len, uint64_t offset){
     OrbisFSChainLink_t *rl = &_node->resourceLnk[resouceBlockIdx];
     retassure(rl->type == ORBIS_FS_CHAINLINK_TYPE_LINK, "tgt resouce chain link has bad type 0x%02x",rl->type);
 
-    uint8_t *block = _parent->getBlock(rl->blk);
-    memcpy(buf, &block[resouceBlockOffset], len);
+    uint8_t *dst = (uint8_t*)buf;
+    _parent->iterateOverRaw((uint64_t)rl->blk * _blockSize + resouceBlockOffset, len, [&](const void *data, size_t curLen){
+        memcpy(dst, data, curLen);
+        dst += curLen;
+    });
     return len;
 }
 
@@ -11,6 +11,8 @@
 #include "OrbisFSFormat.h"
 
 #include <vector>
+#include <map>
+#include <functional>
 
 #include <stdint.h>
 #include <stddef.h>
@@ -27,12 +29,18 @@ class OrbisFSFile {
     
     uint64_t _offset;
     
+    uint32_t getDataBlockNum(uint64_t num);
     uint8_t *getDataBlock(uint64_t num);
     uint8_t *getDataForOffset(uint64_t offset);
+    void iterateOverFatBlocks(OrbisFSChainLink_t *fat, uint32_t elems, uint32_t stage, std::function<void(uint32_t blk)> &callback);
+    void iterateOverAllAllocatedBlocks(std::function<void(uint32_t blk)> callback);
     std::vector<uint32_t> getAllAllocatedBlocks();
     void popLastAllocatedBlock();
+    void linkDataBlock(uint64_t num, uint32_t blk, std::function<uint32_t()> &nextBlock);
     void shrink(uint64_t subBytes);
     void grow(uint64_t addBytes);
+    size_t writeData(const void *buf, size_t len, uint64_t offset);
+    void markModified();
 public:
     OrbisFSFile(OrbisFSImage *parent, OrbisFSInode_t *node, bool noFilemodeChecks = false);
     ~OrbisFSFile();
@@ -47,6 +55,29 @@ public:
     
     void resize(uint64_t size);
     
+    /*
+        Writes {offset, data} ranges with a single resize (and thus one batched block allocation)
+        and a single inode update, used for flushing write-back buffers.
+     */
+    void pwriteRanges(const std::map<uint64_t, std::vector<uint8_t>> &ranges);
+    
+    /*
+        Returns {offset, length} pairs of the physical ranges (relative to the start of the filesystem)
+        backing the requested range of the file. Physically contiguous blocks are merged.
+     */
+    std::vector<std::pair<uint64_t, uint64_t>> getPhysicalExtents(uint64_t offset, uint64_t len);
+    
+    /*
+        Starts reading the blocks backing the range in the background
+     */
+    void prefetch(uint64_t offset, uint64_t len);
+    
+    /*
+        Hands out the range as pointers into the image mapping, without copying.
+        Physically contiguous blocks are passed to the callback in one piece.
+     */
+    void iterateOverData(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback);
+    
 #pragma mark resource IO
     uint64_t resource_size();
     size_t resource_pread(void *buf, size_t len, uint64_t offset);
@@ -0,0 +1,390 @@
+//
+//  OrbisFSFind.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSFind.hpp"
+#include "OrbisFSWorkPool.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+using namespace orbisFSTool;
+
+static std::string childPath(const std::string &dir, const char *name, size_t namelen){
+    std::string ret;
+    ret.reserve(dir.size() + 1 + namelen);
+    ret = dir;
+    if (!ret.size() || ret.back() != '/') ret += '/';
+    ret.append(name, namelen);
+    return ret;
+}
+
+/*
+    fnmatch(3) without flags, but on strings which are not NUL terminated
+ */
+static bool globMatch(const char *p, size_t plen, const char *s, size_t slen){
+    size_t pi = 0;
+    size_t si = 0;
+    size_t starP = SIZE_MAX;
+    size_t starS = 0;
+    while (si < slen) {
+        if (pi < plen) {
+            char c = p[pi];
+            if (c == '*') {
+                starP = pi++;
+                starS = si;
+                continue;
+            }
+            if (c == '?') {
+                pi++; si++;
+                continue;
+            }
+            if (c == '[') {
+                size_t i = pi + 1;
+                bool negate = false;
+                bool found = false;
+                if (i < plen && (p[i] == '!' || p[i] == '^')) {
+                    negate = true;
+                    i++;
+                }
+                size_t first = i;
+                while (i < plen && (p[i] != ']' || i == first)) {
+                    if (i+2 < plen && p[i+1] == '-' && p[i+2] != ']') {
+                        if (p[i] <= s[si] && s[si] <= p[i+2]) found = true;
+                        i += 3;
+                    }else{
+                        if (p[i] == s[si]) found = true;
+                        i++;
+                    }
+                }
+                if (i < plen && found != negate) {
+                    pi = i + 1;
+                    si++;
+                    continue;
+                }
+                if (i >= plen && c == s[si]) {
+                    //unterminated class, '[' is a literal
+                    pi++; si++;
+                    continue;
+                }
+            }else if (c == '\\' && pi+1 < plen) {
+                if (p[pi+1] == s[si]) {
+                    pi += 2; si++;
+                    continue;
+                }
+            }else if (c == s[si]) {
+                pi++; si++;
+                continue;
+            }
+        }
+        if (starP == SIZE_MAX) return false;
+        pi = starP + 1;
+        si = ++starS;
+    }
+    while (pi < plen && p[pi] == '*') pi++;
+    return pi == plen;
+}
+
+/*
+    The part of a glob before the first wildcard
+ */
+static std::string globLiteralPrefix(const std::string &glob){
+    size_t end = glob.find_first_of("*?[\\");
+    return glob.substr(0, end);
+}
+
+static uint64_t parseSize(const std::string &str){
+    char *end = NULL;
+    uint64_t ret = strtoull(str.c_str(), &end, 10);
+    retassure(end != str.c_str(), "Bad size '%s'",str.c_str());
+    switch (*end) {
+        case 'T': case 't': ret <<= 10;
+        case 'G': case 'g': ret <<= 10;
+        case 'M': case 'm': ret <<= 10;
+        case 'K': case 'k': ret <<= 10;
+            end++;
+        default:
+            break;
+    }
+    retassure(!*end, "Bad size '%s'",str.c_str());
+    return ret;
+}
+
+static uint64_t parseDate(const std::string &str){
+    if (str.size() && str[0] == '@') {
+        char *end = NULL;
+        uint64_t ret = strtoull(str.c_str()+1, &end, 10);
+        retassure(end != str.c_str()+1 && !*end, "Bad date '%s'",str.c_str());
+        return ret;
+    }
+    struct tm tm = {};
+    char sep = 0;
+    int cnt = sscanf(str.c_str(), "%d-%d-%d%c%d:%d:%d",&tm.tm_year,&tm.tm_mon,&tm.tm_mday,&sep,&tm.tm_hour,&tm.tm_min,&tm.tm_sec);
+    retassure(cnt == 3 || ((cnt == 6 || cnt == 7) && (sep == 'T' || sep == ' ')), "Bad date '%s', expected YYYY-MM-DD[THH:MM[:SS]] or @<unix time>",str.c_str());
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t ret = mktime(&tm);
+    retassure(ret != (time_t)-1, "Bad date '%s'",str.c_str());
+    return (uint64_t)ret;
+}
+
+#pragma mark OrbisFSFind
+OrbisFSFind::OrbisFSFind(OrbisFSImage *img, unsigned threads)
+: _img(img), _threads(threads)
+, _needsPath(false), _maxDepth(UINT32_MAX)
+, _examined(0), _pruned(0)
+{
+    //
+}
+
+#pragma mark OrbisFSFind private
+bool OrbisFSFind::matches(const char *name, size_t namelen, const std::string &path, const OrbisFSInode_t *node){
+    for (auto &p : _predicates) {
+        uint64_t val = 0;
+        switch (p.field) {
+            case kFieldName:
+                if (globMatch(p.pattern.data(), p.pattern.size(), name, namelen) != (p.op == kOpEq)) return false;
+                continue;
+            case kFieldPath:
+                if (globMatch(p.pattern.data(), p.pattern.size(), path.data(), path.size()) != (p.op == kOpEq)) return false;
+                continue;
+            case kFieldMaxDepth:
+            case kFieldPrune:
+                continue;
+            case kFieldType:    val = node->fileMode & S_IFMT; break;
+            case kFieldSize:    val = node->filesize; break;
+            case kFieldUid:     val = node->uid; break;
+            case kFieldGid:     val = node->gid; break;
+            case kFieldInode:   val = node->inodeNum; break;
+            case kFieldMtime:   val = node->modDate; break;
+            case kFieldCtime:   val = node->createDate; break;
+            case kFieldAtime:   val = node->accessDate; break;
+        }
+        bool ok = false;
+        switch (p.op) {
+            case kOpEq: ok = val == p.value; break;
+            case kOpNe: ok = val != p.value; break;
+            case kOpLt: ok = val <  p.value; break;
+            case kOpGt: ok = val >  p.value; break;
+            case kOpLe: ok = val <= p.value; break;
+            case kOpGe: ok = val >= p.value; break;
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+bool OrbisFSFind::canDescend(const std::string &path, const char *name, size_t namelen, uint32_t depth){
+    if (depth >= _maxDepth) return false;
+    for (auto &p : _predicates) {
+        if (p.field == kFieldPrune) {
+            if (globMatch(p.pattern.data(), p.pattern.size(), name, namelen)) return false;
+        }else if (p.field == kFieldPath && p.op == kOpEq) {
+            /*
+                Everything below path starts with "path/", which has to agree with the literal start of the glob
+             */
+            std::string literal = globLiteralPrefix(p.pattern);
+            size_t cmpLen = std::min(literal.size(), path.size());
+            if (literal.compare(0, cmpLen, path, 0, cmpLen)) return false;
+            if (literal.size() > path.size() && path.back() != '/' && literal[path.size()] != '/') return false;
+        }
+    }
+    return true;
+}
+
+#pragma mark OrbisFSFind public
+void OrbisFSFind::addPredicate(const std::string &predicate){
+    static const struct {
+        const char *name;
+        Field field;
+    } fields[] = {
+        {"name",     kFieldName},
+        {"path",     kFieldPath},
+        {"type",     kFieldType},
+        {"size",     kFieldSize},
+        {"uid",      kFieldUid},
+        {"gid",      kFieldGid},
+        {"inode",    kFieldInode},
+        {"mtime",    kFieldMtime},
+        {"ctime",    kFieldCtime},
+        {"atime",    kFieldAtime},
+        {"maxdepth", kFieldMaxDepth},
+        {"prune",    kFieldPrune},
+    };
+    static const struct {
+        const char *str;
+        Op op;
+    } ops[] = {
+        //longest first
+        {"!=", kOpNe},
+        {"<=", kOpLe},
+        {">=", kOpGe},
+        {"=",  kOpEq},
+        {"<",  kOpLt},
+        {">",  kOpGt},
+    };
+
+    size_t opPos = predicate.find_first_of("=!<>");
+    retassure(opPos != std::string::npos && opPos, "Bad predicate '%s', expected <field><op><value>",predicate.c_str());
+    std::string fieldName = predicate.substr(0, opPos);
+
+    Predicate p = {};
+    bool found = false;
+    for (auto &f : fields) {
+        if (fieldName == f.name) {
+            p.field = f.field;
+            found = true;
+            break;
+        }
+    }
+    retassure(found, "Unknown field '%s' in predicate '%s'",fieldName.c_str(),predicate.c_str());
+
+    found = false;
+    std::string value;
+    for (auto &o : ops) {
+        size_t len = strlen(o.str);
+        if (!predicate.compare(opPos, len, o.str)) {
+            p.op = o.op;
+            value = predicate.substr(opPos + len);
+            found = true;
+            break;
+        }
+    }
+    retassure(found, "Bad operator in predicate '%s'",predicate.c_str());
+
+    switch (p.field) {
+        case kFieldName:
+        case kFieldPath:
+            retassure(p.op == kOpEq || p.op == kOpNe, "'%s' only supports = and !=",fieldName.c_str());
+            p.pattern = value;
+            if (p.field == kFieldPath) _needsPath = true;
+            break;
+        case kFieldPrune:
+            retassure(p.op == kOpEq, "'prune' only supports =");
+            p.pattern = value;
+            break;
+        case kFieldType:
+            retassure(p.op == kOpEq || p.op == kOpNe, "'type' only supports = and !=");
+            if (value == "f") {
+                p.value = S_IFREG;
+            }else if (value == "d") {
+                p.value = S_IFDIR;
+            }else{
+                reterror("Bad type '%s', expected f or d",value.c_str());
+            }
+            break;
+        case kFieldSize:
+            p.value = parseSize(value);
+            break;
+        case kFieldUid:
+        case kFieldGid:
+        case kFieldInode:
+        {
+            char *end = NULL;
+            p.value = strtoull(value.c_str(), &end, 0);
+            retassure(value.size() && !*end, "Bad number '%s'",value.c_str());
+            break;
+        }
+        case kFieldMtime:
+        case kFieldCtime:
+        case kFieldAtime:
+            p.value = parseDate(value);
+            break;
+        case kFieldMaxDepth:
+        {
+            retassure(p.op == kOpEq, "'maxdepth' only supports =");
+            char *end = NULL;
+            p.value = strtoull(value.c_str(), &end, 10);
+            retassure(value.size() && !*end, "Bad depth '%s'",value.c_str());
+            _maxDepth = (uint32_t)std::min<uint64_t>(_maxDepth, p.value);
+            break;
+        }
+    }
+    _predicates.push_back(p);
+}
+
+std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSFind::find(std::string path){
+    if (path.size() > 1 && path.back() == '/') path.pop_back();
+    OrbisFSInode_t root = _img->getInodeForPath(path);
+    auto tstart = std::chrono::steady_clock::now();
+
+    OrbisFSWorkPool pool(_threads);
+    std::vector<std::vector<std::pair<std::string, OrbisFSInode_t>>> results(pool.threads());
+    std::function<void(std::string, uint32_t, uint32_t, unsigned)> walk;
+    _examined = 0;
+    _pruned = 0;
+
+    walk = [&](std::string dirPath, uint32_t inode, uint32_t depth, unsigned worker){
+        uint64_t examined = 0;
+        uint64_t pruned = 0;
+        std::string entryPath;
+        _img->iterateOverDirectory(inode, [&](const char *name, size_t namelen, const OrbisFSInode_t *node){
+            examined++;
+            bool isDir = S_ISDIR(node->fileMode);
+            if (_needsPath || isDir) {
+                entryPath = childPath(dirPath, name, namelen);
+            }
+            if (matches(name, namelen, entryPath, node)) {
+                if (!_needsPath && !isDir) entryPath = childPath(dirPath, name, namelen);
+                results[worker].push_back({entryPath, *node});
+            }
+            if (!isDir) return;
+            if (!canDescend(entryPath, name, namelen, depth+1)) {
+                pruned++;
+                return;
+            }
+            std::string child = entryPath;
+            uint32_t childInode = node->inodeNum;
+            pool.push([&walk,child,childInode,depth](unsigned worker){
+                walk(child, childInode, depth+1, worker);
+            });
+        });
+        _examined += examined;
+        _pruned += pruned;
+    };
+
+    {
+        size_t slash = path.find_last_of('/');
+        std::string name = (slash == std::string::npos || path.size() == 1) ? path : path.substr(slash+1);
+        _examined++;
+        if (matches(name.data(), name.size(), path, &root)) results[0].push_back({path, root});
+        if (S_ISDIR(root.fileMode) && _maxDepth > 0) {
+            uint32_t rootInode = root.inodeNum;
+            pool.push([&walk,path,rootInode](unsigned worker){
+                walk(path, rootInode, 0, worker);
+            });
+        }
+    }
+    pool.wait();
+    retassure(!pool.failedTasks(), "Failed to search %llu directories",pool.failedTasks());
+
+    std::vector<std::pair<std::string, OrbisFSInode_t>> ret;
+    {
+        size_t total = 0;
+        for (auto &r : results) total += r.size();
+        ret.reserve(total);
+        for (auto &r : results) {
+            std::move(r.begin(), r.end(), std::back_inserter(ret));
+        }
+    }
+    std::sort(ret.begin(), ret.end(), [](const std::pair<std::string, OrbisFSInode_t> &a, const std::pair<std::string, OrbisFSInode_t> &b)->bool{
+        return a.first < b.first;
+    });
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Found %zu matches in %llu entries (%llu directories pruned) in %.3f sec using %u threads",
+         ret.size(), _examined.load(), _pruned.load(), secs, pool.threads());
+    return ret;
+}
@@ -0,0 +1,92 @@
+//
+//  OrbisFSFind.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSFind_hpp
+#define OrbisFSFind_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    find(1) style search, all predicates have to match.
+    Directories are walked in parallel, predicates are evaluated on the inodes inside the image mapping,
+    so only matching entries are ever copied. Subtrees which can't contain matches are never opened.
+
+    Predicates are "<field><op><value>" with op one of = != < > <= >=
+        name, path      glob (* ? [...]), only = and !=
+        type            f or d
+        size            bytes, K/M/G/T suffixes allowed
+        uid, gid, inode number
+        mtime, ctime, atime   YYYY-MM-DD[THH:MM[:SS]] (local time) or @<unix time>
+        maxdepth        only = , don't descend deeper than that
+        prune           glob, don't descend into directories with a matching name
+ */
+class OrbisFSFind {
+    enum Field {
+        kFieldName,
+        kFieldPath,
+        kFieldType,
+        kFieldSize,
+        kFieldUid,
+        kFieldGid,
+        kFieldInode,
+        kFieldMtime,
+        kFieldCtime,
+        kFieldAtime,
+        kFieldMaxDepth,
+        kFieldPrune
+    };
+    enum Op {
+        kOpEq,
+        kOpNe,
+        kOpLt,
+        kOpGt,
+        kOpLe,
+        kOpGe
+    };
+    struct Predicate {
+        Field field;
+        Op op;
+        uint64_t value;
+        std::string pattern;
+    };
+
+    OrbisFSImage *_img; //not owned
+    unsigned _threads;
+    std::vector<Predicate> _predicates;
+    bool _needsPath;
+    uint32_t _maxDepth;
+
+    std::atomic<uint64_t> _examined;
+    std::atomic<uint64_t> _pruned;
+
+    bool matches(const char *name, size_t namelen, const std::string &path, const OrbisFSInode_t *node);
+    bool canDescend(const std::string &path, const char *name, size_t namelen, uint32_t depth);
+public:
+    OrbisFSFind(OrbisFSImage *img, unsigned threads = 0);
+
+    /*
+        Throws on malformed predicates
+     */
+    void addPredicate(const std::string &predicate);
+
+    /*
+        Returns all matches below (and including) path, sorted by path
+     */
+    std::vector<std::pair<std::string, OrbisFSInode_t>> find(std::string path);
+};
+
+}
+#endif /* OrbisFSFind_hpp */
@@ -6,33 +6,35 @@
 //
 
 #include "OrbisFSFuse.hpp"
+#include "OrbisFSBufferedFile.hpp"
 #include "OrbisFSException.hpp"
+#include "OrbisFSStats.hpp"
 #include <libgeneral/macros.h>
 
+#include <algorithm>
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
 #ifdef HAVE_FUSE
-#   define FUSE_USE_VERSION 28
-#   include <fuse/fuse.h>
+#   ifdef HAVE_FUSE3
+#       define FUSE_USE_VERSION 34
+#       include <fuse3/fuse_lowlevel.h>
+#   else
+#       define FUSE_USE_VERSION 28
+#       include <fuse/fuse.h>
+#   endif
 #endif
 
+#define STATS_FILE_NAME ".orbisfs_stats"
+#define STATS_FILE_INO (1ULL << 32) //above every OrbisFS inode number
+
 using namespace orbisFSTool;
 
 #ifdef HAVE_FUSE
-static int fs_getattr(const char *path, struct stat *stbuf) noexcept{
-    struct fuse_context *ctx = fuse_get_context();
-    OrbisFSImage *img = (OrbisFSImage*)ctx->private_data;
-    
-    OrbisFSInode_t node = {};
+static void fillStat(const OrbisFSInode_t &node, struct stat *stbuf) noexcept{
     memset(stbuf, 0, sizeof(*stbuf));
-    
-    try {
-        node = img->getInodeForPath(path);
-    } catch(tihmstar::OrbisFSFileNotFound &e){
-        return -EEXIST;
-    } catch (tihmstar::exception &e) {
-        e.dump();
-        return -EFAULT;
-    }
-    
     stbuf->st_ino = node.inodeNum;
     stbuf->st_mode = node.fileMode;
     stbuf->st_size = node.filesize;
@@ -59,7 +61,73 @@ static int fs_getattr(const char *path, struct stat *stbuf) noexcept{
     }
     
     stbuf->st_mode |= 05; //this isn't accurate, but we do want to read the files afterall, right?
+}
+
+/*
+    With --stats, a read-only file in the root folder shows the counters at the time it is opened
+ */
+static void fillStatsStat(struct stat *stbuf) noexcept{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = STATS_FILE_INO;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+    try {
+        stbuf->st_size = OrbisFSStats::report().size();
+    } catch (...) {
+        //
+    }
+}
+
+static std::string *openStatsFile(struct fuse_file_info *fi) noexcept{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return NULL;
+    std::string *ret = NULL;
+    try {
+        ret = new std::string(OrbisFSStats::report());
+    } catch (...) {
+        return NULL;
+    }
+    fi->fh = (uint64_t)ret;
+    fi->direct_io = 1; //the content changes all the time, the kernel must not cache it
+    return ret;
+}
+
+#ifndef HAVE_FUSE3
+static bool isStatsPath(const char *path) noexcept{
+    return OrbisFSStats::enabled() && !strcmp(path, "/" STATS_FILE_NAME);
+}
+
+static size_t readStatsFile(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) noexcept{
+    std::string *s = (std::string *)fi->fh;
+    if (offset < 0 || (uint64_t)offset >= s->size()) return 0;
+    size_t len = std::min<size_t>(size, s->size() - offset);
+    memcpy(buf, s->data() + offset, len);
+    return len;
+}
+
+static int fs_getattr(const char *path, struct stat *stbuf) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseGetattr);
+    struct fuse_context *ctx = fuse_get_context();
+    OrbisFSImage *img = ((OrbisFSFuse*)ctx->private_data)->getImage();
+    
+    OrbisFSInode_t node = {};
+    memset(stbuf, 0, sizeof(*stbuf));
+    
+    if (isStatsPath(path)) {
+        fillStatsStat(stbuf);
+        return 0;
+    }
+    
+    try {
+        node = img->getInodeForPath(path);
+    } catch(tihmstar::OrbisFSFileNotFound &e){
+        return -EEXIST;
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        return -EFAULT;
+    }
     
+    fillStat(node, stbuf);
     return 0;
  }
 
@@ -71,10 +139,15 @@ static int fs_readlink(const char *path, char *buf, size_t bufsize) noexcept{
 }
 
 static int fs_open(const char *path, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseOpen);
     struct fuse_context *ctx = fuse_get_context();
-    OrbisFSImage *img = (OrbisFSImage*)ctx->private_data;
+    OrbisFSImage *img = ((OrbisFSFuse*)ctx->private_data)->getImage();
     std::shared_ptr<OrbisFSFile> f;
 
+    if (isStatsPath(path)) {
+        return openStatsFile(fi) ? 0 : -EACCES;
+    }
+
     try {
         f = img->openFilAtPath(path);
     } catch(tihmstar::OrbisFSFileNotFound &e){
@@ -84,37 +157,84 @@ static int fs_open(const char *path, struct fuse_file_info *fi) noexcept{
         return -EFAULT;
     }
     
-    fi->fh = (uint64_t)new std::shared_ptr<OrbisFSFile>(f);
+    fi->fh = (uint64_t)new OrbisFSBufferedFile(f);
     return 0;
 }
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) noexcept{
-    std::shared_ptr<OrbisFSFile> *f = (std::shared_ptr<OrbisFSFile> *)fi->fh;
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseRead);
+    if (isStatsPath(path)) return (int)readStatsFile(fi, buf, size, offset);
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
     try {
-        return (int)(*f)->pread(buf, size, offset);
+        return (int)f->pread(buf, size, offset);
     } catch (tihmstar::exception &e) {
         return -EFAULT;
     }
 }
 
 static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) noexcept{
-    std::shared_ptr<OrbisFSFile> *f = (std::shared_ptr<OrbisFSFile> *)fi->fh;
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseWrite);
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
     try {
-        return (int)(*f)->pwrite(buf, size, offset);
+        return (int)f->pwrite(buf, size, offset);
     } catch (tihmstar::exception &e) {
         return -EFAULT;
     }
 }
 
+static int fs_truncate(const char *path, off_t size) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseSetattr);
+    if (isStatsPath(path)) return -EACCES;
+    struct fuse_context *ctx = fuse_get_context();
+    OrbisFSImage *img = ((OrbisFSFuse*)ctx->private_data)->getImage();
+    try {
+        img->openFilAtPath(path)->resize(size);
+    } catch(tihmstar::OrbisFSFileNotFound &e){
+        return -ENOENT;
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        return -EIO;
+    }
+    return 0;
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseFlush);
+    if (isStatsPath(path)) return 0;
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
+    try {
+        f->flush();
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        return -EIO;
+    }
+    return 0;
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) noexcept{
+    return fs_flush(path, fi);
+}
+
 static int fs_release(const char *path, struct fuse_file_info *fi) noexcept{
-    std::shared_ptr<OrbisFSFile> *f = (std::shared_ptr<OrbisFSFile> *)fi->fh; fi->fh = 0;
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseRelease);
+    struct fuse_context *ctx = fuse_get_context();
+    OrbisFSFuse *fs = (OrbisFSFuse*)ctx->private_data;
+    if (isStatsPath(path)) {
+        std::string *s = (std::string *)fi->fh; fi->fh = 0;
+        safeDelete(s);
+        return 0;
+    }
+    int err = fs_flush(path, fi);
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh; fi->fh = 0;
+    fs->addReadaheadStats(f->getReadaheadStats());
     safeDelete(f);
-    return 0;
+    return err;
 }
 
 int fs_opendir(const char *path, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseOpendir);
     struct fuse_context *ctx = fuse_get_context();
-    OrbisFSImage *img = (OrbisFSImage*)ctx->private_data;
+    OrbisFSImage *img = ((OrbisFSFuse*)ctx->private_data)->getImage();
 
     std::vector<std::pair<std::string, uint64_t>> *files = nullptr;
     cleanup([&]{
@@ -145,6 +265,7 @@ int fs_opendir(const char *path, struct fuse_file_info *fi) noexcept{
 }
 
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseReaddir);
     std::vector<std::pair<std::string, uint64_t>> *tgt = (std::vector<std::pair<std::string, uint64_t>>*)fi->fh;
 
     while (off < tgt->size()) {
@@ -158,6 +279,7 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, s
 }
 
 int fs_releasedir(const char *path, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseReleasedir);
     std::vector<std::pair<std::string, uint64_t>> *old = (std::vector<std::pair<std::string, uint64_t>>*)fi->fh; fi->fh = 0;
     safeDelete(old);
     return 0;
@@ -166,22 +288,446 @@ int fs_releasedir(const char *path, struct fuse_file_info *fi) noexcept{
 static const struct fuse_operations orbisimgFuse_ops = {
     .getattr = fs_getattr,
     .readlink = fs_readlink,
+    .truncate = fs_truncate,
     .open    = fs_open,
     .read    = fs_read,
     .write   = fs_write,
+    .flush   = fs_flush,
     .release = fs_release,
+    .fsync   = fs_fsync,
     .opendir = fs_opendir,
     .readdir = fs_readdir,
     .releasedir = fs_releasedir,
 };
+#else
+/*
+    Low-level interface, requests arrive with OrbisFS inode numbers instead of paths.
+    FUSE reserves ino 1 for the root, which maps to the OrbisFS root folder.
+ */
+static fuse_ino_t fuseInoForInode(uint32_t inode) noexcept{
+    return inode == kOrbisFSRootFolderID ? FUSE_ROOT_ID : inode;
+}
+
+static uint32_t inodeForFuseIno(fuse_ino_t ino) noexcept{
+    return ino == FUSE_ROOT_ID ? kOrbisFSRootFolderID : (uint32_t)ino;
+}
+
+static bool isStatsIno(fuse_ino_t ino) noexcept{
+    return ino == STATS_FILE_INO && OrbisFSStats::enabled();
+}
+
+static void fillEntry(const OrbisFSInode_t &node, double timeout, struct fuse_entry_param *e) noexcept{
+    memset(e, 0, sizeof(*e));
+    fillStat(node, &e->attr);
+    e->ino = e->attr.st_ino = fuseInoForInode(node.inodeNum);
+    e->generation = node.birthCnt;
+    e->attr_timeout = timeout;
+    e->entry_timeout = timeout;
+}
+
+static void fs_ll_init(void *userdata, struct fuse_conn_info *conn) noexcept{
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        /*
+            Always hand out attributes with directory listings,
+            otherwise every listed entry costs an extra lookup
+         */
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+    
+    if (((OrbisFSFuse*)userdata)->getImage()->isWriteable()) {
+        /*
+            Let the kernel collect small writes in the page cache and send them in large chunks,
+            instead of one request (and one allocation) per 4KiB page
+         */
+        if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        conn->max_write = 1*1024*1024; //libfuse clamps this to its buffer size
+    }
+}
+
+static void fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseLookup);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    struct fuse_entry_param entry = {};
+    
+    if (parent == FUSE_ROOT_ID && OrbisFSStats::enabled() && !strcmp(name, STATS_FILE_NAME)) {
+        fillStatsStat(&entry.attr);
+        entry.ino = STATS_FILE_INO;
+        fuse_reply_entry(req, &entry); //no timeouts, the size changes all the time
+        return;
+    }
+    
+    try {
+        fillEntry(img->getInodeInFolder(inodeForFuseIno(parent), name), fs->getCacheTimeout(), &entry);
+    } catch(tihmstar::OrbisFSFileNotFound &e){
+        if (img->isWriteable()) {
+            fuse_reply_err(req, ENOENT);
+        }else{
+            /*
+                Nothing can appear on a read-only mount, let the kernel cache the miss
+             */
+            entry.ino = 0;
+            entry.entry_timeout = fs->getCacheTimeout();
+            fuse_reply_entry(req, &entry);
+        }
+        return;
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+static void fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) noexcept{
+    /*
+        Inodes live in the image, there is no per-lookup state to drop
+     */
+    fuse_reply_none(req);
+}
+
+static void fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) noexcept{
+    fuse_reply_none(req);
+}
+
+static void fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseGetattr);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    struct stat stbuf = {};
+    
+    if (isStatsIno(ino)) {
+        fillStatsStat(&stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+    
+    try {
+        if (fi && fi->fh) ((OrbisFSBufferedFile *)fi->fh)->flush();
+        fillStat(img->getInodeForID(inodeForFuseIno(ino)), &stbuf);
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, fs->getCacheTimeout());
+}
+
+static void fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseSetattr);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    struct stat stbuf = {};
+    
+    if (isStatsIno(ino)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (!img->isWriteable()) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    
+    /*
+        The inode has no change time, ctime shows the creation date and stays untouched
+     */
+    try {
+        if (to_set & FUSE_SET_ATTR_SIZE) {
+            if (fi && fi->fh) {
+                ((OrbisFSBufferedFile *)fi->fh)->resize(attr->st_size);
+            }else{
+                img->openFileID(inodeForFuseIno(ino))->resize(attr->st_size);
+            }
+        }
+        if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+            const uint64_t now = time(NULL);
+            img->updateInode(inodeForFuseIno(ino), [&](OrbisFSInode_t *node){
+                if (to_set & FUSE_SET_ATTR_MODE) node->fileMode = (node->fileMode & S_IFMT) | (attr->st_mode & 07777);
+                if (to_set & FUSE_SET_ATTR_UID) node->uid = attr->st_uid;
+                if (to_set & FUSE_SET_ATTR_GID) node->gid = attr->st_gid;
+                if (to_set & FUSE_SET_ATTR_ATIME) node->accessDate = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+                if (to_set & FUSE_SET_ATTR_MTIME) node->modDate = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtime;
+                if (!S_ISDIR(node->fileMode)) node->modCnt++;
+            });
+        }
+        fillStat(img->getInodeForID(inodeForFuseIno(ino)), &stbuf);
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, fs->getCacheTimeout());
+}
+
+static void fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseOpen);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    std::shared_ptr<OrbisFSFile> f;
+
+    if (isStatsIno(ino)) {
+        if (openStatsFile(fi)) {
+            fuse_reply_open(req, fi);
+        }else{
+            fuse_reply_err(req, EACCES);
+        }
+        return;
+    }
+
+    try {
+        f = img->openFileID(inodeForFuseIno(ino));
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    
+    fi->fh = (uint64_t)new OrbisFSBufferedFile(f);
+    if (!img->isWriteable()) fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseRead);
+    if (isStatsIno(ino)) {
+        std::string *s = (std::string *)fi->fh;
+        size_t start = std::min<size_t>(off < 0 ? 0 : (size_t)off, s->size());
+        fuse_reply_buf(req, s->data() + start, std::min(size, s->size() - start));
+        return;
+    }
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+    struct fuse_bufvec *bufv = NULL;
+    cleanup([&]{
+        safeFree(bufv);
+    });
+
+    try {
+        extents = f->getPhysicalExtents(off, size);
+    } catch (tihmstar::exception &e) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if (!extents.size()) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    
+    if (img->getFd() == -1) {
+        /*
+            Compressed image, there is nothing to splice from
+         */
+        std::vector<uint8_t> buf(size);
+        size_t didRead = 0;
+        try {
+            didRead = f->pread(buf.data(), size, off);
+        } catch (tihmstar::exception &e) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        fuse_reply_buf(req, (const char*)buf.data(), didRead);
+        return;
+    }
+    
+    /*
+        Hand out the ranges of the image file instead of the data itself,
+        so libfuse can splice straight from the image into the kernel
+     */
+    if (!(bufv = (struct fuse_bufvec*)calloc(1, sizeof(*bufv) + sizeof(bufv->buf[0])*(extents.size()-1)))) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    bufv->count = extents.size();
+    for (size_t i=0; i<extents.size(); i++) {
+        bufv->buf[i].size = extents[i].second;
+        bufv->buf[i].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[i].fd = img->getFd();
+        bufv->buf[i].pos = img->getFdOffset() + extents[i].first;
+    }
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseWrite);
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
+    size_t didWrite = 0;
+    try {
+        didWrite = f->pwrite(buf, size, off);
+    } catch (tihmstar::exception &e) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_write(req, didWrite);
+}
+
+static int flushFileHandle(struct fuse_file_info *fi) noexcept{
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh;
+    try {
+        f->flush();
+    } catch (tihmstar::exception &e) {
+        e.dump();
+        return EIO;
+    }
+    return 0;
+}
+
+static void fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseFlush);
+    fuse_reply_err(req, isStatsIno(ino) ? 0 : flushFileHandle(fi));
+}
+
+static void fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseFlush);
+    fuse_reply_err(req, isStatsIno(ino) ? 0 : flushFileHandle(fi));
+}
+
+static void fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseRelease);
+    if (isStatsIno(ino)) {
+        std::string *s = (std::string *)fi->fh; fi->fh = 0;
+        safeDelete(s);
+        fuse_reply_err(req, 0);
+        return;
+    }
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    int err = flushFileHandle(fi);
+    OrbisFSBufferedFile *f = (OrbisFSBufferedFile *)fi->fh; fi->fh = 0;
+    fs->addReadaheadStats(f->getReadaheadStats());
+    safeDelete(f);
+    fuse_reply_err(req, err);
+}
+
+static void fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseOpendir);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    OrbisFSImage *img = fs->getImage();
+    std::vector<std::pair<std::string, OrbisFSInode_t>> *files = nullptr;
+    cleanup([&]{
+        safeDelete(files);
+    });
+    
+    try {
+        files = new std::vector<std::pair<std::string, OrbisFSInode_t>>(img->listFilesInFolder(inodeForFuseIno(ino), true));
+    } catch (tihmstar::exception &e) {
+#ifdef DEBUG
+        e.dump();
+#endif
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    
+    fi->fh = (uint64_t)files; files = nullptr;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+    if (!img->isWriteable()) {
+        fi->keep_cache = 1;
+        fi->cache_readdir = 1;
+    }
+#endif
+    fuse_reply_open(req, fi);
+}
+
+static void fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseReaddir);
+    std::vector<std::pair<std::string, OrbisFSInode_t>> *tgt = (std::vector<std::pair<std::string, OrbisFSInode_t>>*)fi->fh;
+    char *buf = NULL;
+    cleanup([&]{
+        safeFree(buf);
+    });
+    size_t bufUsed = 0;
+    
+    if (!(buf = (char*)malloc(size))) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    for (size_t i = off; i < tgt->size(); i++) {
+        auto &e = tgt->at(i);
+        struct stat stbuf = {};
+        stbuf.st_ino = fuseInoForInode(e.second.inodeNum);
+        stbuf.st_mode = e.second.fileMode;
+        size_t entrySize = fuse_add_direntry(req, buf+bufUsed, size-bufUsed, e.first.c_str(), &stbuf, i+1);
+        if (entrySize > size-bufUsed) break;
+        bufUsed += entrySize;
+    }
+    fuse_reply_buf(req, buf, bufUsed);
+}
+
+static void fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseReaddir);
+    OrbisFSFuse *fs = (OrbisFSFuse*)fuse_req_userdata(req);
+    std::vector<std::pair<std::string, OrbisFSInode_t>> *tgt = (std::vector<std::pair<std::string, OrbisFSInode_t>>*)fi->fh;
+    char *buf = NULL;
+    cleanup([&]{
+        safeFree(buf);
+    });
+    size_t bufUsed = 0;
+    
+    if (!(buf = (char*)malloc(size))) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    /*
+        The inodes were copied on opendir already, so attributes come for free here
+     */
+    for (size_t i = off; i < tgt->size(); i++) {
+        auto &e = tgt->at(i);
+        struct fuse_entry_param entry = {};
+        fillEntry(e.second, fs->getCacheTimeout(), &entry);
+        size_t entrySize = fuse_add_direntry_plus(req, buf+bufUsed, size-bufUsed, e.first.c_str(), &entry, i+1);
+        if (entrySize > size-bufUsed) break;
+        bufUsed += entrySize;
+    }
+    fuse_reply_buf(req, buf, bufUsed);
+}
+
+static void fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept{
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFuseReleasedir);
+    std::vector<std::pair<std::string, OrbisFSInode_t>> *old = (std::vector<std::pair<std::string, OrbisFSInode_t>>*)fi->fh; fi->fh = 0;
+    safeDelete(old);
+    fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops orbisimgFuse_ops = {
+    .init           = fs_ll_init,
+    .lookup         = fs_ll_lookup,
+    .forget         = fs_ll_forget,
+    .getattr        = fs_ll_getattr,
+    .setattr        = fs_ll_setattr,
+    .open           = fs_ll_open,
+    .read           = fs_ll_read,
+    .write          = fs_ll_write,
+    .flush          = fs_ll_flush,
+    .release        = fs_ll_release,
+    .fsync          = fs_ll_fsync,
+    .opendir        = fs_ll_opendir,
+    .readdir        = fs_ll_readdir,
+    .releasedir     = fs_ll_releasedir,
+    .forget_multi   = fs_ll_forget_multi,
+    .readdirplus    = fs_ll_readdirplus,
+};
+#endif //HAVE_FUSE3
 #endif
 
 
 #pragma mark OrbisFSFuse
-OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPath)
+OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPath, double cacheTimeout)
 : _img(img)
 , _fuse(NULL), _ch(NULL)
+, _se(NULL)
+, _cacheTimeout(cacheTimeout)
+, _readaheadStats{}
 {
+    if (_cacheTimeout < 0) {
+        _cacheTimeout = _img->isWriteable() ? 1.0 : 3600.0;
+    }
 #ifndef HAVE_FUSE
     reterror("Built without FUSE support!");
 #else
@@ -189,9 +735,15 @@ OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPat
     _mountpoint = mountPath;
 
     int vers = fuse_version();
+#ifdef HAVE_FUSE3
+    if (vers < FUSE_MAKE_VERSION(3, 2)) {
+        reterror("Fuse version too low, expected %d but got %d",FUSE_MAKE_VERSION(3, 2),vers);
+    }
+#else
     if (vers < FUSE_USE_VERSION) {
         reterror("Fuse version too low, expected %d but got %d",FUSE_USE_VERSION,vers);
     }
+#endif
     info("Got FUSE version %d",vers);
 
     struct fuse_args args = {};
@@ -203,7 +755,12 @@ OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPat
     assure(!fuse_opt_add_arg(&args, "FIRST_ARG_IS_IGNORED"));
 
     if (!_img->isWriteable()){
+#ifdef HAVE_FUSE3
+        assure(!fuse_opt_add_arg(&args, "-o"));
+        assure(!fuse_opt_add_arg(&args, "ro"));
+#else
         assure(!fuse_opt_add_arg(&args, "-r"));
+#endif
     }
 
     {
@@ -220,6 +777,28 @@ OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPat
     }
 #endif //!defined(__linux__)
 
+#ifndef HAVE_FUSE3
+    {
+        /*
+            The high-level API takes the cache settings as mount options
+         */
+        char buf[0x100] = {};
+        snprintf(buf, sizeof(buf), "attr_timeout=%f,entry_timeout=%f,negative_timeout=%f",_cacheTimeout,_cacheTimeout,_img->isWriteable() ? 0.0 : _cacheTimeout);
+        assure(!fuse_opt_add_arg(&args, "-o"));
+        assure(!fuse_opt_add_arg(&args, buf));
+        if (!_img->isWriteable()){
+            assure(!fuse_opt_add_arg(&args, "-o"));
+            assure(!fuse_opt_add_arg(&args, "kernel_cache"));
+        }else{
+            /*
+                FUSE 2 has no writeback cache, but can at least send writes larger than a page
+             */
+            assure(!fuse_opt_add_arg(&args, "-o"));
+            assure(!fuse_opt_add_arg(&args, "big_writes,max_write=131072"));
+        }
+    }
+#endif
+
 #ifdef __APPLE__
     assure(!fuse_opt_add_arg(&args, "-o"));
     if (!_img->isWriteable()){
@@ -231,25 +810,60 @@ OrbisFSFuse::OrbisFSFuse(std::shared_ptr<OrbisFSImage> img, const char *mountPat
 
     {
         debug("Trying to mount at %s",_mountpoint.c_str());
+#ifdef HAVE_FUSE3
+        retassure(_se = fuse_session_new(&args, &orbisimgFuse_ops, sizeof(orbisimgFuse_ops), this), "Failed to create FUSE session");
+        retassure(!fuse_session_mount(_se, _mountpoint.c_str()), "Failed to mount");
+#else
         retassure(_ch = fuse_mount(_mountpoint.c_str(), &args), "Failed to mount");
-        retassure(_fuse = fuse_new(_ch, &args, &orbisimgFuse_ops, sizeof(orbisimgFuse_ops), _img.get()), "Failed to create FUSE session");
+        retassure(_fuse = fuse_new(_ch, &args, &orbisimgFuse_ops, sizeof(orbisimgFuse_ops), this), "Failed to create FUSE session");
+#endif
     }
     info("Mounted at %s",_mountpoint.c_str());
 #endif
 }
 
 OrbisFSFuse::~OrbisFSFuse(){
+    if (_readaheadStats.reads) {
+        info("Readahead: %llu reads (%llu sequential, %llu strided, %llu random), %.1f%% served from prefetched ranges, %llu bytes prefetched",
+             _readaheadStats.reads, _readaheadStats.sequential, _readaheadStats.strided, _readaheadStats.random,
+             100.0*_readaheadStats.hits/_readaheadStats.reads, _readaheadStats.prefetchedBytes);
+    }
 #ifdef HAVE_FUSE
+#   ifdef HAVE_FUSE3
+    if (_se) {
+        fuse_session_unmount(_se);
+    }
+    safeFreeCustom(_se, fuse_session_destroy);
+#   else
     if (_ch) {
         fuse_unmount(_mountpoint.c_str(), _ch); _ch = NULL;
     }
     safeFreeCustom(_fuse, fuse_destroy);
+#   endif
 #endif
 }
 
 #pragma mark OrbisFSFuse private
 
 #pragma mark OrbisFSFuse public
+OrbisFSImage *OrbisFSFuse::getImage(){
+    return _img.get();
+}
+
+double OrbisFSFuse::getCacheTimeout(){
+    return _cacheTimeout;
+}
+
+void OrbisFSFuse::addReadaheadStats(const OrbisFSReadahead::Stats &stats){
+    std::unique_lock<std::mutex> ul(_statsLock);
+    _readaheadStats.reads += stats.reads;
+    _readaheadStats.sequential += stats.sequential;
+    _readaheadStats.strided += stats.strided;
+    _readaheadStats.random += stats.random;
+    _readaheadStats.hits += stats.hits;
+    _readaheadStats.prefetchedBytes += stats.prefetchedBytes;
+}
+
 void OrbisFSFuse::loopSession(){
 #ifndef HAVE_FUSE
     reterror("Built without FUSE support!");
@@ -258,19 +872,34 @@ void OrbisFSFuse::loopSession(){
     cleanup([&]{
         safeFreeCustom(se, fuse_remove_signal_handlers);
     });
+#ifdef HAVE_FUSE3
+    if ((se = _se)) {
+#else
     if ((se = fuse_get_session(_fuse))) {
+#endif
         if (fuse_set_signal_handlers(se)){
             se = NULL;
             error("Failed to set FUSE sighandlers");
         }
     }
+#ifdef HAVE_FUSE3
+    {
+        struct fuse_loop_config config = {};
+        config.clone_fd = 0;
+        config.max_idle_threads = 10;
+        fuse_session_loop_mt(_se, &config);
+    }
+#else
     fuse_loop_mt(_fuse);
 #endif
+#endif
 }
 
 void OrbisFSFuse::stopSession(){
 #ifndef HAVE_FUSE
     reterror("Built without FUSE support!");
+#elif defined(HAVE_FUSE3)
+    fuse_session_exit(_se);
 #else
     fuse_exit(_fuse);
 #endif
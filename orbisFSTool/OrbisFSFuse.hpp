@@ -9,12 +9,15 @@
 #define OrbisFSFuse_hpp
 
 #include "OrbisFSImage.hpp"
+#include "OrbisFSReadahead.hpp"
 
 #include <memory>
+#include <mutex>
 #include <iostream>
 
 struct fuse;
 struct fuse_chan;
+struct fuse_session;
 
 namespace orbisFSTool {
 
@@ -24,10 +27,28 @@ class OrbisFSFuse {
     
     struct fuse *_fuse;
     struct fuse_chan *_ch;
+    struct fuse_session *_se;
+    
+    double _cacheTimeout;
+    
+    std::mutex _statsLock;
+    OrbisFSReadahead::Stats _readaheadStats;
 public:
-    OrbisFSFuse(std::shared_ptr<OrbisFSImage> disk, const char *mountPath);
+    /*
+        cacheTimeout is how long the kernel may cache attributes and directory entries.
+        A negative value picks a default: long for read-only mounts, 1 second otherwise.
+     */
+    OrbisFSFuse(std::shared_ptr<OrbisFSImage> disk, const char *mountPath, double cacheTimeout = -1);
     ~OrbisFSFuse();
     
+    OrbisFSImage *getImage();
+    double getCacheTimeout();
+    
+    /*
+        Collects the readahead counters of a file handle which is about to be closed
+     */
+    void addReadaheadStats(const OrbisFSReadahead::Stats &stats);
+    
     void loopSession();
     void stopSession();
 };
@@ -0,0 +1,190 @@
+//
+//  OrbisFSHash.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSHash.hpp"
+
+#include <libgeneral/macros.h>
+
+#ifdef HAVE_OPENSSL
+#   include <openssl/evp.h>
+#endif
+
+#include <string.h>
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+using namespace orbisFSTool;
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p){
+    uint64_t ret;
+    memcpy(&ret, p, sizeof(ret)); //little endian hosts only
+    return ret;
+}
+
+static inline uint32_t read32(const uint8_t *p){
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input){
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val){
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+#pragma mark OrbisFSHash
+OrbisFSHash::OrbisFSHash(uint32_t algos)
+: _algos(algos), _shaCtx(NULL)
+, _xxhAcc{XXH_PRIME64_1 + XXH_PRIME64_2, XXH_PRIME64_2, 0, 0 - XXH_PRIME64_1}
+, _xxhBuf{}, _xxhBufSize(0), _xxhTotal(0)
+{
+    retassure(_algos, "No hash algorithm selected");
+    retassure((_algos & availableAlgos()) == _algos, "Requested hash algorithm is not supported by this build");
+#ifdef HAVE_OPENSSL
+    if (_algos & kHashSHA256) {
+        EVP_MD_CTX *ctx = NULL;
+        retassure(ctx = EVP_MD_CTX_new(), "Failed to create digest context");
+        _shaCtx = ctx;
+        retassure(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1, "Failed to init SHA-256");
+    }
+#endif
+}
+
+OrbisFSHash::~OrbisFSHash(){
+#ifdef HAVE_OPENSSL
+    if (_shaCtx) {
+        EVP_MD_CTX_free((EVP_MD_CTX*)_shaCtx); _shaCtx = NULL;
+    }
+#endif
+}
+
+#pragma mark OrbisFSHash private
+void OrbisFSHash::xxhUpdate(const uint8_t *data, size_t len){
+    _xxhTotal += len;
+    if (_xxhBufSize) {
+        size_t fill = sizeof(_xxhBuf) - _xxhBufSize;
+        if (fill > len) fill = len;
+        memcpy(&_xxhBuf[_xxhBufSize], data, fill);
+        _xxhBufSize += fill;
+        data += fill; len -= fill;
+        if (_xxhBufSize < sizeof(_xxhBuf)) return;
+        for (int i=0; i<4; i++) _xxhAcc[i] = xxhRound(_xxhAcc[i], read64(&_xxhBuf[i*8]));
+        _xxhBufSize = 0;
+    }
+    
+    uint64_t v1 = _xxhAcc[0], v2 = _xxhAcc[1], v3 = _xxhAcc[2], v4 = _xxhAcc[3];
+    while (len >= 32) {
+        v1 = xxhRound(v1, read64(data));
+        v2 = xxhRound(v2, read64(data+8));
+        v3 = xxhRound(v3, read64(data+16));
+        v4 = xxhRound(v4, read64(data+24));
+        data += 32; len -= 32;
+    }
+    _xxhAcc[0] = v1; _xxhAcc[1] = v2; _xxhAcc[2] = v3; _xxhAcc[3] = v4;
+    
+    if (len) {
+        memcpy(_xxhBuf, data, len);
+        _xxhBufSize = (uint32_t)len;
+    }
+}
+
+uint64_t OrbisFSHash::xxhFinalize(){
+    uint64_t h = 0;
+    if (_xxhTotal >= 32) {
+        h = rotl64(_xxhAcc[0], 1) + rotl64(_xxhAcc[1], 7) + rotl64(_xxhAcc[2], 12) + rotl64(_xxhAcc[3], 18);
+        for (int i=0; i<4; i++) h = xxhMergeRound(h, _xxhAcc[i]);
+    }else{
+        h = _xxhAcc[2] + XXH_PRIME64_5; //seed
+    }
+    h += _xxhTotal;
+    
+    const uint8_t *p = _xxhBuf;
+    uint32_t len = _xxhBufSize;
+    while (len >= 8) {
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8; len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4; len -= 4;
+    }
+    while (len) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        p++; len--;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#pragma mark OrbisFSHash public
+uint32_t OrbisFSHash::availableAlgos(){
+#ifdef HAVE_OPENSSL
+    return kHashSHA256 | kHashXXH64;
+#else
+    return kHashXXH64;
+#endif
+}
+
+void OrbisFSHash::update(const void *data, size_t len){
+#ifdef HAVE_OPENSSL
+    if (_shaCtx) {
+        retassure(EVP_DigestUpdate((EVP_MD_CTX*)_shaCtx, data, len) == 1, "Failed to update SHA-256");
+    }
+#endif
+    if (_algos & kHashXXH64) xxhUpdate((const uint8_t*)data, len);
+}
+
+OrbisFSHash::Digest OrbisFSHash::finalize(){
+    Digest ret = {};
+#ifdef HAVE_OPENSSL
+    if (_shaCtx) {
+        unsigned int len = sizeof(ret.sha256);
+        retassure(EVP_DigestFinal_ex((EVP_MD_CTX*)_shaCtx, ret.sha256, &len) == 1, "Failed to finalize SHA-256");
+    }
+#endif
+    if (_algos & kHashXXH64) ret.xxh64 = xxhFinalize();
+    return ret;
+}
+
+std::string OrbisFSHash::hexForSHA256(const Digest &d){
+    static const char hexchars[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(sizeof(d.sha256)*2);
+    for (uint8_t c : d.sha256) {
+        ret += hexchars[c >> 4];
+        ret += hexchars[c & 0xF];
+    }
+    return ret;
+}
+
+std::string OrbisFSHash::hexForXXH64(const Digest &d){
+    char buf[0x20] = {};
+    snprintf(buf, sizeof(buf), "%016llx",(unsigned long long)d.xxh64);
+    return buf;
+}
@@ -0,0 +1,59 @@
+//
+//  OrbisFSHash.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSHash_hpp
+#define OrbisFSHash_hpp
+
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Streaming SHA-256 (through OpenSSL, if available) and XXH64, computed side by side in one pass
+ */
+class OrbisFSHash {
+public:
+    enum : uint32_t {
+        kHashSHA256 = 1 << 0,
+        kHashXXH64  = 1 << 1
+    };
+    struct Digest {
+        uint8_t sha256[32];
+        uint64_t xxh64;
+    };
+private:
+    uint32_t _algos;
+    void *_shaCtx;
+    
+    uint64_t _xxhAcc[4];
+    uint8_t _xxhBuf[32];
+    uint32_t _xxhBufSize;
+    uint64_t _xxhTotal;
+    
+    void xxhUpdate(const uint8_t *data, size_t len);
+    uint64_t xxhFinalize();
+public:
+    OrbisFSHash(uint32_t algos);
+    ~OrbisFSHash();
+    
+    /*
+        Algorithms this build supports
+     */
+    static uint32_t availableAlgos();
+    
+    void update(const void *data, size_t len);
+    Digest finalize();
+    
+    static std::string hexForSHA256(const Digest &d);
+    static std::string hexForXXH64(const Digest &d);
+};
+
+}
+#endif /* OrbisFSHash_hpp */
@@ -6,10 +6,19 @@
 //
 
 #include "OrbisFSImage.hpp"
+#include "OrbisFSBitmap.hpp"
+#include "OrbisFSSeekableZstd.hpp"
+#include "OrbisFSStats.hpp"
+#include "OrbisFSTrace.hpp"
 #include "utils.hpp"
 
 #include <libgeneral/macros.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -33,19 +42,72 @@
 using namespace orbisFSTool;
 
 #pragma mark helper
+namespace orbisFSTool {
+struct OrbisFSCheckContext {
+    OrbisFSBitmap usedBlocks;
+    OrbisFSBitmap allocatedInodes;
+    OrbisFSBitmap directoryInodes;
+    OrbisFSBitmap referencedInodes;
+    OrbisFSBitmap multiReferencedInodes;
+    OrbisFSBitmap referencedAsDirInodes;
+    
+    /*
+        Every directory link is accounted twice: once as (child,parent) from the entry
+        in the parent and once as (dir,'..') from inside the child. If the hierarchy is
+        consistent both sums match, without having to remember any parent per inode.
+     */
+    std::atomic<uint64_t> parentLinkSum{0};
+    std::atomic<uint64_t> dotdotLinkSum{0};
+    
+    std::atomic<uint64_t> inodes{0};
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> directories{0};
+    std::atomic<uint64_t> entries{0};
+    std::atomic<uint32_t> highestInode{0};
+    std::atomic<uint32_t> rootChildren{0};
+    std::atomic<bool> failed{false};
+    unsigned threads = 0;
+    
+    OrbisFSCheckContext(uint64_t blocksCnt, uint64_t inodesCnt)
+    : usedBlocks(blocksCnt)
+    , allocatedInodes(inodesCnt), directoryInodes(inodesCnt)
+    , referencedInodes(inodesCnt), multiReferencedInodes(inodesCnt), referencedAsDirInodes(inodesCnt)
+    {}
+};
+}
+
+static uint64_t linkHash(uint32_t child, uint32_t parent){
+    uint64_t z = (((uint64_t)child << 32) | parent) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 #pragma mark OrbisFSImage
-OrbisFSImage::OrbisFSImage(const char *path, bool writeable, uint64_t offset)
-: _writeable(writeable)
-, _fd(-1)
-, _mem(NULL), _memsize(0)
+OrbisFSImage::OrbisFSImage(const char *path, bool writeable, uint64_t offset, bool verbose)
+: _writeable(writeable), _verbose(verbose)
+, _fd(-1), _fdOffset(offset)
+, _mem(NULL), _memsize(0), _zstd(NULL)
 , _superblock(NULL), _diskinfoblock(NULL)
 , _blockAllocator(nullptr)
 , _inodeDir(nullptr)
-, _references(0)
+, _references{0}
 {
 #ifndef DEBUG
     retassure(!_writeable, "Experimental write support is only available in DEBUG builds!");
 #endif
+    {
+        /*
+            Readers hold _fatLock all the time, writers need to get in between them
+         */
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&_fatLock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
     
     retassure((_fd = open(path, writeable ? O_RDWR : O_RDONLY)) != -1, "Failed to open=%s",path);
     {
@@ -81,6 +143,10 @@ OrbisFSImage::OrbisFSImage(const char *path, bool writeable, uint64_t offset)
                 if (!_memsize) _memsize = devsize;
             }
             
+        }else if (OrbisFSSeekableZstd::isSeekableZstd(_fd, st.st_size)){
+            retassure(!writeable, "Compressed images can't be opened in write mode");
+            _zstd = new OrbisFSSeekableZstd(_fd, st.st_size);
+            _memsize = _zstd->size();
         }else{
             _memsize = st.st_size;
         }
@@ -88,7 +154,13 @@ OrbisFSImage::OrbisFSImage(const char *path, bool writeable, uint64_t offset)
     retassure(_memsize, "Failed to detect image size!");
     retassure(_memsize > offset, "offset beyond image size");
     _memsize -= offset;
-    if ((_mem = (uint8_t*)mmap(NULL, _memsize, PROT_READ | PROT_WRITE, MAP_FILE | (writeable ? MAP_SHARED : MAP_PRIVATE), _fd, offset)) == MAP_FAILED){
+    if (_zstd) {
+        /*
+            offset is relative to the decompressed dump, frames are decompressed into the mapping when accessed
+         */
+        _mem = _zstd->mapping() + offset;
+    }else if ((_mem = (uint8_t*)mmap(NULL, _memsize, PROT_READ | PROT_WRITE, MAP_FILE | (writeable ? MAP_SHARED : MAP_PRIVATE), _fd, offset)) == MAP_FAILED){
+        _mem = NULL;
         reterror("Failed to mmap '%s' errno=%d (%s)",path,errno,strerror(errno));
     }
     init();
@@ -100,22 +172,28 @@ OrbisFSImage::~OrbisFSImage(){
      */
     safeDelete(_inodeDir);
     
-    {
-        std::unique_lock<std::mutex> ul(_referencesLck);
-        while (_references) {
-            debug("Waiting for open files to close, %d remaining",_references);
-            uint64_t wevent = _unrefEvent.getNextEvent();
-            ul.unlock();
-            _unrefEvent.waitForEvent(wevent);
-            ul.lock();
-        }
+    while (true) {
+        /*
+            Files only signal when the last reference goes away,
+            so grab the event before looking at the counter
+         */
+        uint64_t wevent = _unrefEvent.getNextEvent();
+        uint32_t refs = _references.load();
+        if (!refs) break;
+        debug("Waiting for open files to close, %d remaining",refs);
+        _unrefEvent.waitForEvent(wevent);
     }
     
     safeDelete(_blockAllocator);
+    if (_zstd) {
+        _mem = NULL; //owned by _zstd
+        safeDelete(_zstd);
+    }
     if (_mem){
         munmap(_mem, _memsize); _mem = NULL;
     }
     safeClose(_fd);
+    pthread_rwlock_destroy(&_fatLock);
 }
 
 #pragma mark OrbisFSImage private
@@ -125,16 +203,18 @@ void OrbisFSImage::init(){
      */
     _superblock = (OrbisFSSuperblock_t*)getBlock(0);
 
-    printf("Superblock:\n");
-    printf("\tmagic             : 0x%llx\n",_superblock->magic);
-    printf("\tunk0              : 0x%llx\n",_superblock->unk0);
-    printf("\treserve           : '%.*s'\n",(int)sizeof(_superblock->reserve),_superblock->reserve);
-    printf("\tversion           : 0x%llx\n",_superblock->version);
-    printf("\tunk2              : 0x%llx\n",_superblock->unk2);
-    printf("\tblockAllocatorLnk : type: 0x%02x blk: %d\n",_superblock->blockAllocatorLnk.type,_superblock->blockAllocatorLnk.blk);
-    printf("\tunk4              : 0x%08x\n",_superblock->unk4);
-    printf("\tunk5              : 0x%08x\n",_superblock->unk5);
-    printf("\tdiskinfoLnk       : type: 0x%02x blk: %d\n",_superblock->diskinfoLnk.type,_superblock->diskinfoLnk.blk);
+    if (_verbose) {
+        printf("Superblock:\n");
+        printf("\tmagic             : 0x%llx\n",_superblock->magic);
+        printf("\tunk0              : 0x%llx\n",_superblock->unk0);
+        printf("\treserve           : '%.*s'\n",(int)sizeof(_superblock->reserve),_superblock->reserve);
+        printf("\tversion           : 0x%llx\n",_superblock->version);
+        printf("\tunk2              : 0x%llx\n",_superblock->unk2);
+        printf("\tblockAllocatorLnk : type: 0x%02x blk: %d\n",_superblock->blockAllocatorLnk.type,_superblock->blockAllocatorLnk.blk);
+        printf("\tunk4              : 0x%08x\n",_superblock->unk4);
+        printf("\tunk5              : 0x%08x\n",_superblock->unk5);
+        printf("\tdiskinfoLnk       : type: 0x%02x blk: %d\n",_superblock->diskinfoLnk.type,_superblock->diskinfoLnk.blk);
+    }
     
     retassure(_superblock->magic == ORBIS_FS_SUPERBLOCK_MAGIC, "Bad superblock magic");
     retassure(memvcmp(_superblock->_pad1, sizeof(_superblock->_pad1), 0x00), "_pad1 is not zero");
@@ -154,8 +234,8 @@ void OrbisFSImage::init(){
     {
         uint64_t totalBlocks = _blockAllocator->getTotalBlockNum();
         uint64_t totalSize = totalBlocks * BLOCK_SIZE;
-        printf("\ttotalFSBlocks     : 0x%llx\n",totalBlocks);
-        {
+        if (_verbose) {
+            printf("\ttotalFSBlocks     : 0x%llx\n",totalBlocks);
             const char *unit = "B";
             float s = 0;
             if (totalSize >= 1e12) {
@@ -175,7 +255,7 @@ void OrbisFSImage::init(){
         }
         retassure(totalSize <= _memsize, "FS claims to use more block than the image has");
         uint64_t freeBlocks = _blockAllocator->getFreeBlocksNum();
-        printf("\tfreeBlocks        : 0x%llx\n",freeBlocks);
+        if (_verbose) printf("\tfreeBlocks        : 0x%llx\n",freeBlocks);
     }
     
     /*
@@ -183,23 +263,25 @@ void OrbisFSImage::init(){
      */
     _diskinfoblock = (OrbisFSDiskinfoblock_t*)getBlock(_superblock->diskinfoLnk.blk);
 
-    printf("Diskinfoblock:\n");
-    printf("\tmagic             : 0x%llx\n",_diskinfoblock->magic);
-    printf("\tunk1              : 0x%llx\n",_diskinfoblock->unk1_is_2);
-    printf("\tunk2              : 0x%llx\n",_diskinfoblock->unk2_is_0x40);
-    printf("\tunk3              : 0x%llx\n",_diskinfoblock->unk3_is_0);
-    printf("\tdevpath           : '%.*s'\n",(int)sizeof(_diskinfoblock->devpath),_diskinfoblock->devpath);
-    printf("\tinodesInRootFolder: 0x%x (%d)\n",_diskinfoblock->inodesInRootFolder,_diskinfoblock->inodesInRootFolder);
-    printf("\trdev              : 0x%x\n",_diskinfoblock->rdev_is_0xffffffff);
-    printf("\thighestUsedInode  : 0x%x (%d)\n",_diskinfoblock->highestUsedInode,_diskinfoblock->highestUsedInode);
-    printf("\tblocksUsed        : 0x%llx\n",_diskinfoblock->blocksUsed);
-    printf("\tblocksAvailable   : 0x%llx\n",_diskinfoblock->blocksAvailable);
+    if (_verbose) {
+        printf("Diskinfoblock:\n");
+        printf("\tmagic             : 0x%llx\n",_diskinfoblock->magic);
+        printf("\tunk1              : 0x%llx\n",_diskinfoblock->unk1_is_2);
+        printf("\tunk2              : 0x%llx\n",_diskinfoblock->unk2_is_0x40);
+        printf("\tunk3              : 0x%llx\n",_diskinfoblock->unk3_is_0);
+        printf("\tdevpath           : '%.*s'\n",(int)sizeof(_diskinfoblock->devpath),_diskinfoblock->devpath);
+        printf("\tinodesInRootFolder: 0x%x (%d)\n",_diskinfoblock->inodesInRootFolder,_diskinfoblock->inodesInRootFolder);
+        printf("\trdev              : 0x%x\n",_diskinfoblock->rdev_is_0xffffffff);
+        printf("\thighestUsedInode  : 0x%x (%d)\n",_diskinfoblock->highestUsedInode,_diskinfoblock->highestUsedInode);
+        printf("\tblocksUsed        : 0x%llx\n",_diskinfoblock->blocksUsed);
+        printf("\tblocksAvailable   : 0x%llx\n",_diskinfoblock->blocksAvailable);
 #ifdef DEBUG
-    printf("\tunk7:\n");
-    DumpHex(_diskinfoblock->unk7,sizeof(_diskinfoblock->unk7));
+        printf("\tunk7:\n");
+        DumpHex(_diskinfoblock->unk7,sizeof(_diskinfoblock->unk7));
 #endif
-    printf("\tinodedirLnk       : type: 0x%02x blk: %d\n",_diskinfoblock->inodedirLnk.type,_diskinfoblock->inodedirLnk.blk);
-    printf("\tdiskinfoLnk       : type: 0x%02x blk: %d\n",_diskinfoblock->diskinfoLnk.type,_diskinfoblock->diskinfoLnk.blk);
+        printf("\tinodedirLnk       : type: 0x%02x blk: %d\n",_diskinfoblock->inodedirLnk.type,_diskinfoblock->inodedirLnk.blk);
+        printf("\tdiskinfoLnk       : type: 0x%02x blk: %d\n",_diskinfoblock->diskinfoLnk.type,_diskinfoblock->diskinfoLnk.blk);
+    }
 
     retassure(_diskinfoblock->magic == ORBIS_FS_DISKINFOBLOCK_MAGIC, "Bad diskinfoblock magic");
     retassure(_diskinfoblock->unk1_is_2 == 2, "unexpected value for unk1");
@@ -217,8 +299,10 @@ void OrbisFSImage::init(){
 }
 
 uint8_t *OrbisFSImage::getBlock(uint32_t blknum){
+    OrbisFSStats::record(OrbisFSStats::kOpGetBlock);
     size_t offset = (size_t)blknum * BLOCK_SIZE;
     retassure(offset+BLOCK_SIZE <= _memsize, "trying to access out of bounds block");
+    if (_zstd) _zstd->populate(_fdOffset + offset, BLOCK_SIZE);
     return &_mem[offset];
 }
 
@@ -226,36 +310,319 @@ std::shared_ptr<OrbisFSFile> OrbisFSImage::openFileNode(OrbisFSInode_t *node, bo
     return std::make_shared<OrbisFSFile>(this, node, noFilemodeChecks);
 }
 
-bool OrbisFSImage::checkBlockAllocations(){
-    OrbisFSBlockAllocator va(this, _superblock->blockAllocatorLnk.blk, true);
+void OrbisFSImage::scanInodes(unsigned threads, OrbisFSCheckContext &ctx){
+    OrbisFSTrace::Span span("check.scanInodes");
+    OrbisFSInode_t *inodeRoot = _inodeDir->findInode(kOrbisFSInodeRootDirID);
+    const uint32_t inodesPerBlock = getBlocksize() / sizeof(OrbisFSInode_t);
+    const uint64_t inodesCnt = inodeRoot->filesize / sizeof(OrbisFSInode_t);
+    const uint64_t inodeBlocks = (inodeRoot->filesize + getBlocksize() - 1) / getBlocksize();
+    const uint64_t batchSize = 16;
+    std::atomic<uint64_t> nextInodeBlock{0};
+    std::vector<std::thread> workers;
+
+    auto markUsed = [&](uint32_t blk){
+        if (blk >= ctx.usedBlocks.size()) {
+            error("block %d is beyond the end of the filesystem",blk);
+            ctx.failed = true;
+        }else if (ctx.usedBlocks.set(blk)) {
+            error("block %d is referenced more than once",blk);
+            ctx.failed = true;
+        }
+    };
     
-    va.freeBlock(_superblock->blockAllocatorLnk.blk);
-    va.freeBlock(_superblock->diskinfoLnk.blk);
+    markUsed(_superblock->blockAllocatorLnk.blk);
+    markUsed(_superblock->diskinfoLnk.blk);
     {
         OrbisFSAllocatorInfoElem_t *aie = (OrbisFSAllocatorInfoElem_t*)getBlock(_superblock->blockAllocatorLnk.blk);
         uint32_t elemsCnt = getBlocksize() / sizeof(*aie);
         for (int i=0; i<elemsCnt; i++) {
             if (aie[i].bitmapBlk.type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
-            va.freeBlock(aie[i].bitmapBlk.blk);
+            markUsed(aie[i].bitmapBlk.blk);
         }
     }
+    
+    if (_diskinfoblock->highestUsedInode >= inodesCnt) {
+        error("highestUsedInode %d is beyond the end of the inode table (%llu entries)",_diskinfoblock->highestUsedInode,inodesCnt);
+        ctx.failed = true;
+    }
 
-    auto fInodes = openFileNode(_inodeDir->findInode(kOrbisFSInodeRootDirID), true);
-    {
-        OrbisFSInode_t node = {};
-        while (fInodes->read(&node, sizeof(node)) == sizeof(node)) {
-            if (node.magic != ORBIS_FS_INODE_MAGIC) continue;
-            
-            auto fnode = openFileNode(&node, true);
-            
-            auto usedBlks = fnode->getAllAllocatedBlocks();
-            for (auto b : usedBlks) {
-                va.freeBlock(b);
+    if (!threads) threads = std::thread::hardware_concurrency();
+    if (threads > (inodeBlocks + batchSize - 1) / batchSize) threads = (unsigned)((inodeBlocks + batchSize - 1) / batchSize);
+    if (!threads) threads = 1;
+    ctx.threads = threads;
+
+    /*
+        Every worker grabs a batch of inode blocks at a time, marks all blocks referenced
+        by the inodes inside and streams through the entries of every directory it finds.
+        Everything is recorded in bitmaps and counters, so nothing per-inode is kept around.
+     */
+    auto worker = [&]{
+        uint64_t myInodes = 0;
+        uint64_t myBlocks = 0;
+        uint64_t myDirs = 0;
+        uint64_t myEntries = 0;
+        uint64_t myParentLinkSum = 0;
+        uint64_t myDotdotLinkSum = 0;
+        uint32_t myHighestInode = 0;
+        try {
+            OrbisFSFile fInodes(this, inodeRoot, true);
+            while (true) {
+                uint64_t first = nextInodeBlock.fetch_add(batchSize);
+                if (first >= inodeBlocks) break;
+                uint64_t last = first + batchSize;
+                if (last > inodeBlocks) last = inodeBlocks;
+                OrbisFSTrace::Span batchSpan("check.inodeBatch", "firstBlock", first);
+                for (uint64_t b = first; b < last; b++) {
+                    OrbisFSInode_t *nodes = (OrbisFSInode_t*)fInodes.getDataBlock(b);
+                    for (uint32_t i=0; i<inodesPerBlock; i++) {
+                        uint64_t inodeNum = b*inodesPerBlock+i;
+                        if (inodeNum >= inodesCnt) break;
+                        OrbisFSInode_t *node = &nodes[i];
+                        if (node->magic != ORBIS_FS_INODE_MAGIC) continue;
+                        myInodes++;
+                        
+                        if (node->inodeNum != inodeNum) {
+                            error("inode %llu claims to be inode %d",inodeNum,node->inodeNum);
+                            ctx.failed = true;
+                            continue;
+                        }
+                        if (inodeNum > myHighestInode) myHighestInode = (uint32_t)inodeNum;
+                        if (inodeNum < ctx.allocatedInodes.size()) ctx.allocatedInodes.set(inodeNum);
+
+                        OrbisFSFile fnode(this, node, true);
+                        uint32_t nodeBlocks = 0;
+                        fnode.iterateOverAllAllocatedBlocks([&](uint32_t blk){
+                            markUsed(blk);
+                            nodeBlocks++;
+                        });
+                        myBlocks += nodeBlocks;
+                        if (nodeBlocks != node->usedBlocks) {
+                            error("inode %d claims to use %d blocks, but references %d blocks",node->inodeNum,node->usedBlocks,nodeBlocks);
+                            ctx.failed = true;
+                        }
+                        
+                        if (!S_ISDIR(node->fileMode)) continue;
+                        myDirs++;
+                        if (inodeNum < ctx.directoryInodes.size()) ctx.directoryInodes.set(inodeNum);
+                        
+                        uint32_t children = 0;
+                        uint32_t selfLinks = 0;
+                        uint32_t parentLinks = 0;
+                        bool malformed = false;
+                        OrbisFSDirectoryElem_t *elem = NULL;
+                        for (uint64_t offset = 0; offset + sizeof(*elem) < node->filesize; offset+= elem->elemSize) {
+                            elem = (OrbisFSDirectoryElem_t *)fnode.getDataForOffset(offset);
+                            /*
+                                The rest of a malformed directory can't be parsed, but the remaining inodes can
+                             */
+                            const char *bad = NULL;
+                            if (!elem->inodeNum) {
+                                bad = "unexpected zero elem";
+                            }else if (elem->elemSize < sizeof(*elem)) {
+                                bad = "elem with bad size";
+                            }else if (offset + elem->elemSize > node->filesize) {
+                                bad = "elemsize going oob";
+                            }else if (sizeof(*elem)+elem->namelen > elem->elemSize) {
+                                bad = "namelen too long";
+                            }
+                            if (bad) {
+                                error("directory %d has %s at offset 0x%llx",node->inodeNum,bad,offset);
+                                ctx.failed = true;
+                                malformed = true;
+                                break;
+                            }
+                            myEntries++;
+                            
+                            bool isSelf = elem->namelen == 1 && elem->name[0] == '.';
+                            bool isParent = elem->namelen == 2 && elem->name[0] == '.' && elem->name[1] == '.';
+                            if (isSelf) {
+                                selfLinks++;
+                                if (elem->inodeNum != node->inodeNum) {
+                                    error("'.' in directory %d points to inode %d",node->inodeNum,elem->inodeNum);
+                                    ctx.failed = true;
+                                }
+                                continue;
+                            }else if (isParent) {
+                                parentLinks++;
+                                if (node->inodeNum == kOrbisFSRootFolderID) {
+                                    if (elem->inodeNum != kOrbisFSRootFolderID) {
+                                        error("'..' in root directory points to inode %d",elem->inodeNum);
+                                        ctx.failed = true;
+                                    }
+                                }else{
+                                    myDotdotLinkSum += linkHash(node->inodeNum, elem->inodeNum);
+                                }
+                                continue;
+                            }
+                            children++;
+                            
+                            if (elem->inodeNum >= ctx.referencedInodes.size()) {
+                                error("directory %d references inode %d, which is beyond highestUsedInode",node->inodeNum,elem->inodeNum);
+                                ctx.failed = true;
+                                continue;
+                            }
+                            if (ctx.referencedInodes.set(elem->inodeNum)) {
+                                ctx.multiReferencedInodes.set(elem->inodeNum);
+                            }
+                            if (elem->type == ORBIS_FS_DIRELEM_TYPE_DIR) {
+                                ctx.referencedAsDirInodes.set(elem->inodeNum);
+                                myParentLinkSum += linkHash(elem->inodeNum, node->inodeNum);
+                            }
+                        }
+                        if (malformed) continue;
+                        if (selfLinks != 1 || parentLinks != 1) {
+                            error("directory %d has %d '.' and %d '..' entries",node->inodeNum,selfLinks,parentLinks);
+                            ctx.failed = true;
+                        }
+                        if (children != node->children) {
+                            error("directory %d claims to have %d children, but has %d entries",node->inodeNum,node->children,children);
+                            ctx.failed = true;
+                        }
+                        if (node->inodeNum == kOrbisFSRootFolderID) {
+                            ctx.rootChildren = children;
+                        }
+                    }
+                }
             }
+        } catch (tihmstar::exception &e) {
+            error("check worker failed with error: %s",e.what());
+            ctx.failed = true;
+        } catch (std::exception &e) {
+            error("check worker failed with error: %s",e.what());
+            ctx.failed = true;
+        } catch (...) {
+            error("check worker failed with an unknown exception");
+            ctx.failed = true;
         }
+        /*
+            Whatever was scanned still counts, even if the worker gave up early
+         */
+        ctx.inodes += myInodes;
+        ctx.blocks += myBlocks;
+        ctx.directories += myDirs;
+        ctx.entries += myEntries;
+        ctx.parentLinkSum += myParentLinkSum;
+        ctx.dotdotLinkSum += myDotdotLinkSum;
+        {
+            uint32_t cur = ctx.highestInode.load();
+            while (cur < myHighestInode && !ctx.highestInode.compare_exchange_weak(cur, myHighestInode));
+        }
+    };
+    
+    for (unsigned i=0; i<threads; i++) {
+        workers.emplace_back(worker);
     }
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+bool OrbisFSImage::checkBlockAllocations(OrbisFSBitmap &usedBlocks){
+    OrbisFSTrace::Span span("check.blockAllocations");
+    bool ret = true;
     
-    return va.getFreeBlocksNum()+1 == va.getTotalBlockNum();
+    /*
+        Diff our view against the on-disk bitmaps, 64 blocks at a time.
+        A block is expected to be marked free exactly when nobody references it.
+     */
+    OrbisFSAllocatorInfoElem_t *aie = (OrbisFSAllocatorInfoElem_t*)getBlock(_superblock->blockAllocatorLnk.blk);
+    uint32_t elemsCnt = getBlocksize() / sizeof(*aie);
+    uint64_t base = 0;
+    uint64_t leakedBlocks = 0;
+    uint64_t usedFreeBlocks = 0;
+    for (int i=0; i<elemsCnt; i++) {
+        if (aie[i].bitmapBlk.type != ORBIS_FS_CHAINLINK_TYPE_LINK) break;
+        const uint8_t *bitmap = getBlock(aie[i].bitmapBlk.blk);
+        uint64_t diskFreeCnt = 0;
+        retassure(aie[i].totalBlocks <= getBlocksize()*8, "allocator %d claims more blocks than fit in its bitmap",i);
+        for (uint64_t off = 0; off < aie[i].totalBlocks; off += 64) {
+            uint64_t diskFree = 0;
+            uint64_t valid = ~0ULL;
+            if (aie[i].totalBlocks - off < 64) valid = (1ULL << (aie[i].totalBlocks - off)) - 1;
+            memcpy(&diskFree, &bitmap[off/8], (off+64 <= getBlocksize()*8) ? sizeof(diskFree) : (getBlocksize()-off/8));
+            diskFree &= valid;
+            uint64_t used = usedBlocks.getWord(base + off) & valid;
+            
+            diskFreeCnt += __builtin_popcountll(diskFree);
+            leakedBlocks += __builtin_popcountll(~diskFree & ~used & valid);
+            usedFreeBlocks += __builtin_popcountll(diskFree & used);
+        }
+        if (diskFreeCnt != aie[i].freeBlocks) {
+            error("allocator %d claims %d free blocks, but bitmap has %llu free blocks",i,aie[i].freeBlocks,diskFreeCnt);
+            ret = false;
+        }
+        base += aie[i].totalBlocks;
+    }
+    if (leakedBlocks) {
+        error("%llu blocks are allocated, but not referenced by anything",leakedBlocks);
+        ret = false;
+    }
+    if (usedFreeBlocks) {
+        error("%llu blocks are referenced, but marked as free",usedFreeBlocks);
+        ret = false;
+    }
+    return ret;
+}
+
+bool OrbisFSImage::checkTree(OrbisFSCheckContext &ctx){
+    OrbisFSTrace::Span span("check.tree");
+    bool ret = true;
+    uint64_t orphans = 0;
+    uint64_t dangling = 0;
+    uint64_t badTypes = 0;
+    uint64_t multiLinkedDirs = 0;
+    
+    if (ctx.rootChildren != _diskinfoblock->inodesInRootFolder) {
+        error("diskinfo claims %d inodes in root folder, but root folder has %d entries",_diskinfoblock->inodesInRootFolder,ctx.rootChildren.load());
+        ret = false;
+    }
+    if (ctx.highestInode > _diskinfoblock->highestUsedInode) {
+        error("inode %d is in use, but highestUsedInode is %d",ctx.highestInode.load(),_diskinfoblock->highestUsedInode);
+        ret = false;
+    }
+    if (ctx.parentLinkSum != ctx.dotdotLinkSum) {
+        error("'..' entries of directories do not match the directories they are linked from");
+        ret = false;
+    }
+
+    for (uint64_t i=0; i<ctx.allocatedInodes.size(); i+=64) {
+        uint64_t allocated = ctx.allocatedInodes.getWord(i);
+        uint64_t dirs = ctx.directoryInodes.getWord(i);
+        uint64_t referenced = ctx.referencedInodes.getWord(i);
+        uint64_t multiReferenced = ctx.multiReferencedInodes.getWord(i);
+        uint64_t referencedAsDir = ctx.referencedAsDirInodes.getWord(i);
+        uint64_t checkOrphans = ~0ULL;
+        
+        /*
+            Reserved inodes don't need to be linked anywhere, except for lost+found
+         */
+        if (i < kOrbisFSFirstUserNodeID) {
+            checkOrphans = ~((1ULL << kOrbisFSFirstUserNodeID) - 1) | (1ULL << kOrbisFSLostAndFoundDirID);
+        }
+
+        orphans += __builtin_popcountll(allocated & ~referenced & checkOrphans);
+        dangling += __builtin_popcountll(referenced & ~allocated);
+        badTypes += __builtin_popcountll(allocated & referenced & (dirs ^ referencedAsDir));
+        multiLinkedDirs += __builtin_popcountll(dirs & multiReferenced);
+    }
+    
+    if (orphans) {
+        error("%llu inodes are allocated, but not linked from any directory",orphans);
+        ret = false;
+    }
+    if (dangling) {
+        error("%llu directory entries point to unallocated inodes",dangling);
+        ret = false;
+    }
+    if (badTypes) {
+        error("%llu directory entries have a type which doesn't match their inode",badTypes);
+        ret = false;
+    }
+    if (multiLinkedDirs) {
+        error("%llu directories are linked from more than one directory",multiLinkedDirs);
+        ret = false;
+    }
+    return ret;
 }
 
 void OrbisFSImage::freeBlock(uint32_t blk){
@@ -263,6 +630,12 @@ void OrbisFSImage::freeBlock(uint32_t blk){
     _diskinfoblock->blocksUsed--;
 }
 
+std::vector<uint32_t> OrbisFSImage::allocateBlocks(uint32_t count){
+    std::vector<uint32_t> ret = _blockAllocator->allocateBlocks(count);
+    _diskinfoblock->blocksUsed += ret.size();
+    return ret;
+}
+
 #pragma mark OrbisFSImage public
 bool OrbisFSImage::isWriteable(){
     return _writeable;
@@ -272,6 +645,53 @@ uint32_t OrbisFSImage::getBlocksize(){
     return BLOCK_SIZE;
 }
 
+int OrbisFSImage::getFd(){
+    return _zstd ? -1 : _fd;
+}
+
+uint64_t OrbisFSImage::getFdOffset(){
+    return _fdOffset;
+}
+
+bool OrbisFSImage::isCompressed(){
+    return _zstd != NULL;
+}
+
+void OrbisFSImage::readRaw(uint64_t offset, void *buf, size_t len){
+    retassure(offset <= _memsize && len <= _memsize - offset, "trying to read out of bounds range 0x%llx-0x%llx",offset,offset+len);
+    if (_zstd) {
+        uint8_t *dst = (uint8_t*)buf;
+        _zstd->iterate(_fdOffset + offset, len, [&](const void *data, size_t curLen){
+            memcpy(dst, data, curLen);
+            dst += curLen;
+        });
+        return;
+    }
+    preadAll(_fd, buf, len, _fdOffset+offset);
+}
+
+void OrbisFSImage::iterateOverRaw(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback){
+    retassure(offset <= _memsize && len <= _memsize - offset, "trying to access out of bounds range 0x%llx-0x%llx",offset,offset+len);
+    if (!len) return;
+    if (_zstd) {
+        _zstd->iterate(_fdOffset + offset, len, callback);
+    }else{
+        /*
+            The image is mapped in one piece, so contiguous blocks are contiguous in memory too
+         */
+        callback(&_mem[offset], len);
+    }
+}
+
+void OrbisFSImage::prefetch(uint64_t offset, uint64_t len){
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    if (_zstd) return; //nothing to ask the kernel for, frames are decompressed on access
+    if (offset >= _memsize || !len) return;
+    if (len > _memsize - offset) len = _memsize - offset;
+    uint64_t start = offset & ~(pageSize-1);
+    madvise(_mem + start, len + (offset - start), MADV_WILLNEED);
+}
+
 std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSImage::listFilesInFolder(std::string path, bool includeSelfAndParent){
     return _inodeDir->listFilesInDir(_inodeDir->findInodeIDForPath(path), includeSelfAndParent);
 }
@@ -280,14 +700,28 @@ std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSImage::listFilesInFol
     return _inodeDir->listFilesInDir(inode, includeSelfAndParent);
 }
 
+void OrbisFSImage::iterateOverDirectory(uint32_t inode, std::function<void(const char *name, size_t namelen, const OrbisFSInode_t *node)> callback){
+    _inodeDir->iterateOverDir(inode, callback);
+}
+
 OrbisFSInode_t OrbisFSImage::getInodeForID(uint32_t inode){
     return *_inodeDir->findInode(inode);
 }
 
+void OrbisFSImage::updateInode(uint32_t inode, std::function<void(OrbisFSInode_t *node)> update){
+    retassure(_writeable, "Image is not writeable");
+    std::unique_lock<std::mutex> ul(_writeLock);
+    update(_inodeDir->findInode(inode));
+}
+
 OrbisFSInode_t OrbisFSImage::getInodeForPath(std::string path){
     return *_inodeDir->findInodeForPath(path);
 }
 
+OrbisFSInode_t OrbisFSImage::getInodeInFolder(uint32_t folderInode, std::string name){
+    return *_inodeDir->findChildInDirectory(_inodeDir->findInode(folderInode), name);
+}
+
 std::shared_ptr<OrbisFSFile> OrbisFSImage::openFileID(uint32_t inode){
     return openFileNode(_inodeDir->findInode(inode));
 }
@@ -341,13 +775,36 @@ void OrbisFSImage::iterateOverFilesInFolder(std::string path, bool recursive, st
     }while(files.size());
 }
 
-bool OrbisFSImage::check(){
+bool OrbisFSImage::check(unsigned threads){
+    /*
+        highestUsedInode comes from the image, don't let it size the bitmaps beyond the inode table
+     */
+    const uint64_t inodesCnt = std::min<uint64_t>((uint64_t)_diskinfoblock->highestUsedInode+1,
+                                                  _inodeDir->findInode(kOrbisFSInodeRootDirID)->filesize / sizeof(OrbisFSInode_t));
+    OrbisFSCheckContext ctx(_blockAllocator->getTotalBlockNum(), inodesCnt);
+    auto tstart = std::chrono::steady_clock::now();
+    
+    info("Scanning inodes and directories...");
+    scanInodes(threads, ctx);
+    {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+        if (secs <= 0) secs = 1e-9;
+        info("Scanned %llu inodes (%llu directories, %llu entries) referencing %llu blocks in %.3f sec using %u threads (%.0f inodes/s, %.0f blocks/s)",
+             ctx.inodes.load(), ctx.directories.load(), ctx.entries.load(), ctx.blocks.load(), secs, ctx.threads,
+             ctx.inodes.load()/secs, ctx.blocks.load()/secs);
+    }
+    
+    /*
+        Every phase runs, so one pass reports everything that is wrong with the image
+     */
+    bool ret = !ctx.failed;
+    
     info("Checking block allocations...");
-    if (!checkBlockAllocations()) goto fail;
+    ret &= checkBlockAllocations(ctx.usedBlocks);
+    
+    info("Checking directory tree...");
+    ret &= checkTree(ctx);
     
-success:
-    return true;
-fail:
-    error("check failed!");
-    return false;
+    if (!ret) error("check failed!");
+    return ret;
 }
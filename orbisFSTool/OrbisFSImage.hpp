@@ -18,19 +18,29 @@
 #include <vector>
 #include <iostream>
 #include <memory>
+#include <atomic>
 #include <mutex>
 #include <functional>
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 
 namespace orbisFSTool {
+class OrbisFSBitmap;
+class OrbisFSDedup;
+class OrbisFSDumper;
+class OrbisFSSeekableZstd;
+struct OrbisFSCheckContext;
 
 class OrbisFSImage{
     bool _writeable;
+    bool _verbose;
     int _fd;
+    uint64_t _fdOffset;
     uint8_t *_mem;
     size_t _memsize;
+    OrbisFSSeekableZstd *_zstd;
     
     OrbisFSSuperblock_t *_superblock;
     OrbisFSDiskinfoblock_t *_diskinfoblock;
@@ -38,31 +48,75 @@ class OrbisFSImage{
     OrbisFSBlockAllocator *_blockAllocator;
     OrbisFSInodeDirectory *_inodeDir;
     
-    uint32_t _references;
-    std::mutex _referencesLck;
+    std::atomic<uint32_t> _references;
     tihmstar::Event _unrefEvent;
     
+    std::mutex _writeLock;
+    pthread_rwlock_t _fatLock; //exclusive while a FAT is restructured, shared while walking one on writeable images
+    
     void init();
     uint8_t *getBlock(uint32_t blknum);
     std::shared_ptr<OrbisFSFile> openFileNode(OrbisFSInode_t *node, bool noFilemodeChecks = false);
-    bool checkBlockAllocations();
+    void scanInodes(unsigned threads, OrbisFSCheckContext &ctx);
+    bool checkBlockAllocations(OrbisFSBitmap &usedBlocks);
+    bool checkTree(OrbisFSCheckContext &ctx);
     void freeBlock(uint32_t blk);
+    std::vector<uint32_t> allocateBlocks(uint32_t count);
 public:
-    OrbisFSImage(const char *path, bool writeable, uint64_t offset = 0);
+    /*
+        verbose prints superblock and diskinfo while opening
+     */
+    OrbisFSImage(const char *path, bool writeable, uint64_t offset = 0, bool verbose = true);
     ~OrbisFSImage();
     
     bool isWriteable();
     uint32_t getBlocksize();
     
+    /*
+        Backing file descriptor and the offset of the filesystem inside it,
+        allows moving file data without going through the mapping.
+        -1 for compressed images, use readRaw() for those
+     */
+    int getFd();
+    uint64_t getFdOffset();
+    bool isCompressed();
+    
+    /*
+        Reads len bytes at offset (relative to the start of the filesystem) without going through the mapping
+     */
+    void readRaw(uint64_t offset, void *buf, size_t len);
+    
+    /*
+        Zero copy access to a range (relative to the start of the filesystem), data is only valid during the callback.
+        Unlike getBlock this doesn't keep decompressed data of compressed images around
+     */
+    void iterateOverRaw(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback);
+    
+    /*
+        Asks the kernel to start reading the range (relative to the start of the filesystem) in the background
+     */
+    void prefetch(uint64_t offset, uint64_t len);
+    
     std::vector<std::pair<std::string, OrbisFSInode_t>> listFilesInFolder(std::string path, bool includeSelfAndParent = false);
     std::vector<std::pair<std::string, OrbisFSInode_t>> listFilesInFolder(uint32_t inode, bool includeSelfAndParent = false);
+
+    /*
+        Unsorted, without copying anything. name is not NUL terminated, node points into the image
+     */
+    void iterateOverDirectory(uint32_t inode, std::function<void(const char *name, size_t namelen, const OrbisFSInode_t *node)> callback);
     
     OrbisFSInode_t getInodeForID(uint32_t inode);
     OrbisFSInode_t getInodeForPath(std::string path);
+    OrbisFSInode_t getInodeInFolder(uint32_t folderInode, std::string name);
+
+    /*
+        Changes the inode in place, update runs under the write lock
+     */
+    void updateInode(uint32_t inode, std::function<void(OrbisFSInode_t *node)> update);
 
     void iterateOverFilesInFolder(std::string path, bool recursive, std::function<void(std::string path, OrbisFSInode_t node)> callback);
     
-    bool check();
+    bool check(unsigned threads = 0);
     
 #pragma mark files
     std::shared_ptr<OrbisFSFile> openFileID(uint32_t inode);
@@ -71,6 +125,8 @@ public:
     
 #pragma mark friends
     friend OrbisFSBlockAllocator;
+    friend OrbisFSDedup;
+    friend OrbisFSDumper;
     friend OrbisFSFile;
     friend OrbisFSInodeDirectory;
 };
@@ -0,0 +1,774 @@
+//
+//  OrbisFSImageBuilder.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSImageBuilder.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define IMAGE_BLOCK_SIZE 0x10000
+#define OUT_BUFFER_SIZE (8*1024*1024)
+#define RESERVE_BLOCKS 16   //spare blocks in images without an explicit size, so they can be written to
+#define MAX_NAME_LEN 255
+#define MAX_FAT_STAGES 3
+#define MIN_SPARSE_HOLE (1024*1024)    //shorter runs of zeros are simply written
+#define SYNTHETIC_DATE 1700000000      //all synthetic nodes get the same dates, so images are reproducible
+#define FRAGMENT_GROUP 8               //number of neighbouring files whose blocks get interleaved
+
+using namespace orbisFSTool;
+
+static OrbisFSChainLink_t linkForBlock(uint32_t blk){
+    OrbisFSChainLink_t ret = {};
+    ret.blk = blk;
+    ret.type = ORBIS_FS_CHAINLINK_TYPE_LINK;
+    return ret;
+}
+
+static uint32_t elemSizeForName(size_t namelen){
+    uint32_t ret = (uint32_t)((sizeof(OrbisFSDirectoryElem_t) + namelen + 0xF) & ~0xF);
+    if (ret < ORBIS_FS_DIRELEM_ELEMSIZE_MIN) ret = ORBIS_FS_DIRELEM_ELEMSIZE_MIN;
+    return ret;
+}
+
+static uint64_t splitmix64(uint64_t &state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+    Level 0 is the data, level i holds the fat blocks pointing into level i-1.
+    Fat blocks are stored level by level right in front of the data.
+    With fatStart 0 and dataStart set to the number of fat blocks, this yields indices into Node::blocks.
+ */
+static void fatLevels(uint32_t fatStart, uint32_t dataStart, uint32_t dataBlocks, uint32_t stages, uint32_t linkElemsPerPage,
+                      uint32_t start[MAX_FAT_STAGES], uint32_t cnt[MAX_FAT_STAGES]){
+    start[0] = dataStart;
+    cnt[0] = dataBlocks;
+    uint32_t next = fatStart;
+    for (uint32_t i=1; i<stages; i++) {
+        start[i] = next;
+        cnt[i] = (cnt[i-1] + linkElemsPerPage - 1) / linkElemsPerPage;
+        next += cnt[i];
+    }
+}
+
+#pragma mark OrbisFSImageBuilder::SyntheticSpec
+OrbisFSImageBuilder::SyntheticSpec::SyntheticSpec()
+: seed(0), files(1000), fanout(16), maxFileSize(1024*1024)
+, largeFiles(0), hugeFile(false), fragmentExtent(0)
+{
+    //
+}
+
+#pragma mark OrbisFSImageBuilder
+OrbisFSImageBuilder::OrbisFSImageBuilder(const char *hostDir, uint64_t imageSize)
+: _hostDir(hostDir), _synthetic(false), _requestedSize(imageSize)
+, _blockSize(IMAGE_BLOCK_SIZE), _linkElemsPerPage(IMAGE_BLOCK_SIZE/sizeof(OrbisFSChainLink_t))
+, _bitmapBlocks(0), _usedBlocks(0), _imageBlocks(0)
+, _outfd(-1), _outSparse(false), _outBufStart{0,0}, _outFill(0), _outCur(0), _outPos(0), _outHole(0)
+, _outPending{0,0}, _outErrno(0), _outStop(false)
+, _hostfd(-1), _hostfdNode(0)
+{
+    retassure(_hostDir.size(), "No host directory specified");
+    retassure(!_requestedSize || _requestedSize % _blockSize == 0, "Image size needs to be a multiple of 0x%x",_blockSize);
+}
+
+OrbisFSImageBuilder::OrbisFSImageBuilder(const SyntheticSpec &spec, uint64_t imageSize)
+: _spec(spec), _synthetic(true), _requestedSize(imageSize)
+, _blockSize(IMAGE_BLOCK_SIZE), _linkElemsPerPage(IMAGE_BLOCK_SIZE/sizeof(OrbisFSChainLink_t))
+, _bitmapBlocks(0), _usedBlocks(0), _imageBlocks(0)
+, _outfd(-1), _outSparse(false), _outBufStart{0,0}, _outFill(0), _outCur(0), _outPos(0), _outHole(0)
+, _outPending{0,0}, _outErrno(0), _outStop(false)
+, _hostfd(-1), _hostfdNode(0)
+{
+    retassure(_spec.fanout, "Directory fan-out needs to be at least 1");
+    retassure(!_requestedSize || _requestedSize % _blockSize == 0, "Image size needs to be a multiple of 0x%x",_blockSize);
+}
+
+OrbisFSImageBuilder::~OrbisFSImageBuilder(){
+    if (_outWriter.joinable()) {
+        {
+            std::unique_lock<std::mutex> ul(_outLock);
+            _outStop = true;
+        }
+        _outCond.notify_all();
+        _outWriter.join();
+    }
+    safeClose(_hostfd);
+    safeClose(_outfd);
+}
+
+#pragma mark OrbisFSImageBuilder private
+uint32_t OrbisFSImageBuilder::newNode(uint32_t inodeNum, uint32_t parent, const std::string &name, const std::string &hostPath, const struct stat &st){
+    if (!inodeNum) inodeNum = std::max<uint32_t>((uint32_t)_nodes.size(), kOrbisFSFirstUserNodeID);
+    if (_nodes.size() <= inodeNum) _nodes.resize(inodeNum+1);
+
+    Node &node = _nodes[inodeNum];
+    retassure(node.inode.magic != ORBIS_FS_INODE_MAGIC, "inode %d was already created",inodeNum);
+    node.hostPath = hostPath;
+    node.name = name;
+    node.parent = parent;
+    node.source = S_ISDIR(st.st_mode) ? kSourceContent : kSourceHost;
+    node.blocks.clear();
+    node.fatBlocks = node.dataBlocks = 0;
+
+    OrbisFSInode_t &inode = node.inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.magic = ORBIS_FS_INODE_MAGIC;
+    inode.inodeNum = inodeNum;
+    inode.fileMode = (st.st_mode & 07777) | (S_ISDIR(st.st_mode) ? S_IFDIR : S_IFREG);
+    inode.uid = st.st_uid;
+    inode.gid = st.st_gid;
+    inode.birthCnt = 1;
+    inode.type = S_ISDIR(st.st_mode) ? ORBIS_FS_INODE_TYPE_DIRECTORY : ORBIS_FS_INODE_TYPE_FILE;
+    inode.createDate = st.st_mtime;
+    inode.modDate = st.st_mtime;
+    inode.accessDate = st.st_atime;
+    memset(inode.resourceLnk, 0xFF, sizeof(inode.resourceLnk));
+    memset(inode.dataLnk, 0xFF, sizeof(inode.dataLnk));
+    if (!S_ISDIR(st.st_mode)) inode.filesize = st.st_size;
+    return inodeNum;
+}
+
+void OrbisFSImageBuilder::scanDir(uint32_t dirNum){
+    std::string path = _nodes[dirNum].hostPath;
+    std::vector<std::string> names;
+    {
+        DIR *dir = NULL;
+        cleanup([&]{
+            safeFreeCustom(dir, closedir);
+        });
+        struct dirent *ent = NULL;
+        retassure(dir = opendir(path.c_str()), "Failed to open dir '%s' errno=%d (%s)",path.c_str(),errno,strerror(errno));
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+            names.push_back(ent->d_name);
+        }
+    }
+    std::sort(names.begin(), names.end());
+
+    for (auto &name : names) {
+        std::string childPath = path + "/" + name;
+        struct stat st = {};
+        retassure(name.size() <= MAX_NAME_LEN, "Name of '%s' is too long",childPath.c_str());
+        retassure(!lstat(childPath.c_str(), &st), "Failed to stat '%s' errno=%d (%s)",childPath.c_str(),errno,strerror(errno));
+
+        uint32_t child = 0;
+        if (S_ISDIR(st.st_mode) && dirNum == kOrbisFSRootFolderID && name == "lost+found") {
+            child = newNode(kOrbisFSLostAndFoundDirID, dirNum, name, childPath, st);
+        }else if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+            child = newNode(0, dirNum, name, childPath, st);
+        }else{
+            error("Skipping '%s' with unsupported file mode 0%o",childPath.c_str(),st.st_mode);
+            continue;
+        }
+        _nodes[dirNum].children.push_back(child);
+        if (S_ISDIR(st.st_mode)) scanDir(child);
+    }
+}
+
+void OrbisFSImageBuilder::scanHost(){
+    struct stat st = {};
+    retassure(!stat(_hostDir.c_str(), &st), "Failed to stat '%s' errno=%d (%s)",_hostDir.c_str(),errno,strerror(errno));
+    retassure(S_ISDIR(st.st_mode), "'%s' is not a directory",_hostDir.c_str());
+
+    _nodes.clear();
+    _nodes.resize(kOrbisFSFirstUserNodeID);
+    newNode(kOrbisFSRootFolderID, kOrbisFSRootFolderID, "", _hostDir, st);
+    scanDir(kOrbisFSRootFolderID);
+
+    if (_nodes[kOrbisFSLostAndFoundDirID].inode.magic != ORBIS_FS_INODE_MAGIC) {
+        struct stat lst = st;
+        lst.st_mode = S_IFDIR | 0755;
+        uint32_t lostAndFound = newNode(kOrbisFSLostAndFoundDirID, kOrbisFSRootFolderID, "lost+found", "", lst);
+        Node &root = _nodes[kOrbisFSRootFolderID];
+        root.children.push_back(lostAndFound);
+        std::sort(root.children.begin(), root.children.end(), [&](uint32_t a, uint32_t b){
+            return _nodes[a].name < _nodes[b].name;
+        });
+    }
+}
+
+void OrbisFSImageBuilder::generateSynthetic(){
+    uint64_t rng = _spec.seed;
+    const uint32_t fanout = _spec.fanout;
+    const uint32_t totalFiles = _spec.files + _spec.largeFiles + (_spec.hugeFile ? 1 : 0);
+    const uint64_t directLinks = sizeof(OrbisFSInode_t::dataLnk)/sizeof(*OrbisFSInode_t::dataLnk);
+    char name[0x20] = {};
+
+    struct stat st = {};
+    st.st_mode = S_IFDIR | 0755;
+    st.st_mtime = st.st_atime = SYNTHETIC_DATE;
+
+    _nodes.clear();
+    _nodes.resize(kOrbisFSFirstUserNodeID);
+    newNode(kOrbisFSRootFolderID, kOrbisFSRootFolderID, "", "", st);
+    uint32_t lostAndFound = newNode(kOrbisFSLostAndFoundDirID, kOrbisFSRootFolderID, "lost+found", "", st);
+    _nodes[kOrbisFSRootFolderID].children.push_back(lostAndFound);
+
+    /*
+        Directories form a tree with fanout subdirectories each (heap order), directory i holds files i*fanout to i*fanout+fanout-1
+     */
+    std::vector<uint32_t> dirs{kOrbisFSRootFolderID};
+    uint64_t dirsNeeded = std::max<uint64_t>(1, ((uint64_t)totalFiles + fanout - 1) / fanout);
+    for (uint64_t d=1; d<dirsNeeded; d++) {
+        uint32_t parent = dirs[(d-1)/fanout];
+        snprintf(name, sizeof(name), "d%06llu",d);
+        uint32_t dir = newNode(0, parent, name, "", st);
+        _nodes[parent].children.push_back(dir);
+        dirs.push_back(dir);
+    }
+
+    struct stat fst = st;
+    fst.st_mode = S_IFREG | 0644;
+    for (uint32_t i=0; i<totalFiles; i++) {
+        Source source = kSourceSynthetic;
+        if (i < _spec.files) {
+            fst.st_size = (off_t)(_spec.maxFileSize ? splitmix64(rng) % (_spec.maxFileSize+1) : 0);
+        }else if (i < _spec.files + _spec.largeFiles) {
+            //more blocks than direct links, but a single fat level is enough
+            fst.st_size = (off_t)(directLinks*_blockSize + 1 + splitmix64(rng) % (7*directLinks*_blockSize));
+        }else{
+            fst.st_size = (off_t)((directLinks*_linkElemsPerPage + 1) * _blockSize);
+            source = kSourceZero;
+        }
+        uint32_t dir = dirs[i / fanout];
+        snprintf(name, sizeof(name), "f%07u",i);
+        uint32_t file = newNode(0, dir, name, "", fst);
+        _nodes[file].source = source;
+        _nodes[dir].children.push_back(file);
+    }
+
+    for (uint32_t dir : dirs) {
+        auto &children = _nodes[dir].children;
+        std::sort(children.begin(), children.end(), [&](uint32_t a, uint32_t b){
+            return _nodes[a].name < _nodes[b].name;
+        });
+    }
+}
+
+void OrbisFSImageBuilder::buildDirectoryContent(Node &dir){
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    entries.push_back({".", (uint32_t)dir.inode.inodeNum});
+    entries.push_back({"..", dir.parent});
+    for (uint32_t c : dir.children) {
+        entries.push_back({_nodes[c].name, c});
+    }
+
+    dir.content.clear();
+    size_t lastElem = 0;
+    for (auto &e : entries) {
+        uint32_t elemSize = elemSizeForName(e.first.size());
+        size_t blockLeft = _blockSize - (dir.content.size() % _blockSize);
+        if (elemSize > blockLeft) {
+            /*
+                Elements never cross a block boundary, the previous one absorbs the rest of the block
+             */
+            ((OrbisFSDirectoryElem_t*)&dir.content[lastElem])->elemSize += (uint32_t)blockLeft;
+            dir.content.resize(dir.content.size() + blockLeft);
+        }
+        lastElem = dir.content.size();
+        dir.content.resize(dir.content.size() + elemSize);
+        OrbisFSDirectoryElem_t *elem = (OrbisFSDirectoryElem_t*)&dir.content[lastElem];
+        elem->inodeNum = e.second;
+        elem->unk0_is_0x00100000 = 0x00100000;
+        elem->elemSize = elemSize;
+        elem->namelen = (uint16_t)e.first.size();
+        elem->type = S_ISDIR(_nodes[e.second].inode.fileMode) ? ORBIS_FS_DIRELEM_TYPE_DIR : ORBIS_FS_DIRELEM_TYPE_REG;
+        memcpy(elem->name, e.first.data(), e.first.size());
+    }
+    dir.inode.filesize = dir.content.size();
+    dir.inode.children = (uint32_t)dir.children.size();
+}
+
+void OrbisFSImageBuilder::placeNode(Node &node, uint64_t size){
+    uint64_t dataBlocks = (size + _blockSize - 1) / _blockSize;
+    node.inode.filesize = size;
+    node.blocks.clear();
+    node.fatBlocks = 0;
+    node.dataBlocks = 0;
+    node.inode.fatStages = 0;
+    node.inode.usedBlocks = 0;
+    if (!dataBlocks) return;
+
+    uint32_t stages = 1;
+    uint64_t capacity = sizeof(node.inode.dataLnk)/sizeof(*node.inode.dataLnk);
+    while (dataBlocks > capacity) {
+        stages++;
+        capacity *= _linkElemsPerPage;
+        retassure(stages <= MAX_FAT_STAGES, "'%s' is too large",node.hostPath.c_str());
+    }
+
+    uint32_t start[MAX_FAT_STAGES] = {};
+    uint32_t cnt[MAX_FAT_STAGES] = {};
+    fatLevels(0, 0, (uint32_t)dataBlocks, stages, _linkElemsPerPage, start, cnt);
+    for (uint32_t i=1; i<stages; i++) node.fatBlocks += cnt[i];
+
+    retassure((uint64_t)_usedBlocks + node.fatBlocks + dataBlocks < (1ULL<<24), "Image would exceed the maximum number of blocks");
+    node.dataBlocks = (uint32_t)dataBlocks;
+    node.inode.fatStages = stages;
+    node.inode.usedBlocks = node.fatBlocks + node.dataBlocks;
+    node.blocks.resize(node.inode.usedBlocks);
+    for (uint32_t i=0; i<node.inode.usedBlocks; i++) {
+        node.blocks[i] = _usedBlocks++;
+    }
+    _order.push_back(node.inode.inodeNum);
+}
+
+void OrbisFSImageBuilder::fragment(){
+    /*
+        The blocks of FRAGMENT_GROUP neighbouring files are handed out round robin in extents,
+        so every file ends up interleaved with its neighbours. Directories stay where they are.
+     */
+    const uint32_t extent = _spec.fragmentExtent;
+    std::vector<uint32_t> group;
+    auto interleave = [&]{
+        std::vector<uint32_t> pool;
+        for (uint32_t num : group) {
+            pool.insert(pool.end(), _nodes[num].blocks.begin(), _nodes[num].blocks.end());
+        }
+        std::sort(pool.begin(), pool.end());
+        std::vector<size_t> assigned(group.size(), 0);
+        size_t next = 0;
+        while (next < pool.size()) {
+            for (size_t i=0; i<group.size(); i++) {
+                auto &blocks = _nodes[group[i]].blocks;
+                for (uint32_t k=0; k<extent && assigned[i] < blocks.size(); k++) {
+                    blocks[assigned[i]++] = pool[next++];
+                }
+            }
+        }
+        group.clear();
+    };
+    for (uint32_t num : _order) {
+        if (S_ISDIR(_nodes[num].inode.fileMode) || num == kOrbisFSInodeRootDirID) continue;
+        group.push_back(num);
+        if (group.size() == FRAGMENT_GROUP) interleave();
+    }
+    if (group.size()) interleave();
+}
+
+void OrbisFSImageBuilder::linkNode(Node &node){
+    if (!node.inode.fatStages) return;
+    uint32_t start[MAX_FAT_STAGES] = {};
+    uint32_t cnt[MAX_FAT_STAGES] = {};
+    uint32_t top = node.inode.fatStages-1;
+    fatLevels(0, node.fatBlocks, node.dataBlocks, node.inode.fatStages, _linkElemsPerPage, start, cnt);
+    retassure(cnt[top] <= sizeof(node.inode.dataLnk)/sizeof(*node.inode.dataLnk), "Too many top level links");
+    for (uint32_t i=0; i<cnt[top]; i++) {
+        node.inode.dataLnk[i] = linkForBlock(node.blocks[start[top]+i]);
+    }
+}
+
+void OrbisFSImageBuilder::layout(){
+    for (auto &n : _nodes) {
+        if (n.inode.magic == ORBIS_FS_INODE_MAGIC && S_ISDIR(n.inode.fileMode)) buildDirectoryContent(n);
+    }
+
+    uint64_t inodeTableSize = (uint64_t)_nodes.size() * sizeof(OrbisFSInode_t);
+    inodeTableSize = (inodeTableSize + _blockSize - 1) / _blockSize * _blockSize;
+
+    /*
+        The number of bitmap blocks depends on the image size, which depends on the number of bitmap blocks
+     */
+    _bitmapBlocks = 1;
+    while (true) {
+        _order.clear();
+        _usedBlocks = 3 + _bitmapBlocks; //superblock, allocator, diskinfo, bitmaps
+
+        /*
+            Inode table first, then all nodes in tree order, so reading the tree reads the disk front to back
+         */
+        placeNode(_nodes[kOrbisFSInodeRootDirID], inodeTableSize);
+        std::vector<uint32_t> todo{kOrbisFSRootFolderID};
+        while (todo.size()) {
+            Node &n = _nodes[todo.back()];
+            todo.pop_back();
+            placeNode(n, S_ISDIR(n.inode.fileMode) ? n.content.size() : n.inode.filesize);
+            todo.insert(todo.end(), n.children.rbegin(), n.children.rend());
+        }
+
+        uint64_t minBlocks = (uint64_t)_usedBlocks + 1; //the last block of the image isn't tracked by the bitmaps
+        _imageBlocks = _requestedSize ? _requestedSize / _blockSize : minBlocks + RESERVE_BLOCKS;
+        retassure(_imageBlocks >= minBlocks, "Image size too small, need at least 0x%llx bytes",minBlocks*_blockSize);
+        retassure(_imageBlocks <= (1ULL<<24), "Image size too large, blocks are limited to 24 bits");
+
+        uint32_t needBitmaps = (uint32_t)((_imageBlocks - 1 + _blockSize*8 - 1) / (_blockSize*8));
+        if (needBitmaps == _bitmapBlocks) break;
+        _bitmapBlocks = needBitmaps;
+    }
+    retassure(_bitmapBlocks <= _blockSize / sizeof(OrbisFSAllocatorInfoElem_t), "Too many bitmap blocks");
+
+    if (_synthetic && _spec.fragmentExtent) fragment();
+
+    for (auto &n : _nodes) {
+        if (n.inode.magic == ORBIS_FS_INODE_MAGIC) linkNode(n);
+    }
+
+    Node &inodeTable = _nodes[kOrbisFSInodeRootDirID];
+    inodeTable.content.resize(inodeTableSize);
+    for (auto &n : _nodes) {
+        if (n.inode.magic != ORBIS_FS_INODE_MAGIC) continue;
+        memcpy(&inodeTable.content[(uint64_t)n.inode.inodeNum * sizeof(OrbisFSInode_t)], &n.inode, sizeof(n.inode));
+    }
+}
+
+void OrbisFSImageBuilder::outWriterLoop(){
+    int cur = 0;
+    while (true) {
+        size_t len = 0;
+        uint64_t pos = 0;
+        {
+            std::unique_lock<std::mutex> ul(_outLock);
+            _outCond.wait(ul, [&]{return _outPending[cur] || _outStop;});
+            if (!_outPending[cur]) break;
+            len = _outPending[cur];
+            pos = _outBufStart[cur];
+        }
+        const uint8_t *ptr = _outBufs[cur].data();
+        while (len && !_outErrno) {
+            ssize_t didWrite = pwrite(_outfd, ptr, len, (off_t)pos);
+            if (didWrite < 0 && errno == EINTR) continue;
+            if (didWrite <= 0) {
+                _outErrno = didWrite < 0 ? errno : EIO;
+                break;
+            }
+            ptr += didWrite;
+            pos += didWrite;
+            len -= didWrite;
+        }
+        {
+            std::unique_lock<std::mutex> ul(_outLock);
+            _outPending[cur] = 0;
+        }
+        _outCond.notify_all();
+        cur ^= 1;
+    }
+}
+
+void OrbisFSImageBuilder::outSwap(){
+    /*
+        Hand the filled buffer to the writer and continue with the other one once it was written
+     */
+    if (!_outFill) return;
+    uint64_t nextStart = _outBufStart[_outCur] + _outFill;
+    std::unique_lock<std::mutex> ul(_outLock);
+    _outPending[_outCur] = _outFill;
+    _outCond.notify_all();
+    _outCur ^= 1;
+    _outCond.wait(ul, [&]{return _outPending[_outCur] == 0;});
+    _outBufStart[_outCur] = nextStart;
+    _outFill = 0;
+    retassure(!_outErrno, "Failed to write image errno=%d (%s)",_outErrno,strerror(_outErrno));
+}
+
+void OrbisFSImageBuilder::fillZeros(size_t len){
+    while (len) {
+        if (_outFill == OUT_BUFFER_SIZE) outSwap();
+        size_t n = std::min<size_t>(len, OUT_BUFFER_SIZE - _outFill);
+        memset(&_outBufs[_outCur][_outFill], 0, n);
+        len -= n;
+        _outFill += n;
+    }
+}
+
+void OrbisFSImageBuilder::flushHole(){
+    /*
+        Short runs of zeros are cheaper to write than to split the stream for
+     */
+    if (!_outHole) return;
+    if (_outHole < MIN_SPARSE_HOLE) {
+        size_t len = (size_t)_outHole;
+        _outHole = 0;
+        fillZeros(len);
+        return;
+    }
+    outSwap();
+    _outBufStart[_outCur] = _outPos;
+    _outHole = 0;
+}
+
+void OrbisFSImageBuilder::emit(const void *buf, size_t len){
+    const uint8_t *ptr = (const uint8_t *)buf;
+    flushHole();
+    while (len) {
+        if (_outFill == OUT_BUFFER_SIZE) outSwap();
+        size_t n = std::min<size_t>(len, OUT_BUFFER_SIZE - _outFill);
+        memcpy(&_outBufs[_outCur][_outFill], ptr, n);
+        ptr += n; len -= n;
+        _outFill += n; _outPos += n;
+    }
+}
+
+void OrbisFSImageBuilder::emitZeros(uint64_t len){
+    _outPos += len;
+    if (_outSparse) {
+        _outHole += len;
+    }else{
+        fillZeros((size_t)len);
+    }
+}
+
+void OrbisFSImageBuilder::emitFromHost(const Node &node, uint64_t offset, uint64_t len){
+    if (_hostfdNode != node.inode.inodeNum) {
+        safeClose(_hostfd);
+        _hostfdNode = 0;
+        retassure((_hostfd = open(node.hostPath.c_str(), O_RDONLY)) != -1, "Failed to open '%s' errno=%d (%s)",node.hostPath.c_str(),errno,strerror(errno));
+        _hostfdNode = node.inode.inodeNum;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(_hostfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    /*
+        Read straight into the output buffer
+     */
+    flushHole();
+    while (len) {
+        if (_outFill == OUT_BUFFER_SIZE) outSwap();
+        size_t n = (size_t)std::min<uint64_t>(len, OUT_BUFFER_SIZE - _outFill);
+        preadAll(_hostfd, &_outBufs[_outCur][_outFill], n, offset);
+        len -= n;
+        offset += n;
+        _outFill += n; _outPos += n;
+    }
+}
+
+void OrbisFSImageBuilder::emitSynthetic(const Node &node, uint32_t blk, uint64_t len){
+    uint64_t state = _spec.seed ^ ((uint64_t)node.inode.inodeNum << 32) ^ blk;
+    splitmix64(state);
+    uint64_t *words = (uint64_t*)_scratch.data();
+    for (size_t i=0; i<(len+7)/8; i++) {
+        words[i] = splitmix64(state);
+    }
+    emit(words, (size_t)len);
+}
+
+void OrbisFSImageBuilder::emitFatBlock(const Node &node, uint32_t slot){
+    uint32_t start[MAX_FAT_STAGES] = {};
+    uint32_t cnt[MAX_FAT_STAGES] = {};
+    OrbisFSChainLink_t *fat = (OrbisFSChainLink_t*)_scratch.data();
+    fatLevels(0, node.fatBlocks, node.dataBlocks, node.inode.fatStages, _linkElemsPerPage, start, cnt);
+    for (uint32_t i=1; i<node.inode.fatStages; i++) {
+        if (slot < start[i] || slot >= start[i] + cnt[i]) continue;
+        uint32_t k = slot - start[i];
+        uint32_t links = std::min<uint32_t>(_linkElemsPerPage, cnt[i-1] - k*_linkElemsPerPage);
+        memset(fat, 0xFF, _blockSize);
+        for (uint32_t j=0; j<links; j++) {
+            fat[j] = linkForBlock(node.blocks[start[i-1] + k*_linkElemsPerPage + j]);
+        }
+        emit(fat, _blockSize);
+        return;
+    }
+    reterror("Block %d of inode %d is not a fat block",slot,node.inode.inodeNum);
+}
+
+void OrbisFSImageBuilder::emitBlock(const Node &node, uint32_t slot){
+    if (slot < node.fatBlocks) {
+        emitFatBlock(node, slot);
+        return;
+    }
+    uint32_t blk = slot - node.fatBlocks;
+    uint64_t offset = (uint64_t)blk * _blockSize;
+    uint64_t len = std::min<uint64_t>(_blockSize, node.inode.filesize - offset);
+    switch (node.source) {
+        case kSourceContent:
+            emit(&node.content[offset], (size_t)len);
+            break;
+        case kSourceHost:
+            emitFromHost(node, offset, len);
+            break;
+        case kSourceSynthetic:
+            emitSynthetic(node, blk, len);
+            break;
+        case kSourceZero:
+            emitZeros(len);
+            break;
+    }
+    if (len < _blockSize) emitZeros(_blockSize - len);
+}
+
+void OrbisFSImageBuilder::emitMetadata(){
+    const uint64_t trackedBlocks = _imageBlocks - 1;
+    const uint64_t bitsPerBitmap = (uint64_t)_blockSize*8;
+    std::vector<uint8_t> blk(_blockSize);
+    uint64_t freeBlocks = 0;
+
+    {
+        OrbisFSSuperblock_t *sb = (OrbisFSSuperblock_t*)blk.data();
+        sb->magic = ORBIS_FS_SUPERBLOCK_MAGIC;
+        strncpy(sb->reserve, ORBIS_FS_SUPERBLOCK_RESERVE_STR, sizeof(sb->reserve));
+        sb->version = ORBIS_FS_SUPERBLOCK_VERSION;
+        sb->blockAllocatorLnk = linkForBlock(1);
+        sb->diskinfoLnk = linkForBlock(2);
+        emit(blk.data(), blk.size());
+    }
+
+    {
+        /*
+            Block 0 is tracked but never handed out, it shows up as free
+         */
+        memset(blk.data(), 0, blk.size());
+        OrbisFSAllocatorInfoElem_t *aie = (OrbisFSAllocatorInfoElem_t*)blk.data();
+        for (uint32_t i=0; i<_bitmapBlocks; i++) {
+            uint64_t first = i*bitsPerBitmap;
+            uint64_t total = std::min<uint64_t>(bitsPerBitmap, trackedBlocks - first);
+            uint64_t used = 0;
+            if (_usedBlocks > first) used = std::min<uint64_t>(_usedBlocks - first, total);
+            if (first == 0) used--;
+            aie[i].bitmapBlk = linkForBlock(3+i);
+            aie[i].totalBlocks = (uint32_t)total;
+            aie[i].freeBlocks = (uint32_t)(total - used);
+            freeBlocks += aie[i].freeBlocks;
+        }
+        emit(blk.data(), blk.size());
+    }
+
+    {
+        memset(blk.data(), 0, blk.size());
+        OrbisFSDiskinfoblock_t *di = (OrbisFSDiskinfoblock_t*)blk.data();
+        di->magic = ORBIS_FS_DISKINFOBLOCK_MAGIC;
+        di->unk1_is_2 = 2;
+        di->unk2_is_0x40 = 0x40;
+        di->unk3_is_0 = 0;
+        di->inodesInRootFolder = (uint32_t)_nodes[kOrbisFSRootFolderID].children.size();
+        di->rdev_is_0xffffffff = 0xFFFFFFFF;
+        di->highestUsedInode = (uint32_t)_nodes.size()-1;
+        di->blocksUsed = _usedBlocks - 1;
+        di->blocksAvailable = freeBlocks;
+        const Node &inodeTable = _nodes[kOrbisFSInodeRootDirID];
+        di->inodedirLnk = linkForBlock(inodeTable.blocks[inodeTable.fatBlocks]);
+        di->diskinfoLnk = linkForBlock(2);
+        emit(blk.data(), blk.size());
+    }
+
+    for (uint32_t i=0; i<_bitmapBlocks; i++) {
+        uint64_t first = i*bitsPerBitmap;
+        uint64_t total = std::min<uint64_t>(bitsPerBitmap, trackedBlocks - first);
+        memset(blk.data(), 0, blk.size());
+        for (uint64_t z=0; z<total; z++) {
+            uint64_t b = first + z;
+            if (b == 0 || b >= _usedBlocks) blk[z >> 3] |= 1 << (z & 7);
+        }
+        emit(blk.data(), blk.size());
+    }
+}
+
+#pragma mark OrbisFSImageBuilder public
+void OrbisFSImageBuilder::writeImage(const char *outPath){
+    auto tstart = std::chrono::steady_clock::now();
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t bytes = 0;
+
+    if (_synthetic) {
+        generateSynthetic();
+    }else{
+        scanHost();
+    }
+
+    {
+        const OrbisFSInode_t &root = _nodes[kOrbisFSRootFolderID].inode;
+        struct stat ist = {};
+        ist.st_mode = S_IFREG | 0600;
+        ist.st_uid = root.uid;
+        ist.st_gid = root.gid;
+        ist.st_mtime = (time_t)root.modDate;
+        ist.st_atime = (time_t)root.accessDate;
+        uint32_t inodeTable = newNode(kOrbisFSInodeRootDirID, kOrbisFSRootFolderID, "", "", ist);
+        _nodes[inodeTable].source = kSourceContent;
+    }
+
+    for (auto &n : _nodes) {
+        if (n.inode.magic != ORBIS_FS_INODE_MAGIC || n.inode.inodeNum < kOrbisFSFirstUserNodeID) continue;
+        if (S_ISDIR(n.inode.fileMode)) {
+            dirs++;
+        }else{
+            files++;
+            bytes += n.inode.filesize;
+        }
+    }
+
+    layout();
+    info("Laying out %llu files and %llu directories (%llu bytes) in 0x%x of 0x%llx blocks",
+         files, dirs, bytes, _usedBlocks, _imageBlocks);
+
+    retassure((_outfd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to create '%s' errno=%d (%s)",outPath,errno,strerror(errno));
+    {
+        struct stat st = {};
+        retassure(!fstat(_outfd, &st), "Failed to stat output");
+        _outSparse = S_ISREG(st.st_mode);
+    }
+    for (auto &b : _outBufs) b.resize(OUT_BUFFER_SIZE);
+    _scratch.resize(_blockSize);
+    _outBufStart[0] = _outBufStart[1] = 0;
+    _outFill = 0;
+    _outCur = 0;
+    _outPos = 0;
+    _outHole = 0;
+    _outStop = false;
+    _outWriter = std::thread([this]{
+        outWriterLoop();
+    });
+
+    emitMetadata();
+    {
+        /*
+            Walk the image front to back, every block knows which node (and which of its blocks) it belongs to
+         */
+        std::vector<uint64_t> owners(_usedBlocks, 0);
+        for (uint32_t num : _order) {
+            const Node &n = _nodes[num];
+            for (uint32_t i=0; i<n.blocks.size(); i++) {
+                owners[n.blocks[i]] = ((uint64_t)num << 32) | i;
+            }
+        }
+        for (uint64_t b = 3 + _bitmapBlocks; b < _usedBlocks; b++) {
+            retassure(owners[b] && _outPos == b * _blockSize, "Layout mismatch at block 0x%llx",b);
+            emitBlock(_nodes[owners[b] >> 32], (uint32_t)owners[b]);
+        }
+    }
+    outSwap();
+    safeClose(_hostfd);
+    _hostfdNode = 0;
+
+    {
+        {
+            std::unique_lock<std::mutex> ul(_outLock);
+            _outCond.wait(ul, [&]{return !_outPending[0] && !_outPending[1];});
+            _outStop = true;
+        }
+        _outCond.notify_all();
+        _outWriter.join();
+        retassure(!_outErrno, "Failed to write image errno=%d (%s)",_outErrno,strerror(_outErrno));
+    }
+
+    {
+        /*
+            The free blocks at the end are never written, leave them sparse
+         */
+        if (_outSparse) {
+            retassure(!ftruncate(_outfd, (off_t)(_imageBlocks * _blockSize)), "Failed to resize image errno=%d (%s)",errno,strerror(errno));
+        }
+    }
+    safeClose(_outfd);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Wrote 0x%llx bytes in %.3f sec (%.2f MB/s)",_outPos,secs,_outPos/secs/1e6);
+}
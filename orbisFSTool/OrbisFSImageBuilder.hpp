@@ -0,0 +1,133 @@
+//
+//  OrbisFSImageBuilder.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSImageBuilder_hpp
+#define OrbisFSImageBuilder_hpp
+
+#include "OrbisFSFormat.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Creates a fresh OrbisFS image from a host directory tree, or from a deterministic synthetic tree.
+    Everything is laid out up front, so the image is written front to back in one sequential stream:
+    superblock, allocator, diskinfo, bitmaps, inode table, then every node's fat blocks followed by its data.
+    The data of every file is contiguous, unless fragmentation was requested for a synthetic tree.
+ */
+class OrbisFSImageBuilder {
+public:
+    struct SyntheticSpec {
+        uint64_t seed;
+        uint32_t files;
+        uint32_t fanout;            //entries (files and subdirectories each) per directory
+        uint64_t maxFileSize;       //small files are uniformly sized in [0, maxFileSize]
+        uint32_t largeFiles;        //additional files needing two fat stages
+        bool hugeFile;              //an additional (all zero, sparse) file needing three fat stages
+        uint32_t fragmentExtent;    //interleave the blocks of neighbouring files in extents of this many blocks, 0 for contiguous files
+
+        SyntheticSpec();
+    };
+private:
+    enum Source {
+        kSourceContent,     //directories and the inode table are generated into content
+        kSourceHost,        //streamed from hostPath
+        kSourceSynthetic,   //pseudo random data derived from the seed
+        kSourceZero
+    };
+    struct Node {
+        std::string hostPath;
+        std::string name;
+        uint32_t parent = 0;
+        std::vector<uint32_t> children;
+        OrbisFSInode_t inode = {};
+        Source source = kSourceContent;
+        std::vector<uint8_t> content;
+        std::vector<uint32_t> blocks;   //physical location of the fat blocks, followed by the data blocks
+        uint32_t fatBlocks = 0;
+        uint32_t dataBlocks = 0;
+    };
+
+    const std::string _hostDir;
+    const SyntheticSpec _spec;
+    const bool _synthetic;
+    const uint64_t _requestedSize;
+    const uint32_t _blockSize;
+    const uint32_t _linkElemsPerPage;
+
+    std::vector<Node> _nodes;       //indexed by inode number, unused entries have inodeNum 0
+    std::vector<uint32_t> _order;   //physical order of the nodes
+    uint32_t _bitmapBlocks;
+    uint32_t _usedBlocks;           //all blocks below this are in use
+    uint64_t _imageBlocks;
+
+    /*
+        Output stream, filled by the caller and written by a dedicated thread
+     */
+    int _outfd;
+    bool _outSparse;                //runs of zeros are skipped instead of written
+    std::vector<uint8_t> _outBufs[2];
+    uint64_t _outBufStart[2];       //image offset of each buffer
+    size_t _outFill;
+    int _outCur;
+    uint64_t _outPos;
+    uint64_t _outHole;              //zeros emitted but not yet written
+    std::mutex _outLock;
+    std::condition_variable _outCond;
+    std::thread _outWriter;
+    size_t _outPending[2];
+    int _outErrno;
+    bool _outStop;
+
+    int _hostfd;
+    uint32_t _hostfdNode;
+    std::vector<uint8_t> _scratch;  //one block for generated fat and synthetic data blocks
+
+    uint32_t newNode(uint32_t inodeNum, uint32_t parent, const std::string &name, const std::string &hostPath, const struct stat &st);
+    void scanDir(uint32_t dirNum);
+    void scanHost();
+    void generateSynthetic();
+    void buildDirectoryContent(Node &dir);
+    void placeNode(Node &node, uint64_t size);
+    void fragment();
+    void linkNode(Node &node);
+    void layout();
+
+    void outWriterLoop();
+    void outSwap();
+    void fillZeros(size_t len);
+    void flushHole();
+    void emit(const void *buf, size_t len);
+    void emitZeros(uint64_t len);
+    void emitFromHost(const Node &node, uint64_t offset, uint64_t len);
+    void emitSynthetic(const Node &node, uint32_t blk, uint64_t len);
+    void emitFatBlock(const Node &node, uint32_t slot);
+    void emitBlock(const Node &node, uint32_t slot);
+    void emitMetadata();
+public:
+    OrbisFSImageBuilder(const char *hostDir, uint64_t imageSize = 0);
+    OrbisFSImageBuilder(const SyntheticSpec &spec, uint64_t imageSize = 0);
+    ~OrbisFSImageBuilder();
+
+    /*
+        Scans the host directory (or generates the synthetic tree) and writes the image to outPath.
+        Without an explicit image size, the image is made just large enough plus a small reserve.
+     */
+    void writeImage(const char *outPath);
+};
+
+}
+#endif /* OrbisFSImageBuilder_hpp */
@@ -8,6 +8,7 @@
 #include "OrbisFSInodeDirectory.hpp"
 #include "OrbisFSException.hpp"
 #include "OrbisFSImage.hpp"
+#include "OrbisFSStats.hpp"
 #include "utils.hpp"
 
 #include <libgeneral/macros.h>
@@ -30,6 +31,12 @@ OrbisFSInodeDirectory::OrbisFSInodeDirectory(OrbisFSImage *parent, uint32_t inod
     _inodeRootDir = (OrbisFSInode_t*)_parent->getBlock(inodeRootDirBlock);
     retassure(memvcmp(&_inodeRootDir[0], sizeof(_inodeRootDir[0]), 0x00), "inode 0 is not zero");
     retassure(memvcmp(&_inodeRootDir[1], sizeof(_inodeRootDir[1]), 0x00), "inode 1 is not zero");
+    
+    /*
+        Open the inode table right away rather than on first use,
+        so concurrent lookups never race on initializing it
+     */
+    _self = _parent->openFileNode(findInode(kOrbisFSInodeRootDirID), true);
 }
 
 OrbisFSInodeDirectory::~OrbisFSInodeDirectory(){
@@ -39,16 +46,15 @@ OrbisFSInodeDirectory::~OrbisFSInodeDirectory(){
 #pragma mark OrbisFSInodeDirectory private
 #pragma mark OrbisFSInodeDirectory public
 
-std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSInodeDirectory::listFilesInDir(uint32_t inodeNum, bool includeSelfAndParent){
-    std::vector<std::pair<std::string, OrbisFSInode_t>> ret;
-    
+void OrbisFSInodeDirectory::iterateOverDir(uint32_t inodeNum, std::function<void(const char *name, size_t namelen, const OrbisFSInode_t *node)> callback, bool includeSelfAndParent){
+    OrbisFSStats::Timer t(OrbisFSStats::kOpDirScan);
     OrbisFSInode_t *node = findInode(inodeNum);
     retassure(S_ISDIR(node->fileMode), "inode %d is not a directory!",inodeNum);
-    auto df = _parent->openFileNode(node, true);
+    OrbisFSFile df(_parent, node, true);
     
     OrbisFSDirectoryElem_t *elem = NULL;
     for (uint64_t offset = 0; offset + sizeof(*elem) < node->filesize; offset+= elem->elemSize) {
-        elem = (OrbisFSDirectoryElem_t *)df->getDataForOffset(offset);
+        elem = (OrbisFSDirectoryElem_t *)df.getDataForOffset(offset);
         retassure(elem->inodeNum, "unexpected zero elem");
         retassure(offset + elem->elemSize <= node->filesize, "elemsize goes oob");
         retassure(sizeof(*elem)+elem->namelen <= elem->elemSize, "namelen too long");
@@ -56,16 +62,21 @@ std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSInodeDirectory::listF
         retassure(elem->unk0_is_0x00100000 == 0x00100000, "elem->unk0_is_0x00100000 is 0x%08x",elem->unk0_is_0x00100000);
 #endif
         
-        std::string elemName{elem->name,elem->name+elem->namelen};
-        if (!includeSelfAndParent && (elemName == "." || elemName == "..")) continue;
+        if (!includeSelfAndParent && elem->namelen && elem->name[0] == '.'
+            && (elem->namelen == 1 || (elem->namelen == 2 && elem->name[1] == '.'))) continue;
 
-        OrbisFSInode_t *curInode = findInode(elem->inodeNum);
+        callback(elem->name, elem->namelen, findInode(elem->inodeNum));
+    }
+}
+
+std::vector<std::pair<std::string, OrbisFSInode_t>> OrbisFSInodeDirectory::listFilesInDir(uint32_t inodeNum, bool includeSelfAndParent){
+    std::vector<std::pair<std::string, OrbisFSInode_t>> ret;
+    iterateOverDir(inodeNum, [&](const char *name, size_t namelen, const OrbisFSInode_t *node){
         ret.push_back({
-            elemName,
-            *curInode
+            {name, name+namelen},
+            *node
         });
-    }
-out:
+    }, includeSelfAndParent);
     std::sort(ret.begin(), ret.end(), [](const std::pair<std::string, OrbisFSInode_t> &a, const std::pair<std::string, OrbisFSInode_t> &b)->bool{
         return a.first < b.first;
     });
@@ -73,12 +84,13 @@ out:
 }
 
 OrbisFSInode_t *OrbisFSInodeDirectory::findChildInDirectory(OrbisFSInode_t *node, std::string childname){
+    OrbisFSStats::Timer t(OrbisFSStats::kOpDirLookup);
     retassure(S_ISDIR(node->fileMode), "inode %d is not a directory!",node->inodeNum);
-    auto df = _parent->openFileNode(node, true);
+    OrbisFSFile df(_parent, node, true);
 
     OrbisFSDirectoryElem_t *elem = NULL;
     for (uint64_t offset = 0; offset + sizeof(*elem) < node->filesize; offset+= elem->elemSize) {
-        elem = (OrbisFSDirectoryElem_t *)df->getDataForOffset(offset);
+        elem = (OrbisFSDirectoryElem_t *)df.getDataForOffset(offset);
         retassure(elem->inodeNum, "unexpected zero elem");
         retassure(offset + elem->elemSize <= node->filesize, "elemsize goes oob");
         retassure(sizeof(*elem)+elem->namelen <= elem->elemSize, "namelen too long");
@@ -86,9 +98,8 @@ OrbisFSInode_t *OrbisFSInodeDirectory::findChildInDirectory(OrbisFSInode_t *node
         retassure(elem->unk0_is_0x00100000 == 0x00100000, "elem->unk0_is_0x00100000 is 0x%08x",elem->unk0_is_0x00100000);
 #endif
 
-        std::string elemName{elem->name,elem->name+elem->namelen};
-        if (elemName == "." || elemName == "..") continue;
-        if (elemName != childname) continue;
+        if (elem->namelen != childname.size() || memcmp(elem->name, childname.data(), elem->namelen)) continue;
+        if (childname == "." || childname == "..") continue;
 
         OrbisFSInode_t *curInode = findInode(elem->inodeNum);
         return curInode;
@@ -98,13 +109,13 @@ error:
 }
 
 OrbisFSInode_t *OrbisFSInodeDirectory::findInode(uint32_t inodeNum){
+    OrbisFSStats::Timer t(OrbisFSStats::kOpFindInode);
     retassure(inodeNum <= _parent->_diskinfoblock->highestUsedInode, "Trying to access beyond largest used iNode");
     
     OrbisFSInode_t *ret = NULL;
     if (inodeNum < _inodeElemsPerBlock) {
         ret = &_inodeRootDir[inodeNum];
     }else {
-        if (!_self) _self = _parent->openFileID(kOrbisFSInodeRootDirID);
         uint32_t inodeBlk = inodeNum/_inodeElemsPerBlock;
         uint32_t inodeElem = inodeNum % _inodeElemsPerBlock;
         ret = (OrbisFSInode_t*)_self->getDataBlock(inodeBlk);
@@ -125,6 +136,7 @@ OrbisFSInode_t *OrbisFSInodeDirectory::findInode(uint32_t inodeNum){
 }
 
 uint32_t OrbisFSInodeDirectory::findInodeIDForPath(std::string path){
+    OrbisFSStats::Timer t(OrbisFSStats::kOpPathResolve);
     if (strncmp(path.c_str(), "iNode", sizeof("iNode")-1) == 0){
         return atoi(path.c_str()+sizeof("iNode")-1);
     }
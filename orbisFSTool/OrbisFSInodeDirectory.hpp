@@ -11,6 +11,7 @@
 #include "OrbisFSFormat.h"
 #include "OrbisFSFile.hpp"
 
+#include <functional>
 #include <vector>
 #include <iostream>
 #include <memory>
@@ -34,6 +35,10 @@ public:
     OrbisFSInodeDirectory(OrbisFSImage *parent, uint32_t inodeRootDirBlock);
     ~OrbisFSInodeDirectory();
 
+    /*
+        Calls callback for every entry in directory order, name is not NUL terminated and node points into the image
+     */
+    void iterateOverDir(uint32_t inodeNum, std::function<void(const char *name, size_t namelen, const OrbisFSInode_t *node)> callback, bool includeSelfAndParent = false);
     std::vector<std::pair<std::string, OrbisFSInode_t>> listFilesInDir(uint32_t inodeNum, bool includeSelfAndParent = false);
 
     OrbisFSInode_t *findChildInDirectory(OrbisFSInode_t *node, std::string childname);
@@ -0,0 +1,251 @@
+//
+//  OrbisFSListWriter.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSListWriter.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define LIST_BUFFER_SIZE (4*1024*1024)
+#define TZ_BUCKET_SECONDS (15*60)
+#define ARRAYOF(a) (sizeof(a)/sizeof(*a))
+
+using namespace orbisFSTool;
+
+static const char *gCSVHeader = "path,inode,type,mode,uid,gid,size,usedBlocks,created,modified,accessed\n";
+
+/*
+    Days since 1970-01-01 to y/m/d in the proleptic gregorian calendar
+ */
+static void civilFromDays(int64_t z, int64_t &y, unsigned &m, unsigned &d){
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = (unsigned)(z - era * 146097);
+    const unsigned yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    const unsigned doy = doe - (365*yoe + yoe/4 - yoe/100);
+    const unsigned mp = (5*doy + 2)/153;
+    d = doy - (153*mp+2)/5 + 1;
+    m = mp < 10 ? mp+3 : mp-9;
+    y = (int64_t)yoe + era * 400 + (m <= 2);
+}
+
+static void put2(char *dst, unsigned val){
+    dst[0] = '0' + (val / 10) % 10;
+    dst[1] = '0' + val % 10;
+}
+
+#pragma mark OrbisFSListWriter
+OrbisFSListWriter::OrbisFSListWriter(int fd, Format format)
+: _fd(fd), _format(format)
+, _buf(NULL), _bufSize(LIST_BUFFER_SIZE), _bufUsed(0)
+, _entries(0)
+{
+    for (auto &e : _tzCache) {
+        e.bucket = INT64_MIN;
+        e.offset = 0;
+    }
+    retassure(_buf = (char*)malloc(_bufSize), "Failed to allocate output buffer");
+    tzset();
+    if (_format == kFormatCSV) put(gCSVHeader, strlen(gCSVHeader));
+}
+
+OrbisFSListWriter::~OrbisFSListWriter(){
+    try {
+        flush();
+    } catch (tihmstar::exception &e) {
+        error("Failed to flush listing with error=%d (%s)",e.code(),e.what());
+    }
+    safeFree(_buf);
+}
+
+OrbisFSListWriter::Format OrbisFSListWriter::formatForName(const char *name){
+    if (strcasecmp(name, "ndjson") == 0 || strcasecmp(name, "json") == 0) return kFormatNDJSON;
+    if (strcasecmp(name, "csv") == 0) return kFormatCSV;
+    reterror("Unknown list format '%s', expected 'ndjson' or 'csv'",name);
+}
+
+#pragma mark OrbisFSListWriter private
+void OrbisFSListWriter::writeAll(const void *buf, size_t len){
+    orbisFSTool::writeAll(_fd, buf, len);
+}
+
+void OrbisFSListWriter::put(char c){
+    if (_bufUsed == _bufSize) flush();
+    _buf[_bufUsed++] = c;
+}
+
+void OrbisFSListWriter::put(const char *str, size_t len){
+    if (_bufUsed + len > _bufSize) flush();
+    memcpy(&_buf[_bufUsed], str, len);
+    _bufUsed += len;
+}
+
+void OrbisFSListWriter::putUInt(uint64_t val){
+    char tmp[20];
+    int i = sizeof(tmp);
+    do {
+        tmp[--i] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    put(&tmp[i], sizeof(tmp) - i);
+}
+
+void OrbisFSListWriter::putOctal(uint32_t val){
+    char tmp[12];
+    int i = sizeof(tmp);
+    do {
+        tmp[--i] = '0' + (val & 7);
+        val >>= 3;
+    } while (val);
+    tmp[--i] = '0';
+    put(&tmp[i], sizeof(tmp) - i);
+}
+
+void OrbisFSListWriter::putString(const std::string &str){
+    static const char hex[] = "0123456789abcdef";
+    put('"');
+    if (_format == kFormatNDJSON) {
+        for (unsigned char c : str) {
+            if (c == '"' || c == '\\') {
+                put('\\'); put(c);
+            }else if (c < 0x20) {
+                put('\\'); put('u'); put('0'); put('0');
+                put(hex[c >> 4]); put(hex[c & 0xf]);
+            }else{
+                put(c);
+            }
+        }
+    }else{
+        for (char c : str) {
+            if (c == '"') put('"');
+            put(c);
+        }
+    }
+    put('"');
+}
+
+int32_t OrbisFSListWriter::utcOffset(int64_t date){
+    int64_t bucket = date / TZ_BUCKET_SECONDS;
+    TZCacheEntry &e = _tzCache[(uint64_t)bucket % ARRAYOF(_tzCache)];
+    if (e.bucket != bucket) {
+        time_t t = (time_t)date;
+        struct tm local = {};
+        struct tm utc = {};
+        localtime_r(&t, &local);
+        gmtime_r(&t, &utc);
+        /*
+            timegm isn't portable, so compute the offset from the broken down times
+         */
+        int64_t days = local.tm_yday - utc.tm_yday;
+        if (local.tm_year != utc.tm_year) days = local.tm_year > utc.tm_year ? 1 : -1;
+        e.offset = (int32_t)(((days*24 + local.tm_hour - utc.tm_hour)*60 + local.tm_min - utc.tm_min)*60 + local.tm_sec - utc.tm_sec);
+        e.bucket = bucket;
+    }
+    return e.offset;
+}
+
+void OrbisFSListWriter::putDate(uint64_t date){
+    //YYYY-MM-DDTHH:MM:SS+HH:MM
+    char tmp[32];
+    int64_t off = utcOffset((int64_t)date);
+    int64_t t = (int64_t)date + off;
+    int64_t days = t / 86400;
+    int64_t secs = t % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    int64_t y;
+    unsigned m, d;
+    civilFromDays(days, y, m, d);
+    if (y < 0 || y > 9999) {
+        //not representable, emit the raw timestamp as string instead
+        put('"');
+        putUInt(date);
+        put('"');
+        return;
+    }
+    tmp[0] = '"';
+    put2(&tmp[1], (unsigned)(y / 100));
+    put2(&tmp[3], (unsigned)(y % 100));
+    tmp[5] = '-';
+    put2(&tmp[6], m);
+    tmp[8] = '-';
+    put2(&tmp[9], d);
+    tmp[11] = 'T';
+    put2(&tmp[12], (unsigned)(secs / 3600));
+    tmp[14] = ':';
+    put2(&tmp[15], (unsigned)(secs / 60 % 60));
+    tmp[17] = ':';
+    put2(&tmp[18], (unsigned)(secs % 60));
+    tmp[20] = off < 0 ? '-' : '+';
+    if (off < 0) off = -off;
+    put2(&tmp[21], (unsigned)(off / 3600));
+    tmp[23] = ':';
+    put2(&tmp[24], (unsigned)(off / 60 % 60));
+    tmp[26] = '"';
+    put(tmp, 27);
+}
+
+#pragma mark OrbisFSListWriter public
+void OrbisFSListWriter::addEntry(const std::string &path, const OrbisFSInode_t &node){
+    const bool json = _format == kFormatNDJSON;
+    const char *type = S_ISDIR(node.fileMode) ? "dir" : (S_ISLNK(node.fileMode) ? "symlink" : "file");
+    auto field = [&](const char *jsonKey, size_t keyLen){
+        if (json) {
+            put(jsonKey, keyLen);
+        }else if (jsonKey[0] == ','){
+            put(',');
+        }
+    };
+#define FIELD(key) field(key, sizeof(key)-1)
+
+    FIELD("{\"path\":");
+    putString(path);
+    FIELD(",\"inode\":");
+    putUInt(node.inodeNum);
+    FIELD(",\"type\":");
+    put('"'); put(type, strlen(type)); put('"');
+    FIELD(",\"mode\":");
+    put('"'); putOctal(node.fileMode & 07777); put('"');
+    FIELD(",\"uid\":");
+    putUInt(node.uid);
+    FIELD(",\"gid\":");
+    putUInt(node.gid);
+    FIELD(",\"size\":");
+    putUInt(node.filesize);
+    FIELD(",\"usedBlocks\":");
+    putUInt(node.usedBlocks);
+    FIELD(",\"created\":");
+    putDate(node.createDate);
+    FIELD(",\"modified\":");
+    putDate(node.modDate);
+    FIELD(",\"accessed\":");
+    putDate(node.accessDate);
+    if (json) put('}');
+    put('\n');
+#undef FIELD
+    _entries++;
+}
+
+void OrbisFSListWriter::flush(){
+    if (!_bufUsed) return;
+    size_t len = _bufUsed;
+    _bufUsed = 0;
+    writeAll(_buf, len);
+}
+
+uint64_t OrbisFSListWriter::entries(){
+    return _entries;
+}
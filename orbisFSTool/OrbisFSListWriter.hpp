@@ -0,0 +1,66 @@
+//
+//  OrbisFSListWriter.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSListWriter_hpp
+#define OrbisFSListWriter_hpp
+
+#include "OrbisFSFormat.h"
+
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+namespace orbisFSTool {
+
+/*
+    Machine readable listing output (one JSON object per line, or CSV with a header line).
+    Lines are formatted by hand into a large buffer which is only flushed when full,
+    local time offsets are cached per 15 minutes since zones only ever change on those boundaries.
+ */
+class OrbisFSListWriter {
+public:
+    enum Format {
+        kFormatNDJSON,
+        kFormatCSV
+    };
+private:
+    struct TZCacheEntry {
+        int64_t bucket;
+        int32_t offset;
+    };
+    int _fd; //not owned
+    Format _format;
+    char *_buf;
+    size_t _bufSize;
+    size_t _bufUsed;
+    uint64_t _entries;
+    TZCacheEntry _tzCache[64];
+
+    void writeAll(const void *buf, size_t len);
+    void put(char c);
+    void put(const char *str, size_t len);
+    void putUInt(uint64_t val);
+    void putOctal(uint32_t val);
+    void putString(const std::string &str);
+    void putDate(uint64_t date);
+    int32_t utcOffset(int64_t date);
+public:
+    OrbisFSListWriter(int fd, Format format);
+    ~OrbisFSListWriter();
+
+    static Format formatForName(const char *name);
+
+    void addEntry(const std::string &path, const OrbisFSInode_t &node);
+    void flush();
+
+    uint64_t entries();
+};
+
+}
+#endif /* OrbisFSListWriter_hpp */
@@ -0,0 +1,309 @@
+//
+//  OrbisFSManifest.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSManifest.hpp"
+#include "OrbisFSWorkPool.hpp"
+#include "OrbisFSException.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define MANIFEST_MAGIC "# orbisFSTool hash manifest v1"
+#define MANIFEST_CHUNK_BLOCKS 1024 //per-block hashes of larger files are computed in chunks of this many blocks
+
+using namespace orbisFSTool;
+
+static std::string algosString(uint32_t algos){
+    std::string ret;
+    if (algos & OrbisFSHash::kHashSHA256) ret += "sha256";
+    if (algos & OrbisFSHash::kHashXXH64) ret += ret.size() ? ",xxh64" : "xxh64";
+    return ret;
+}
+
+static std::string digestString(const OrbisFSHash::Digest &d, uint32_t algos){
+    std::string ret = (algos & OrbisFSHash::kHashSHA256) ? OrbisFSHash::hexForSHA256(d) : "-";
+    ret += " ";
+    ret += (algos & OrbisFSHash::kHashXXH64) ? OrbisFSHash::hexForXXH64(d) : "-";
+    return ret;
+}
+
+static bool digestsEqual(const OrbisFSHash::Digest &a, const OrbisFSHash::Digest &b, uint32_t algos){
+    if ((algos & OrbisFSHash::kHashSHA256) && memcmp(a.sha256, b.sha256, sizeof(a.sha256))) return false;
+    if ((algos & OrbisFSHash::kHashXXH64) && a.xxh64 != b.xxh64) return false;
+    return true;
+}
+
+static bool parseDigest(const char *sha, const char *xxh, uint32_t algos, OrbisFSHash::Digest &d){
+    memset(&d, 0, sizeof(d));
+    if (algos & OrbisFSHash::kHashSHA256) {
+        if (strlen(sha) != sizeof(d.sha256)*2) return false;
+        for (size_t i=0; i<sizeof(d.sha256); i++) {
+            unsigned int v = 0;
+            if (sscanf(&sha[i*2], "%2x", &v) != 1) return false;
+            d.sha256[i] = (uint8_t)v;
+        }
+    }
+    if (algos & OrbisFSHash::kHashXXH64) {
+        unsigned long long v = 0;
+        if (sscanf(xxh, "%llx", &v) != 1) return false;
+        d.xxh64 = v;
+    }
+    return true;
+}
+
+/*
+    Hashes [offset, offset+len) of the file, into fileDigest and/or one digest per block into blockDigests.
+    offset needs to be block aligned when block digests are requested.
+ */
+static void hashFileData(OrbisFSFile *f, uint64_t offset, uint64_t len, uint32_t blockSize, uint32_t algos,
+                         OrbisFSHash::Digest *fileDigest, OrbisFSHash::Digest *blockDigests){
+    OrbisFSHash fileHash(algos);
+    std::unique_ptr<OrbisFSHash> blockHash;
+    uint64_t pos = offset;
+    size_t blockIdx = 0;
+
+    if (len) {
+        f->iterateOverData(offset, len, [&](const void *data, size_t dlen){
+            const uint8_t *ptr = (const uint8_t*)data;
+            if (fileDigest) fileHash.update(ptr, dlen);
+            if (!blockDigests) return;
+            while (dlen) {
+                size_t cur = blockSize - (pos % blockSize);
+                if (cur > dlen) cur = dlen;
+                if (!blockHash) blockHash.reset(new OrbisFSHash(algos));
+                blockHash->update(ptr, cur);
+                ptr += cur; dlen -= cur; pos += cur;
+                if (pos % blockSize == 0) {
+                    blockDigests[blockIdx++] = blockHash->finalize();
+                    blockHash.reset();
+                }
+            }
+        });
+    }
+    if (blockHash) blockDigests[blockIdx++] = blockHash->finalize();
+    if (fileDigest) *fileDigest = fileHash.finalize();
+}
+
+#pragma mark OrbisFSManifest
+OrbisFSManifest::OrbisFSManifest(OrbisFSImage *img, unsigned threads)
+: _img(img), _threads(threads)
+{
+    //
+}
+
+#pragma mark OrbisFSManifest private
+void OrbisFSManifest::hashEntries(std::vector<Entry> &entries, uint32_t algos, bool blockHashes){
+    const uint32_t blockSize = _img->getBlocksize();
+    std::atomic<uint64_t> bytes{0};
+    auto tstart = std::chrono::steady_clock::now();
+
+    /*
+        Workers take the most recently pushed task of their own queue first,
+        so pushing in ascending order of size starts the largest files first
+     */
+    std::vector<size_t> order;
+    for (size_t i=0; i<entries.size(); i++) {
+        if (entries[i].found) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        return entries[a].size < entries[b].size;
+    });
+
+    OrbisFSWorkPool pool(_threads);
+    for (size_t idx : order) {
+        Entry *e = &entries[idx];
+        uint64_t blocks = (e->size + blockSize - 1) / blockSize;
+        std::shared_ptr<OrbisFSFile> f = _img->openFileID(e->inodeNum);
+        if (blockHashes) e->blocks.resize(blocks);
+
+        if (!blockHashes || blocks <= MANIFEST_CHUNK_BLOCKS) {
+            pool.push([e,f,algos,blockHashes,blockSize,&bytes](unsigned worker){
+                hashFileData(f.get(), 0, e->size, blockSize, algos, &e->digest, blockHashes ? e->blocks.data() : NULL);
+                bytes += e->size;
+            });
+            continue;
+        }
+
+        pool.push([e,f,algos,blockSize,&bytes](unsigned worker){
+            hashFileData(f.get(), 0, e->size, blockSize, algos, &e->digest, NULL);
+            bytes += e->size;
+        });
+        for (uint64_t first = 0; first < blocks; first += MANIFEST_CHUNK_BLOCKS) {
+            uint64_t offset = first * blockSize;
+            uint64_t len = std::min<uint64_t>((uint64_t)MANIFEST_CHUNK_BLOCKS*blockSize, e->size - offset);
+            pool.push([e,f,algos,blockSize,first,offset,len](unsigned worker){
+                hashFileData(f.get(), offset, len, blockSize, algos, NULL, &e->blocks[first]);
+            });
+        }
+    }
+    pool.wait();
+    retassure(!pool.failedTasks(), "Failed to hash %llu files",pool.failedTasks());
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Hashed %zu files (%llu bytes) in %.3f sec using %u threads (%.2f MB/s)",
+         order.size(), bytes.load(), secs, pool.threads(), bytes/secs/1e6);
+}
+
+#pragma mark OrbisFSManifest public
+void OrbisFSManifest::create(std::string path, int fd, uint32_t algos, bool blockHashes){
+    std::vector<Entry> entries;
+    _img->iterateOverFilesInFolder(path, true, [&](std::string curPath, OrbisFSInode_t node){
+        if (!S_ISREG(node.fileMode)) return;
+        entries.push_back({curPath, node.inodeNum, node.filesize, true, {}, {}});
+    });
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){
+        return a.path < b.path;
+    });
+
+    hashEntries(entries, algos, blockHashes);
+
+    std::string out = MANIFEST_MAGIC "\n";
+    out += "# algos=" + algosString(algos) + " blocksize=" + std::to_string(_img->getBlocksize()) + " root=" + path + "\n";
+    for (auto &e : entries) {
+        out += "F " + std::to_string(e.size) + " " + digestString(e.digest, algos) + " " + e.path + "\n";
+        for (size_t i=0; i<e.blocks.size(); i++) {
+            out += "B " + std::to_string(i) + " " + digestString(e.blocks[i], algos) + "\n";
+        }
+        if (out.size() >= 1024*1024) {
+            writeAll(fd, out.data(), out.size());
+            out.clear();
+        }
+    }
+    writeAll(fd, out.data(), out.size());
+}
+
+bool OrbisFSManifest::verify(const char *manifestPath, int fd){
+    FILE *f = NULL;
+    char *line = NULL;
+    size_t lineCap = 0;
+    cleanup([&]{
+        safeFree(line);
+        safeFreeCustom(f, fclose);
+    });
+    std::string root;
+    uint32_t algos = 0;
+    std::vector<Entry> expected;
+
+    retassure(f = fopen(manifestPath, "r"), "Failed to open manifest '%s'",manifestPath);
+    for (uint64_t lineNum = 1; getline(&line, &lineCap, f) > 0; lineNum++) {
+        std::string l = line;
+        while (l.size() && (l.back() == '\n' || l.back() == '\r')) l.pop_back();
+        if (lineNum == 1) {
+            retassure(l == MANIFEST_MAGIC, "'%s' is not a hash manifest",manifestPath);
+            continue;
+        }
+        if (!l.size()) continue;
+        if (l[0] == '#') {
+            char algosBuf[0x40] = {};
+            unsigned blocksize = 0;
+            int rootOffset = 0;
+            if (sscanf(l.c_str(), "# algos=%63s blocksize=%u root=%n", algosBuf, &blocksize, &rootOffset) == 2 && rootOffset) {
+                root = l.substr(rootOffset);
+                if (strstr(algosBuf, "sha256")) algos |= OrbisFSHash::kHashSHA256;
+                if (strstr(algosBuf, "xxh64")) algos |= OrbisFSHash::kHashXXH64;
+                retassure(blocksize == _img->getBlocksize(), "Manifest was created with blocksize %u",blocksize);
+            }
+            continue;
+        }
+        retassure(algos, "Manifest is missing its header");
+
+        char sha[0x80] = {};
+        char xxh[0x20] = {};
+        unsigned long long num = 0;
+        int pathOffset = 0;
+        OrbisFSHash::Digest d = {};
+        if (l[0] == 'F') {
+            retassure(sscanf(l.c_str(), "F %llu %127s %31s %n", &num, sha, xxh, &pathOffset) == 3 && pathOffset, "Malformed line %llu",lineNum);
+            retassure(parseDigest(sha, xxh, algos, d), "Malformed digest in line %llu",lineNum);
+            expected.push_back({l.substr(pathOffset), 0, num, false, d, {}});
+        }else if (l[0] == 'B') {
+            retassure(expected.size(), "Block hash without file in line %llu",lineNum);
+            retassure(sscanf(l.c_str(), "B %llu %127s %31s", &num, sha, xxh) == 3, "Malformed line %llu",lineNum);
+            retassure(num == expected.back().blocks.size(), "Unexpected block index in line %llu",lineNum);
+            retassure(parseDigest(sha, xxh, algos, d), "Malformed digest in line %llu",lineNum);
+            expected.back().blocks.push_back(d);
+        }else{
+            reterror("Malformed line %llu",lineNum);
+        }
+    }
+    retassure(root.size(), "Manifest is missing its root");
+    retassure((algos & OrbisFSHash::availableAlgos()) == algos, "Manifest uses hash algorithms not supported by this build");
+
+    /*
+        Rehash the files which are still there, then compare
+     */
+    bool blockHashes = false;
+    std::vector<Entry> actual;
+    std::map<std::string, size_t> listed;
+    uint64_t missing = 0;
+    uint64_t mismatched = 0;
+    uint64_t unlisted = 0;
+    for (size_t i=0; i<expected.size(); i++) {
+        const Entry &e = expected[i];
+        Entry a = {e.path, 0, 0, false, {}, {}};
+        listed[e.path] = i;
+        if (e.blocks.size()) blockHashes = true;
+        try {
+            OrbisFSInode_t node = _img->getInodeForPath(e.path);
+            if (S_ISREG(node.fileMode)) {
+                a.inodeNum = node.inodeNum;
+                a.size = node.filesize;
+                a.found = true;
+            }
+        } catch (tihmstar::OrbisFSFileNotFound &ex) {
+            //
+        }
+        actual.push_back(a);
+    }
+    hashEntries(actual, algos, blockHashes);
+
+    std::string out;
+    for (size_t i=0; i<expected.size(); i++) {
+        const Entry &e = expected[i];
+        const Entry &a = actual[i];
+        if (!a.found) {
+            out += "MISSING " + e.path + "\n";
+            missing++;
+            continue;
+        }
+        if (a.size != e.size || !digestsEqual(a.digest, e.digest, algos)) {
+            std::string badBlocks;
+            for (size_t b=0; b<e.blocks.size(); b++) {
+                if (b < a.blocks.size() && digestsEqual(a.blocks[b], e.blocks[b], algos)) continue;
+                badBlocks += (badBlocks.size() ? "," : " blocks ") + std::to_string(b);
+            }
+            out += "MISMATCH " + e.path + badBlocks + "\n";
+            mismatched++;
+        }
+    }
+    _img->iterateOverFilesInFolder(root, true, [&](std::string curPath, OrbisFSInode_t node){
+        if (!S_ISREG(node.fileMode) || listed.find(curPath) != listed.end()) return;
+        out += "UNLISTED " + curPath + "\n";
+        unlisted++;
+        if (out.size() >= 0x10000) {
+            writeAll(fd, out.data(), out.size());
+            out.clear();
+        }
+    });
+    writeAll(fd, out.data(), out.size());
+
+    info("Verified %zu files: %llu mismatched, %llu missing, %llu not in manifest",expected.size(),mismatched,missing,unlisted);
+    return !mismatched && !missing && !unlisted;
+}
@@ -0,0 +1,58 @@
+//
+//  OrbisFSManifest.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSManifest_hpp
+#define OrbisFSManifest_hpp
+
+#include "OrbisFSImage.hpp"
+#include "OrbisFSHash.hpp"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+class OrbisFSWorkPool;
+
+/*
+    Hash manifest of all files below a path, hashed straight from the image mapping.
+    Files are hashed concurrently (largest first), per-block hashes of large files are split into chunks
+    so they are spread over all workers as well.
+ */
+class OrbisFSManifest {
+    struct Entry {
+        std::string path;
+        uint32_t inodeNum;
+        uint64_t size;
+        bool found;
+        OrbisFSHash::Digest digest;
+        std::vector<OrbisFSHash::Digest> blocks;
+    };
+
+    OrbisFSImage *_img; //not owned
+    unsigned _threads;
+
+    void hashEntries(std::vector<Entry> &entries, uint32_t algos, bool blockHashes);
+public:
+    OrbisFSManifest(OrbisFSImage *img, unsigned threads = 0);
+
+    /*
+        Writes the manifest of everything below path to fd
+     */
+    void create(std::string path, int fd, uint32_t algos, bool blockHashes);
+
+    /*
+        Rehashes everything listed in the manifest and reports mismatching, missing and unlisted files to fd.
+        Returns true if everything matched.
+     */
+    bool verify(const char *manifestPath, int fd);
+};
+
+}
+#endif /* OrbisFSManifest_hpp */
@@ -0,0 +1,104 @@
+//
+//  OrbisFSReadahead.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSReadahead.hpp"
+#include "OrbisFSFile.hpp"
+
+#include <libgeneral/macros.h>
+
+#define MAX_STRIDED_PREFETCHES 32
+
+using namespace orbisFSTool;
+
+#pragma mark OrbisFSReadahead
+OrbisFSReadahead::OrbisFSReadahead(OrbisFSFile *file, uint64_t minWindow, uint64_t maxWindow)
+: _file(file)
+, _minWindow(minWindow), _maxWindow(maxWindow)
+, _lastOffset(0), _lastEnd(0)
+, _stride(0)
+, _window(0)
+, _prefetchStart(0), _prefetchEnd(0)
+, _reads{0}, _sequential{0}, _strided{0}, _random{0}, _hits{0}, _prefetchedBytes{0}
+{
+    retassure(_file, "No file given");
+    retassure(_minWindow && _minWindow <= _maxWindow, "Bad readahead window limits");
+}
+
+#pragma mark OrbisFSReadahead private
+void OrbisFSReadahead::prefetch(uint64_t offset, uint64_t len){
+    uint64_t fileSize = _file->size();
+    if (offset >= fileSize) return;
+    if (len > fileSize - offset) len = fileSize - offset;
+    _file->prefetch(offset, len);
+    _prefetchedBytes += len;
+}
+
+#pragma mark OrbisFSReadahead public
+void OrbisFSReadahead::access(uint64_t offset, uint64_t len){
+    if (!len) return;
+    const uint64_t end = offset + len;
+    std::unique_lock<std::mutex> ul(_lock);
+    
+    _reads++;
+    if (offset >= _prefetchStart && end <= _prefetchEnd) _hits++;
+    
+    if (_reads > 1 && offset == _lastEnd) {
+        /*
+            Sequential, keep the prefetched range half a window ahead of the reader
+         */
+        _sequential++;
+        _window = _window ? _window*2 : _minWindow;
+        if (_window > _maxWindow) _window = _maxWindow;
+        
+        if (_prefetchEnd < end || _prefetchStart > offset) {
+            _prefetchStart = _prefetchEnd = end;
+        }
+        if (_prefetchEnd - end < _window/2) {
+            uint64_t pfEnd = end + _window;
+            prefetch(_prefetchEnd, pfEnd - _prefetchEnd);
+            _prefetchEnd = pfEnd;
+        }
+        _stride = len;
+    }else if (_reads > 2 && (int64_t)(offset - _lastOffset) == _stride && _stride) {
+        /*
+            Strided, prefetch as many of the upcoming chunks as fit into the window
+         */
+        _strided++;
+        _window = _window ? _window*2 : _minWindow;
+        if (_window > _maxWindow) _window = _maxWindow;
+        
+        uint64_t chunks = _window / len;
+        if (chunks < 1) chunks = 1;
+        if (chunks > MAX_STRIDED_PREFETCHES) chunks = MAX_STRIDED_PREFETCHES;
+        uint64_t pfStart = UINT64_MAX;
+        uint64_t pfEnd = 0;
+        for (uint64_t i=1; i<=chunks; i++) {
+            int64_t next = (int64_t)offset + _stride*(int64_t)i;
+            if (next < 0) break;
+            if ((uint64_t)next < _prefetchStart || next + len > _prefetchEnd) prefetch(next, len); //skip chunks the last read already prefetched
+            if ((uint64_t)next < pfStart) pfStart = next;
+            if (next + len > pfEnd) pfEnd = next + len;
+        }
+        _prefetchStart = pfStart;
+        _prefetchEnd = pfEnd;
+    }else{
+        /*
+            Random access, prefetching would only waste IO
+         */
+        _random++;
+        _window = 0;
+        _prefetchStart = _prefetchEnd = 0;
+        _stride = (int64_t)(offset - _lastOffset);
+    }
+    
+    _lastOffset = offset;
+    _lastEnd = end;
+}
+
+OrbisFSReadahead::Stats OrbisFSReadahead::getStats(){
+    return {_reads.load(), _sequential.load(), _strided.load(), _random.load(), _hits.load(), _prefetchedBytes.load()};
+}
@@ -0,0 +1,66 @@
+//
+//  OrbisFSReadahead.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSReadahead_hpp
+#define OrbisFSReadahead_hpp
+
+#include <atomic>
+#include <mutex>
+
+#include <stdint.h>
+
+namespace orbisFSTool {
+class OrbisFSFile;
+
+/*
+    Per open file access pattern detector.
+    Sequential and strided reads make the prefetch window grow, random reads collapse it.
+ */
+class OrbisFSReadahead {
+public:
+    struct Stats {
+        uint64_t reads;
+        uint64_t sequential;
+        uint64_t strided;
+        uint64_t random;
+        uint64_t hits;          //reads fully covered by an earlier prefetch
+        uint64_t prefetchedBytes;
+    };
+private:
+    OrbisFSFile *_file; //not owned
+    const uint64_t _minWindow;
+    const uint64_t _maxWindow;
+    
+    std::mutex _lock;
+    uint64_t _lastOffset;
+    uint64_t _lastEnd;
+    int64_t _stride;
+    uint64_t _window;
+    uint64_t _prefetchStart;
+    uint64_t _prefetchEnd;
+    
+    std::atomic<uint64_t> _reads;
+    std::atomic<uint64_t> _sequential;
+    std::atomic<uint64_t> _strided;
+    std::atomic<uint64_t> _random;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _prefetchedBytes;
+    
+    void prefetch(uint64_t offset, uint64_t len);
+public:
+    OrbisFSReadahead(OrbisFSFile *file, uint64_t minWindow = 0x20000, uint64_t maxWindow = 0x800000);
+    
+    /*
+        Called for every read, may start prefetching the range the next reads are expected to hit
+     */
+    void access(uint64_t offset, uint64_t len);
+    
+    Stats getStats();
+};
+
+}
+#endif /* OrbisFSReadahead_hpp */
@@ -0,0 +1,241 @@
+//
+//  OrbisFSSeekableZstd.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSSeekableZstd.hpp"
+#include "OrbisFSTrace.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#   include <zstd.h>
+#endif //HAVE_ZSTD
+
+using namespace orbisFSTool;
+
+#pragma mark helper
+static uint32_t readLE32(const uint8_t *p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#ifdef HAVE_ZSTD
+namespace {
+/*
+    One decompression context per thread, they are expensive to create
+ */
+struct DecompressContext {
+    ZSTD_DCtx *dctx;
+    std::vector<uint8_t> compressed;
+    DecompressContext() : dctx(ZSTD_createDCtx()) {}
+    ~DecompressContext(){
+        ZSTD_freeDCtx(dctx);
+    }
+};
+thread_local DecompressContext gDecompressContext;
+}
+#endif //HAVE_ZSTD
+
+#pragma mark OrbisFSSeekableZstd
+bool OrbisFSSeekableZstd::isSeekableZstd(int fd, uint64_t fileSize){
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE] = {};
+    if (fileSize < ZSTD_SEEKABLE_FOOTER_SIZE + 8) return false;
+    if (pread(fd, footer, sizeof(footer), fileSize - sizeof(footer)) != sizeof(footer)) return false;
+    return readLE32(&footer[5]) == ZSTD_SEEKABLE_MAGIC;
+}
+
+OrbisFSSeekableZstd::OrbisFSSeekableZstd(int fd, uint64_t fileSize, size_t cacheLimit)
+: _fd(fd), _size(0), _uniformFrameSize(0)
+, _mapping(NULL)
+, _cacheLimit(cacheLimit), _cacheSize(0)
+, _decompressedFrames(0)
+{
+#ifndef HAVE_ZSTD
+    reterror("Image is a seekable zstd dump, but orbisFSTool was built without zstd support");
+#else
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE] = {};
+    retassure(fileSize >= sizeof(footer) + 8, "File too small for a seek table");
+    preadAll(_fd, footer, sizeof(footer), fileSize - sizeof(footer));
+    retassure(readLE32(&footer[5]) == ZSTD_SEEKABLE_MAGIC, "Bad seekable zstd magic");
+
+    const uint32_t numFrames = readLE32(&footer[0]);
+    const uint8_t descriptor = footer[4];
+    retassure(!(descriptor & 0x7C), "Reserved bits in the seek table descriptor are set (0x%02x)",descriptor);
+    const uint32_t entrySize = (descriptor & ZSTD_SEEKABLE_CHECKSUM_FLAG) ? 12 : 8;
+    const uint64_t tableSize = (uint64_t)numFrames * entrySize + sizeof(footer);
+    retassure(numFrames, "Seek table has no frames");
+    retassure(tableSize + 8 <= fileSize, "Seek table is larger than the file");
+
+    std::vector<uint8_t> table(tableSize + 8);
+    preadAll(_fd, table.data(), table.size(), fileSize - table.size());
+    retassure(readLE32(&table[0]) == ZSTD_SEEKABLE_SKIPPABLE_MAGIC, "Seek table is not in a skippable frame");
+    retassure(readLE32(&table[4]) == tableSize, "Seek table frame has size 0x%x, expected 0x%llx",readLE32(&table[4]),tableSize);
+
+    _frames.reserve(numFrames);
+    uint64_t compOffset = 0;
+    for (uint32_t i=0; i<numFrames; i++) {
+        const uint8_t *e = &table[8 + (uint64_t)i*entrySize];
+        Frame f = {compOffset, _size, readLE32(&e[0]), readLE32(&e[4])};
+        retassure(f.decompSize, "Frame %u is empty",i);
+        _frames.push_back(f);
+        compOffset += f.compSize;
+        _size += f.decompSize;
+    }
+    retassure(compOffset + table.size() == fileSize, "Frames end at 0x%llx, but the seek table starts at 0x%llx",compOffset,fileSize - table.size());
+
+    /*
+        Dumps normally use one frame size, which makes looking up frames a division
+     */
+    _uniformFrameSize = _frames.front().decompSize;
+    for (size_t i=0; i<_frames.size(); i++) {
+        if (_frames[i].decompSize != _uniformFrameSize && (i+1 != _frames.size() || _frames[i].decompSize > _uniformFrameSize)) {
+            _uniformFrameSize = 0;
+            break;
+        }
+    }
+
+    _resident.reset(new std::atomic<bool>[_frames.size()]);
+    for (size_t i=0; i<_frames.size(); i++) _resident[i] = false;
+
+    if ((_mapping = (uint8_t*)mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED){
+        _mapping = NULL;
+        reterror("Failed to reserve 0x%llx bytes for the decompressed image errno=%d (%s)",_size,errno,strerror(errno));
+    }
+    debug("Seekable zstd dump with %zu frames, 0x%llx bytes decompressed",_frames.size(),_size);
+#endif //HAVE_ZSTD
+}
+
+OrbisFSSeekableZstd::~OrbisFSSeekableZstd(){
+    if (_mapping) {
+        munmap(_mapping, _size); _mapping = NULL;
+    }
+}
+
+#pragma mark OrbisFSSeekableZstd private
+size_t OrbisFSSeekableZstd::frameForOffset(uint64_t offset){
+    retassure(offset < _size, "Offset 0x%llx is beyond the decompressed image",offset);
+    if (_uniformFrameSize) return (size_t)(offset / _uniformFrameSize);
+    auto it = std::upper_bound(_frames.begin(), _frames.end(), offset, [](uint64_t off, const Frame &f)->bool{
+        return off < f.decompOffset;
+    });
+    return (it - _frames.begin()) - 1;
+}
+
+void OrbisFSSeekableZstd::decompressFrame(size_t idx, void *dst){
+#ifdef HAVE_ZSTD
+    const Frame &f = _frames.at(idx);
+    OrbisFSTrace::Span span("zstd.decompressFrame", "frame", idx);
+    DecompressContext &ctx = gDecompressContext;
+    retassure(ctx.dctx, "Failed to create zstd decompression context");
+    if (ctx.compressed.size() < f.compSize) ctx.compressed.resize(f.compSize);
+    preadAll(_fd, ctx.compressed.data(), f.compSize, f.compOffset);
+    size_t ret = ZSTD_decompressDCtx(ctx.dctx, dst, f.decompSize, ctx.compressed.data(), f.compSize);
+    retassure(!ZSTD_isError(ret), "Failed to decompress frame %zu: %s",idx,ZSTD_getErrorName(ret));
+    retassure(ret == f.decompSize, "Frame %zu decompressed to 0x%zx bytes, expected 0x%x",idx,ret,f.decompSize);
+    _decompressedFrames++;
+#else
+    reterror("Built without zstd support");
+#endif //HAVE_ZSTD
+}
+
+std::shared_ptr<const std::vector<uint8_t>> OrbisFSSeekableZstd::getFrame(size_t idx){
+    {
+        std::unique_lock<std::mutex> ul(_cacheLock);
+        auto it = _cache.find(idx);
+        if (it != _cache.end()) {
+            _lru.splice(_lru.begin(), _lru, it->second.second);
+            return it->second.first;
+        }
+    }
+
+    /*
+        Decompress without holding the lock, two threads racing for the same frame both decompress it
+     */
+    std::shared_ptr<std::vector<uint8_t>> frame = std::make_shared<std::vector<uint8_t>>(_frames.at(idx).decompSize);
+    decompressFrame(idx, frame->data());
+
+    std::unique_lock<std::mutex> ul(_cacheLock);
+    auto it = _cache.find(idx);
+    if (it != _cache.end()) return it->second.first;
+    _lru.push_front(idx);
+    _cache[idx] = {frame, _lru.begin()};
+    _cacheSize += frame->size();
+    while (_cacheSize > _cacheLimit && _lru.size() > 1) {
+        auto evict = _cache.find(_lru.back());
+        _cacheSize -= evict->second.first->size();
+        _cache.erase(evict);
+        _lru.pop_back();
+    }
+    return frame;
+}
+
+#pragma mark OrbisFSSeekableZstd public
+uint64_t OrbisFSSeekableZstd::size(){
+    return _size;
+}
+
+size_t OrbisFSSeekableZstd::frames(){
+    return _frames.size();
+}
+
+uint64_t OrbisFSSeekableZstd::decompressedFrames(){
+    return _decompressedFrames;
+}
+
+uint8_t *OrbisFSSeekableZstd::mapping(){
+    return _mapping;
+}
+
+void OrbisFSSeekableZstd::populate(uint64_t offset, uint64_t len){
+    if (!len) return;
+    retassure(offset + len <= _size, "Range 0x%llx-0x%llx is beyond the decompressed image",offset,offset+len);
+    size_t last = frameForOffset(offset + len - 1);
+    for (size_t idx = frameForOffset(offset); idx <= last; idx++) {
+        if (_resident[idx].load(std::memory_order_acquire)) continue;
+        std::unique_lock<std::mutex> ul(_populateLocks[idx % (sizeof(_populateLocks)/sizeof(*_populateLocks))]);
+        if (_resident[idx].load(std::memory_order_relaxed)) continue;
+        const Frame &f = _frames[idx];
+        {
+            /*
+                Reuse a cached copy if file reads already decompressed this frame
+             */
+            std::unique_lock<std::mutex> cl(_cacheLock);
+            auto it = _cache.find(idx);
+            if (it != _cache.end()) {
+                memcpy(&_mapping[f.decompOffset], it->second.first->data(), f.decompSize);
+                _resident[idx].store(true, std::memory_order_release);
+                continue;
+            }
+        }
+        decompressFrame(idx, &_mapping[f.decompOffset]);
+        _resident[idx].store(true, std::memory_order_release);
+    }
+}
+
+void OrbisFSSeekableZstd::iterate(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback){
+    if (!len) return;
+    retassure(offset + len <= _size, "Range 0x%llx-0x%llx is beyond the decompressed image",offset,offset+len);
+    while (len) {
+        size_t idx = frameForOffset(offset);
+        const Frame &f = _frames[idx];
+        uint64_t frameOffset = offset - f.decompOffset;
+        size_t curLen = (size_t)std::min<uint64_t>(len, f.decompSize - frameOffset);
+        if (_resident[idx].load(std::memory_order_acquire)) {
+            callback(&_mapping[offset], curLen);
+        }else{
+            auto frame = getFrame(idx);
+            callback(frame->data() + frameOffset, curLen);
+        }
+        offset += curLen;
+        len -= curLen;
+    }
+}
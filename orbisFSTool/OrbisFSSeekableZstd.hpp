@@ -0,0 +1,94 @@
+//
+//  OrbisFSSeekableZstd.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSSeekableZstd_hpp
+#define OrbisFSSeekableZstd_hpp
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ZSTD_SEEKABLE_MAGIC             0x8F92EAB1
+#define ZSTD_SEEKABLE_SKIPPABLE_MAGIC   0x184D2A5E
+#define ZSTD_SEEKABLE_FOOTER_SIZE       9
+#define ZSTD_SEEKABLE_CHECKSUM_FLAG     0x80
+
+namespace orbisFSTool {
+
+/*
+    Random access to a dump in the zstd seekable format (independent frames followed by a seek table).
+
+    Data is available in two ways:
+    - populate() decompresses frames into a reserved mapping of the whole dump, where they stay.
+      This is what OrbisFSImage::getBlock uses, because metadata pointers need to stay valid.
+    - iterate() hands out frames from a bounded LRU cache, used for file data so extracting
+      a large archive doesn't keep everything decompressed in memory.
+ */
+class OrbisFSSeekableZstd {
+public:
+    struct Frame {
+        uint64_t compOffset;
+        uint64_t decompOffset;
+        uint32_t compSize;
+        uint32_t decompSize;
+    };
+private:
+    int _fd; //not owned
+    uint64_t _size;
+    uint32_t _uniformFrameSize; //0 if frames differ in size
+    std::vector<Frame> _frames;
+
+    uint8_t *_mapping;
+    std::unique_ptr<std::atomic<bool>[]> _resident;
+    std::mutex _populateLocks[64]; //striped by frame index, so different frames decompress in parallel
+
+    size_t _cacheLimit;
+    size_t _cacheSize;
+    std::mutex _cacheLock;
+    std::list<size_t> _lru;
+    std::unordered_map<size_t, std::pair<std::shared_ptr<const std::vector<uint8_t>>, std::list<size_t>::iterator>> _cache;
+
+    std::atomic<uint64_t> _decompressedFrames;
+
+    size_t frameForOffset(uint64_t offset);
+    void decompressFrame(size_t idx, void *dst);
+    std::shared_ptr<const std::vector<uint8_t>> getFrame(size_t idx);
+public:
+    /*
+        Only looks at the seek table, works without zstd support
+     */
+    static bool isSeekableZstd(int fd, uint64_t fileSize);
+
+    OrbisFSSeekableZstd(int fd, uint64_t fileSize, size_t cacheLimit = 128*1024*1024);
+    ~OrbisFSSeekableZstd();
+
+    uint64_t size();
+    size_t frames();
+    uint64_t decompressedFrames();
+
+    /*
+        Reserved (not committed) memory covering the whole decompressed dump,
+        only ranges passed to populate() contain data
+     */
+    uint8_t *mapping();
+    void populate(uint64_t offset, uint64_t len);
+
+    /*
+        data is only valid during the callback
+     */
+    void iterate(uint64_t offset, uint64_t len, std::function<void(const void *data, size_t len)> callback);
+};
+
+}
+#endif /* OrbisFSSeekableZstd_hpp */
@@ -0,0 +1,231 @@
+//
+//  OrbisFSStats.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSStats.hpp"
+#include "OrbisFSTrace.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+
+using namespace orbisFSTool;
+
+namespace {
+enum Kind {
+    kKindCount,     //no histogram
+    kKindDepth,     //linear buckets
+    kKindLatency    //log2 buckets of ns
+};
+
+struct OpInfo {
+    const char *name;
+    Kind kind;
+};
+
+const OpInfo gOps[OrbisFSStats::kOpCount] = {
+    {"getBlock",        kKindCount},
+    {"fatWalk",         kKindDepth},
+    {"findInode",       kKindLatency},
+    {"dirScan",         kKindLatency},
+    {"dirLookup",       kKindLatency},
+    {"pathResolve",     kKindLatency},
+    {"fuse.lookup",     kKindLatency},
+    {"fuse.getattr",    kKindLatency},
+    {"fuse.setattr",    kKindLatency},
+    {"fuse.open",       kKindLatency},
+    {"fuse.read",       kKindLatency},
+    {"fuse.write",      kKindLatency},
+    {"fuse.flush",      kKindLatency},
+    {"fuse.release",    kKindLatency},
+    {"fuse.opendir",    kKindLatency},
+    {"fuse.readdir",    kKindLatency},
+    {"fuse.releasedir", kKindLatency},
+};
+
+/*
+    Only the owning thread writes, so plain loads and stores are enough (no locked instructions),
+    readers may see slightly stale values
+ */
+struct OpStats {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> buckets[OrbisFSStats::kHistogramBuckets];
+};
+
+struct ThreadStats;
+
+struct Registry {
+    std::mutex lock;
+    std::vector<ThreadStats*> threads;
+    OpStats retired[OrbisFSStats::kOpCount];    //threads which already exited
+};
+
+Registry *registry(){
+    //never destroyed, threads may still exit after main returned
+    static Registry *ret = new Registry();
+    return ret;
+}
+
+inline void bump(std::atomic<uint64_t> &v, uint64_t add){
+    v.store(v.load(std::memory_order_relaxed) + add, std::memory_order_relaxed);
+}
+
+struct ThreadStats {
+    OpStats ops[OrbisFSStats::kOpCount];
+
+    ThreadStats() : ops(){
+        Registry *r = registry();
+        std::unique_lock<std::mutex> ul(r->lock);
+        r->threads.push_back(this);
+    }
+    ~ThreadStats(){
+        Registry *r = registry();
+        std::unique_lock<std::mutex> ul(r->lock);
+        r->threads.erase(std::find(r->threads.begin(), r->threads.end(), this));
+        for (uint32_t i=0; i<OrbisFSStats::kOpCount; i++) {
+            bump(r->retired[i].count, ops[i].count.load(std::memory_order_relaxed));
+            bump(r->retired[i].sum, ops[i].sum.load(std::memory_order_relaxed));
+            for (uint32_t b=0; b<OrbisFSStats::kHistogramBuckets; b++) {
+                bump(r->retired[i].buckets[b], ops[i].buckets[b].load(std::memory_order_relaxed));
+            }
+        }
+    }
+};
+
+ThreadStats &localStats(){
+    static thread_local ThreadStats ret;
+    return ret;
+}
+
+uint32_t bucketForValue(Kind kind, uint64_t value){
+    uint32_t ret = 0;
+    if (kind == kKindDepth) {
+        ret = (uint32_t)std::min<uint64_t>(value, OrbisFSStats::kHistogramBuckets-1);
+    }else{
+        while (value && ret < OrbisFSStats::kHistogramBuckets-1) {
+            value >>= 1;
+            ret++;
+        }
+    }
+    return ret;
+}
+
+/*
+    Upper bound of the bucket holding the given percentile
+ */
+uint64_t percentile(const uint64_t buckets[], uint64_t count, double pct){
+    uint64_t want = (uint64_t)(count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+    if (!want) want = 1;
+    for (uint32_t b=0; b<OrbisFSStats::kHistogramBuckets; b++) {
+        seen += buckets[b];
+        if (seen >= want) return b ? (1ULL << b) - 1 : 0;
+    }
+    return 0;
+}
+
+std::string humanNs(uint64_t ns){
+    char buf[0x20] = {};
+    if (ns < 10000) {
+        snprintf(buf, sizeof(buf), "%lluns",ns);
+    }else if (ns < 10000000) {
+        snprintf(buf, sizeof(buf), "%lluus",ns/1000);
+    }else{
+        snprintf(buf, sizeof(buf), "%llums",ns/1000000);
+    }
+    return buf;
+}
+}
+
+std::atomic<bool> OrbisFSStats::_enabled{false};
+
+#pragma mark OrbisFSStats::Timer
+OrbisFSStats::Timer::Timer(Op op)
+: _op(op), _stats(enabled()), _trace(OrbisFSTrace::enabled()), _start(0)
+{
+    if (_stats || _trace) _start = OrbisFSTrace::now();
+}
+
+OrbisFSStats::Timer::~Timer(){
+    if (!_stats && !_trace) return;
+    uint64_t end = OrbisFSTrace::now();
+    if (_stats) add(_op, end - _start);
+    if (_trace) OrbisFSTrace::add(gOps[_op].name, _start, end);
+}
+
+#pragma mark OrbisFSStats private
+void OrbisFSStats::add(Op op, uint64_t value){
+    OpStats &s = localStats().ops[op];
+    bump(s.count, 1);
+    if (gOps[op].kind == kKindCount) return;
+    bump(s.sum, value);
+    bump(s.buckets[bucketForValue(gOps[op].kind, value)], 1);
+}
+
+#pragma mark OrbisFSStats public
+void OrbisFSStats::enable(){
+    _enabled = true;
+}
+
+std::string OrbisFSStats::report(){
+    uint64_t count[kOpCount] = {};
+    uint64_t sum[kOpCount] = {};
+    uint64_t buckets[kOpCount][kHistogramBuckets] = {};
+    {
+        Registry *r = registry();
+        std::unique_lock<std::mutex> ul(r->lock);
+        auto collect = [&](const OpStats *ops){
+            for (uint32_t i=0; i<kOpCount; i++) {
+                count[i] += ops[i].count.load(std::memory_order_relaxed);
+                sum[i] += ops[i].sum.load(std::memory_order_relaxed);
+                for (uint32_t b=0; b<kHistogramBuckets; b++) {
+                    buckets[i][b] += ops[i].buckets[b].load(std::memory_order_relaxed);
+                }
+            }
+        };
+        collect(r->retired);
+        for (auto t : r->threads) collect(t->ops);
+    }
+
+    std::string ret;
+    char buf[0x200] = {};
+    snprintf(buf, sizeof(buf), "%-18s %12s %10s %10s %10s %10s\n","op","count","avg","p50","p90","p99");
+    ret += buf;
+    for (uint32_t i=0; i<kOpCount; i++) {
+        if (!count[i]) continue;
+        switch (gOps[i].kind) {
+            case kKindCount:
+                snprintf(buf, sizeof(buf), "%-18s %12llu\n",gOps[i].name,count[i]);
+                break;
+            case kKindDepth:
+            {
+                std::string depths;
+                for (uint32_t b=0; b<kHistogramBuckets; b++) {
+                    if (!buckets[i][b]) continue;
+                    char d[0x40] = {};
+                    snprintf(d, sizeof(d), " depth%u=%llu",b,buckets[i][b]);
+                    depths += d;
+                }
+                snprintf(buf, sizeof(buf), "%-18s %12llu %10.2f %s\n",gOps[i].name,count[i],(double)sum[i]/count[i],depths.c_str());
+                break;
+            }
+            case kKindLatency:
+                snprintf(buf, sizeof(buf), "%-18s %12llu %10s %10s %10s %10s\n",gOps[i].name,count[i],
+                         humanNs(sum[i]/count[i]).c_str(),
+                         humanNs(percentile(buckets[i], count[i], 50)).c_str(),
+                         humanNs(percentile(buckets[i], count[i], 90)).c_str(),
+                         humanNs(percentile(buckets[i], count[i], 99)).c_str());
+                break;
+        }
+        ret += buf;
+    }
+    return ret;
+}
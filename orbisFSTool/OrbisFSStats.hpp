@@ -0,0 +1,83 @@
+//
+//  OrbisFSStats.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSStats_hpp
+#define OrbisFSStats_hpp
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Operation counters and histograms, collected per thread and only summed up when reporting.
+    Latencies go into power of two buckets (in ns), FAT walks are bucketed by their depth.
+    While disabled, every probe costs a single relaxed load.
+ */
+class OrbisFSStats {
+public:
+    enum Op : uint32_t {
+        kOpGetBlock = 0,
+        kOpFatWalk,
+        kOpFindInode,
+        kOpDirScan,
+        kOpDirLookup,
+        kOpPathResolve,
+        kOpFuseLookup,
+        kOpFuseGetattr,
+        kOpFuseSetattr,
+        kOpFuseOpen,
+        kOpFuseRead,
+        kOpFuseWrite,
+        kOpFuseFlush,
+        kOpFuseRelease,
+        kOpFuseOpendir,
+        kOpFuseReaddir,
+        kOpFuseReleasedir,
+
+        kOpCount
+    };
+    enum : uint32_t {
+        kHistogramBuckets = 40
+    };
+
+    /*
+        Measures the lifetime of the object, also recorded as span while OrbisFSTrace is enabled
+     */
+    class Timer {
+        Op _op;
+        bool _stats;
+        bool _trace;
+        uint64_t _start;
+    public:
+        Timer(Op op);
+        ~Timer();
+    };
+private:
+    static std::atomic<bool> _enabled;
+
+    static void add(Op op, uint64_t value);
+public:
+    static void enable();
+    static inline bool enabled(){return _enabled.load(std::memory_order_relaxed);}
+
+    /*
+        Counts op with value (latency in ns, or fat depth) going into its histogram
+     */
+    static inline void record(Op op, uint64_t value = 0){if (enabled()) add(op, value);}
+
+    /*
+        Human readable table of all ops seen so far
+     */
+    static std::string report();
+};
+
+}
+#endif /* OrbisFSStats_hpp */
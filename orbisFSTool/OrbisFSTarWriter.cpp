@@ -0,0 +1,223 @@
+//
+//  OrbisFSTarWriter.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSTarWriter.hpp"
+#include "utils.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <chrono>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define TAR_BLOCK_SIZE 512
+
+#define USTAR_NAME_LEN 100
+#define USTAR_PREFIX_LEN 155
+
+#define USTAR_TYPE_REG '0'
+#define USTAR_TYPE_DIR '5'
+#define USTAR_TYPE_PAX 'x'
+
+using namespace orbisFSTool;
+
+namespace {
+struct UstarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+static_assert(sizeof(UstarHeader) == TAR_BLOCK_SIZE, "bad ustar header size");
+}
+
+/*
+    Writes val as zero padded octal, returns false if it doesn't fit
+ */
+static bool putOctal(char *field, size_t fieldSize, uint64_t val){
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%0*llo", (int)fieldSize-1, (unsigned long long)val);
+    if (len < 0 || (size_t)len > fieldSize-1) return false;
+    memcpy(field, buf, len+1);
+    return true;
+}
+
+static std::string paxRecord(const std::string &key, const std::string &value){
+    /*
+        The record length includes its own digits
+     */
+    size_t payload = 1 + key.size() + 1 + value.size() + 1; //' ' key '=' value '\n'
+    size_t len = payload + 1;
+    while (std::to_string(len).size() + payload != len) len = std::to_string(len).size() + payload;
+    return std::to_string(len) + " " + key + "=" + value + "\n";
+}
+
+#pragma mark OrbisFSTarWriter
+OrbisFSTarWriter::OrbisFSTarWriter(int fd)
+: _fd(fd)
+, _written(0)
+, _files(0), _dirs(0)
+{
+    retassure(_fd != -1, "Bad output fd");
+#ifdef F_SETPIPE_SZ
+    /*
+        Larger pipe buffers mean fewer wakeups on both ends, failing is fine
+     */
+    fcntl(_fd, F_SETPIPE_SZ, 1024*1024);
+#endif
+}
+
+#pragma mark OrbisFSTarWriter private
+void OrbisFSTarWriter::writeAll(const void *buf, size_t len){
+    orbisFSTool::writeAll(_fd, buf, len);
+    _written += len;
+}
+
+void OrbisFSTarWriter::writePadding(uint64_t size){
+    static const uint8_t zeros[TAR_BLOCK_SIZE] = {};
+    if (size % TAR_BLOCK_SIZE) writeAll(zeros, TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE));
+}
+
+void OrbisFSTarWriter::writePaxHeader(const std::string &name, const std::vector<std::pair<std::string, std::string>> &records){
+    std::string data;
+    for (auto &r : records) {
+        data += paxRecord(r.first, r.second);
+    }
+    
+    OrbisFSInode_t paxNode = {};
+    paxNode.fileMode = 0644;
+    std::string paxName = "PaxHeaders/" + name.substr(0, USTAR_NAME_LEN - 12);
+    writeHeader(paxName, paxNode, USTAR_TYPE_PAX, data.size());
+    writeAll(data.data(), data.size());
+    writePadding(data.size());
+}
+
+void OrbisFSTarWriter::writeHeader(const std::string &name, const OrbisFSInode_t &node, char type, uint64_t size){
+    UstarHeader hdr = {};
+    std::vector<std::pair<std::string, std::string>> pax;
+    
+    if (name.size() <= USTAR_NAME_LEN) {
+        memcpy(hdr.name, name.data(), name.size());
+    }else{
+        /*
+            Try to split into prefix and name at a '/', otherwise the name goes into a pax header
+         */
+        size_t split = name.find('/');
+        while (split != std::string::npos && name.size() - split - 1 > USTAR_NAME_LEN) {
+            split = name.find('/', split+1);
+        }
+        if (split != std::string::npos && split > 0 && split <= USTAR_PREFIX_LEN && split+1 < name.size()) {
+            memcpy(hdr.prefix, name.data(), split);
+            memcpy(hdr.name, name.data() + split + 1, name.size() - split - 1);
+        }else{
+            pax.push_back({"path", name});
+            memcpy(hdr.name, name.data(), USTAR_NAME_LEN);
+        }
+    }
+    
+    putOctal(hdr.mode, sizeof(hdr.mode), node.fileMode & 07777);
+    if (!putOctal(hdr.uid, sizeof(hdr.uid), node.uid)) pax.push_back({"uid", std::to_string(node.uid)});
+    if (!putOctal(hdr.gid, sizeof(hdr.gid), node.gid)) pax.push_back({"gid", std::to_string(node.gid)});
+    if (!putOctal(hdr.size, sizeof(hdr.size), size)) pax.push_back({"size", std::to_string(size)});
+    if (!putOctal(hdr.mtime, sizeof(hdr.mtime), node.modDate)) pax.push_back({"mtime", std::to_string(node.modDate)});
+    hdr.typeflag = type;
+    memcpy(hdr.magic, "ustar", 6);
+    memcpy(hdr.version, "00", 2);
+    
+    if (pax.size()) {
+        retassure(type != USTAR_TYPE_PAX, "pax header doesn't fit into ustar header");
+        writePaxHeader(name, pax);
+    }
+    
+    {
+        uint32_t chksum = 0;
+        memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+        for (size_t i=0; i<sizeof(hdr); i++) chksum += ((uint8_t*)&hdr)[i];
+        snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", chksum);
+        hdr.chksum[7] = ' ';
+    }
+    writeAll(&hdr, sizeof(hdr));
+}
+
+#pragma mark OrbisFSTarWriter public
+uint64_t OrbisFSTarWriter::bytesWritten(){
+    return _written;
+}
+
+void OrbisFSTarWriter::addDirectory(const std::string &name, const OrbisFSInode_t &node){
+    std::string dirName = name;
+    if (dirName.back() != '/') dirName += '/';
+    writeHeader(dirName, node, USTAR_TYPE_DIR, 0);
+    _dirs++;
+}
+
+void OrbisFSTarWriter::addFile(const std::string &name, const OrbisFSInode_t &node, OrbisFSFile *file){
+    uint64_t size = file->size();
+    writeHeader(name, node, USTAR_TYPE_REG, size);
+    file->iterateOverData(0, size, [&](const void *data, size_t len){
+        writeAll(data, len);
+    });
+    writePadding(size);
+    _files++;
+}
+
+void OrbisFSTarWriter::addTree(OrbisFSImage *img, std::string path){
+    std::string prefix = path;
+    if (prefix.back() != '/') prefix += '/';
+    auto tstart = std::chrono::steady_clock::now();
+    uint64_t startWritten = _written;
+    
+    img->iterateOverFilesInFolder(path, true, [&](std::string curPath, OrbisFSInode_t node){
+        if (curPath.size() > 1 && curPath.back() == '/') curPath.pop_back();
+        std::string name;
+        if (curPath.size() > prefix.size()) {
+            name = curPath.substr(prefix.size());
+        }else if (S_ISDIR(node.fileMode)) {
+            name = ".";
+        }else{
+            /*
+                Exporting a single file, archive it under its own name
+             */
+            name = curPath.substr(curPath.rfind('/')+1);
+        }
+        
+        if (S_ISDIR(node.fileMode)) {
+            addDirectory(name, node);
+        }else if (S_ISREG(node.fileMode)) {
+            addFile(name, node, img->openFileID(node.inodeNum).get());
+        }else{
+            error("Skipping '%s' with unsupported file mode 0%o",curPath.c_str(),node.fileMode);
+        }
+    });
+    
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    info("Archived %llu files and %llu directories (%llu bytes) in %.3f sec (%.2f MB/s)",
+         _files, _dirs, _written - startWritten, secs, (_written - startWritten)/secs/1e6);
+}
+
+void OrbisFSTarWriter::finish(){
+    static const uint8_t zeros[TAR_BLOCK_SIZE*2] = {};
+    writeAll(zeros, sizeof(zeros));
+}
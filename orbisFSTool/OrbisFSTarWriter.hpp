@@ -0,0 +1,56 @@
+//
+//  OrbisFSTarWriter.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSTarWriter_hpp
+#define OrbisFSTarWriter_hpp
+
+#include "OrbisFSImage.hpp"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Streams a ustar archive to a file descriptor, falling back to pax extended headers
+    for names and numbers which don't fit into the ustar fields.
+    File data is written straight from the image mapping.
+ */
+class OrbisFSTarWriter {
+    int _fd; //not owned
+    uint64_t _written;
+    uint64_t _files;
+    uint64_t _dirs;
+    
+    void writeAll(const void *buf, size_t len);
+    void writePadding(uint64_t size);
+    void writeHeader(const std::string &name, const OrbisFSInode_t &node, char type, uint64_t size);
+    void writePaxHeader(const std::string &name, const std::vector<std::pair<std::string, std::string>> &records);
+public:
+    OrbisFSTarWriter(int fd);
+    
+    uint64_t bytesWritten();
+    
+    void addDirectory(const std::string &name, const OrbisFSInode_t &node);
+    void addFile(const std::string &name, const OrbisFSInode_t &node, OrbisFSFile *file);
+    
+    /*
+        Adds everything below path, names in the archive are relative to path
+     */
+    void addTree(OrbisFSImage *img, std::string path);
+    
+    /*
+        Writes the end of archive marker
+     */
+    void finish();
+};
+
+}
+#endif /* OrbisFSTarWriter_hpp */
@@ -0,0 +1,217 @@
+//
+//  OrbisFSTrace.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSTrace.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define TRACE_RING_SIZE 0x10000 //spans per thread, power of 2
+
+using namespace orbisFSTool;
+
+namespace {
+struct Event {
+    const char *name;
+    const char *argName;
+    uint64_t start;
+    uint64_t dur;
+    uint64_t arg;
+    uint32_t tid;
+};
+
+/*
+    Single producer ring, head counts all events ever pushed.
+    Rings of exited threads are handed to new threads, their events keep the old tid.
+ */
+struct Ring {
+    std::atomic<uint64_t> head;
+    Event events[TRACE_RING_SIZE];
+};
+
+struct Registry {
+    std::mutex lock;
+    std::vector<Ring*> rings;
+    std::vector<Ring*> freeRings;
+    uint32_t nextTid = 1;
+    std::mutex writeLock;
+    std::string path;
+    uint64_t epoch = 0;
+};
+
+Registry *registry(){
+    //never destroyed, threads may still exit after main returned
+    static Registry *ret = new Registry();
+    return ret;
+}
+
+struct ThreadRing {
+    Ring *ring;
+    uint32_t tid;
+
+    ThreadRing() : ring(NULL), tid(0){
+        Registry *r = registry();
+        std::unique_lock<std::mutex> ul(r->lock);
+        tid = r->nextTid++;
+        if (r->freeRings.size()) {
+            ring = r->freeRings.back();
+            r->freeRings.pop_back();
+        }else{
+            ring = new Ring();
+            ring->head = 0;
+            r->rings.push_back(ring);
+        }
+    }
+    ~ThreadRing(){
+        Registry *r = registry();
+        std::unique_lock<std::mutex> ul(r->lock);
+        r->freeRings.push_back(ring);
+    }
+};
+
+ThreadRing &localRing(){
+    static thread_local ThreadRing ret;
+    return ret;
+}
+
+void signalThread(){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (true) {
+        int sig = 0;
+        if (sigwait(&set, &sig)) continue;
+        try {
+            OrbisFSTrace::write();
+        } catch (tihmstar::exception &e) {
+            e.dump();
+        }
+    }
+}
+}
+
+std::atomic<bool> OrbisFSTrace::_enabled{false};
+
+#pragma mark OrbisFSTrace::Span
+OrbisFSTrace::Span::Span(const char *name, const char *argName, uint64_t arg)
+: _name(name), _argName(argName), _arg(arg), _start(0)
+{
+    if (enabled()) _start = now();
+}
+
+OrbisFSTrace::Span::~Span(){
+    if (_start) add(_name, _start, now(), _argName, _arg);
+}
+
+#pragma mark OrbisFSTrace
+void OrbisFSTrace::enable(const char *path){
+    Registry *r = registry();
+    {
+        std::unique_lock<std::mutex> ul(r->writeLock);
+        r->path = path;
+        r->epoch = now();
+    }
+    localRing(); //the calling thread becomes tid 1
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    retassure(!pthread_sigmask(SIG_BLOCK, &set, NULL), "Failed to block SIGUSR1");
+    std::thread(signalThread).detach();
+    _enabled = true;
+}
+
+uint64_t OrbisFSTrace::now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void OrbisFSTrace::add(const char *name, uint64_t start, uint64_t end, const char *argName, uint64_t arg){
+    ThreadRing &t = localRing();
+    uint64_t head = t.ring->head.load(std::memory_order_relaxed);
+    Event &e = t.ring->events[head & (TRACE_RING_SIZE-1)];
+    e.name = name;
+    e.argName = argName;
+    e.start = start;
+    e.dur = end - start;
+    e.arg = arg;
+    e.tid = t.tid;
+    t.ring->head.store(head + 1, std::memory_order_release);
+}
+
+void OrbisFSTrace::write(){
+    Registry *r = registry();
+    std::unique_lock<std::mutex> wl(r->writeLock);
+    if (!r->path.size()) return;
+
+    std::vector<Event> events;
+    uint64_t dropped = 0;
+    uint32_t threads = 0;
+    {
+        std::unique_lock<std::mutex> ul(r->lock);
+        threads = r->nextTid - 1;
+        for (Ring *ring : r->rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+            size_t base = events.size();
+            for (uint64_t i=first; i<head; i++) {
+                events.push_back(ring->events[i & (TRACE_RING_SIZE-1)]);
+            }
+            /*
+                The owner kept recording while we copied, drop whatever it may have overwritten meanwhile
+             */
+            uint64_t newHead = ring->head.load(std::memory_order_acquire);
+            uint64_t valid = newHead > TRACE_RING_SIZE ? newHead - TRACE_RING_SIZE : 0;
+            if (valid > first) {
+                uint64_t stale = std::min(valid - first, head - first);
+                events.erase(events.begin() + base, events.begin() + base + stale);
+            }
+            dropped += (newHead > TRACE_RING_SIZE ? newHead - TRACE_RING_SIZE : 0);
+        }
+    }
+
+    std::string tmpPath = r->path + ".tmp";
+    FILE *f = NULL;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+    });
+    retassure(f = fopen(tmpPath.c_str(), "w"), "Failed to open trace file '%s' errno=%d (%s)",tmpPath.c_str(),errno,strerror(errno));
+
+    const int pid = getpid();
+    const char *sep = "";
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"droppedSpans\":%llu},\"traceEvents\":[",dropped);
+    for (uint32_t tid=1; tid<=threads; tid++) {
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                sep,pid,tid,tid == 1 ? "main" : "worker",tid);
+        sep = ",";
+    }
+    for (const Event &e : events) {
+        uint64_t ts = e.start > r->epoch ? e.start - r->epoch : 0;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"orbisfs\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+                sep,e.name,pid,e.tid,ts/1000,ts%1000,e.dur/1000,e.dur%1000);
+        if (e.argName) fprintf(f, ",\"args\":{\"%s\":%llu}",e.argName,e.arg);
+        fprintf(f, "}");
+        sep = ",";
+    }
+    fprintf(f, "\n]}\n");
+    retassure(!ferror(f), "Failed to write trace file '%s'",tmpPath.c_str());
+    retassure(!fclose(f), "Failed to close trace file '%s'",tmpPath.c_str());
+    f = NULL;
+    retassure(!rename(tmpPath.c_str(), r->path.c_str()), "Failed to move trace file to '%s' errno=%d (%s)",r->path.c_str(),errno,strerror(errno));
+    info("Wrote %zu spans (%llu dropped) of %u threads to '%s'",events.size(),dropped,threads,r->path.c_str());
+}
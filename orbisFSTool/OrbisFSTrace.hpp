@@ -0,0 +1,66 @@
+//
+//  OrbisFSTrace.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSTrace_hpp
+#define OrbisFSTrace_hpp
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace orbisFSTool {
+
+/*
+    Timeline of scoped spans, written as Chrome trace-event JSON (chrome://tracing, Perfetto).
+    Every thread records into its own ring buffer, so recording takes no locks and only
+    the newest TRACE_RING_SIZE spans per thread are kept.
+    While disabled, every probe costs a single relaxed load.
+ */
+class OrbisFSTrace {
+public:
+    /*
+        Records the lifetime of the object, name and argName must be string literals
+     */
+    class Span {
+        const char *_name;
+        const char *_argName;
+        uint64_t _arg;
+        uint64_t _start;
+    public:
+        Span(const char *name, const char *argName = NULL, uint64_t arg = 0);
+        ~Span();
+    };
+private:
+    static std::atomic<bool> _enabled;
+public:
+    /*
+        Starts recording, the trace is written to path by write() and whenever the process gets SIGUSR1.
+        Must be called before any other thread is started, so all of them inherit the blocked signal.
+     */
+    static void enable(const char *path);
+    static inline bool enabled(){return _enabled.load(std::memory_order_relaxed);}
+
+    /*
+        Monotonic timestamp in ns, as used by add()
+     */
+    static uint64_t now();
+
+    /*
+        Records a span which already ended
+     */
+    static void add(const char *name, uint64_t start, uint64_t end, const char *argName = NULL, uint64_t arg = 0);
+
+    /*
+        Writes everything recorded so far, threads may keep recording meanwhile
+     */
+    static void write();
+};
+
+}
+#endif /* OrbisFSTrace_hpp */
@@ -0,0 +1,136 @@
+//
+//  OrbisFSWorkPool.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSWorkPool.hpp"
+
+#include <libgeneral/macros.h>
+
+using namespace orbisFSTool;
+
+static thread_local OrbisFSWorkPool *gCurrentPool = NULL;
+static thread_local unsigned gCurrentWorker = 0;
+
+#pragma mark OrbisFSWorkPool
+OrbisFSWorkPool::OrbisFSWorkPool(unsigned threads)
+: _queued{0}, _pending{0}, _failed{0}
+, _nextQueue{0}
+, _stop(false)
+{
+    if (!threads) threads = std::thread::hardware_concurrency();
+    if (!threads) threads = 1;
+    
+    for (unsigned i=0; i<threads; i++) {
+        _queues.emplace_back(new WorkQueue);
+    }
+    for (unsigned i=0; i<threads; i++) {
+        _workers.emplace_back([this,i]{
+            workerLoop(i);
+        });
+    }
+}
+
+OrbisFSWorkPool::~OrbisFSWorkPool(){
+    {
+        std::unique_lock<std::mutex> ul(_idleLock);
+        _stop = true;
+    }
+    _workCond.notify_all();
+    for (auto &w : _workers) {
+        w.join();
+    }
+}
+
+#pragma mark OrbisFSWorkPool private
+bool OrbisFSWorkPool::popTask(unsigned worker, Task &task){
+    {
+        WorkQueue *q = _queues[worker].get();
+        std::unique_lock<std::mutex> ul(q->lock);
+        if (q->tasks.size()) {
+            task = std::move(q->tasks.back());
+            q->tasks.pop_back();
+            _queued--;
+            return true;
+        }
+    }
+    for (size_t i=1; i<_queues.size(); i++) {
+        WorkQueue *q = _queues[(worker + i) % _queues.size()].get();
+        std::unique_lock<std::mutex> ul(q->lock);
+        if (q->tasks.size()) {
+            task = std::move(q->tasks.front());
+            q->tasks.pop_front();
+            _queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void OrbisFSWorkPool::workerLoop(unsigned worker){
+    gCurrentPool = this;
+    gCurrentWorker = worker;
+    while (true) {
+        Task task;
+        if (popTask(worker, task)) {
+            try {
+                task(worker);
+            } catch (tihmstar::exception &e) {
+                e.dump();
+                _failed++;
+            } catch (std::exception &e) {
+                error("Task failed with %s",e.what());
+                _failed++;
+            } catch (...) {
+                error("Task failed with an unknown exception");
+                _failed++;
+            }
+            task = nullptr; //whatever the task captured must be gone before wait() returns
+            if (--_pending == 0) {
+                std::unique_lock<std::mutex> ul(_idleLock);
+                _doneCond.notify_all();
+            }
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> ul(_idleLock);
+        if (_stop) break;
+        if (!_queued) _workCond.wait(ul);
+    }
+}
+
+#pragma mark OrbisFSWorkPool public
+unsigned OrbisFSWorkPool::threads(){
+    return (unsigned)_workers.size();
+}
+
+uint64_t OrbisFSWorkPool::failedTasks(){
+    return _failed;
+}
+
+void OrbisFSWorkPool::push(Task task){
+    unsigned qi = (gCurrentPool == this) ? gCurrentWorker : (_nextQueue++ % _queues.size());
+    _pending++;
+    {
+        WorkQueue *q = _queues[qi].get();
+        std::unique_lock<std::mutex> ul(q->lock);
+        q->tasks.push_back(std::move(task));
+        _queued++;
+    }
+    {
+        /*
+            Idle workers check _queued while holding this lock, taking it here makes sure they can't miss the wakeup
+         */
+        std::unique_lock<std::mutex> ul(_idleLock);
+    }
+    _workCond.notify_one();
+}
+
+void OrbisFSWorkPool::wait(){
+    std::unique_lock<std::mutex> ul(_idleLock);
+    while (_pending) {
+        _doneCond.wait(ul);
+    }
+}
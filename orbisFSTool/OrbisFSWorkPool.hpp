@@ -0,0 +1,72 @@
+//
+//  OrbisFSWorkPool.hpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#ifndef OrbisFSWorkPool_hpp
+#define OrbisFSWorkPool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace orbisFSTool {
+
+/*
+    Work-stealing thread pool.
+    Every worker has its own deque: tasks pushed from a worker go to its own deque and are taken LIFO,
+    idle workers steal FIFO from the others, so recursive work stays local until somebody runs dry.
+ */
+class OrbisFSWorkPool {
+public:
+    typedef std::function<void(unsigned worker)> Task;
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _workers;
+    
+    std::mutex _idleLock;
+    std::condition_variable _workCond;
+    std::condition_variable _doneCond;
+    std::atomic<uint64_t> _queued;  //tasks waiting in a queue
+    std::atomic<uint64_t> _pending; //tasks queued or running
+    std::atomic<uint64_t> _failed;
+    std::atomic<unsigned> _nextQueue;
+    bool _stop;
+    
+    bool popTask(unsigned worker, Task &task);
+    void workerLoop(unsigned worker);
+public:
+    OrbisFSWorkPool(unsigned threads = 0);
+    ~OrbisFSWorkPool();
+    
+    unsigned threads();
+    
+    /*
+        Number of tasks which threw an exception
+     */
+    uint64_t failedTasks();
+    
+    void push(Task task);
+    
+    /*
+        Blocks until every pushed task (including the ones pushed by tasks) finished
+     */
+    void wait();
+};
+
+}
+#endif /* OrbisFSWorkPool_hpp */
@@ -0,0 +1,175 @@
+//
+//  liborbisfs.cpp
+//  liborbisfs
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include <liborbisfs/liborbisfs.h>
+
+#include "OrbisFSImage.hpp"
+#include "OrbisFSException.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <memory>
+#include <new>
+#include <string>
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace orbisFSTool;
+
+struct orbisfs_image {
+    std::unique_ptr<OrbisFSImage> img;
+};
+
+namespace {
+thread_local std::string gLastError;
+
+/*
+    Runs fn and turns exceptions into negative errno values, nothing may escape into C callers
+ */
+template <typename Fn>
+int64_t guarded(Fn fn) noexcept{
+    try {
+        return fn();
+    } catch (tihmstar::OrbisFSFileNotFound &e) {
+        gLastError = e.what();
+        return -ENOENT;
+    } catch (tihmstar::exception &e) {
+        gLastError = e.what();
+        return -EIO;
+    } catch (std::bad_alloc &e) {
+        gLastError = "Out of memory";
+        return -ENOMEM;
+    } catch (...) {
+        gLastError = "Unknown error";
+        return -EIO;
+    }
+}
+
+int64_t fail(int err, const char *msg){
+    gLastError = msg;
+    return -err;
+}
+
+void fillStat(const OrbisFSInode_t &node, orbisfs_stat *st){
+    memset(st, 0, sizeof(*st));
+    st->ino = node.inodeNum;
+    st->mode = node.fileMode;
+    st->uid = node.uid;
+    st->gid = node.gid;
+    st->blocks = node.usedBlocks;
+    st->size = node.filesize;
+    st->ctime = node.createDate;
+    st->mtime = node.modDate;
+    st->atime = node.accessDate;
+}
+}
+
+#pragma mark liborbisfs
+int orbisfs_api_version(void){
+    return LIBORBISFS_API_VERSION;
+}
+
+const char *orbisfs_last_error(void){
+    return gLastError.c_str();
+}
+
+int orbisfs_open(const char *path, uint64_t offset, uint32_t flags, orbisfs_image **out){
+    if (!path || !out) return (int)fail(EINVAL, "Invalid argument");
+    if (flags) return (int)fail(EINVAL, "Unsupported flags");
+    return (int)guarded([&]()->int64_t{
+        std::unique_ptr<orbisfs_image> ret(new orbisfs_image);
+        ret->img.reset(new OrbisFSImage(path, false, offset, false));
+        *out = ret.release();
+        return 0;
+    });
+}
+
+void orbisfs_close(orbisfs_image *img){
+    delete img;
+}
+
+uint32_t orbisfs_block_size(orbisfs_image *img){
+    return img->img->getBlocksize();
+}
+
+int orbisfs_lookup(orbisfs_image *img, uint32_t parent, const char *name, uint32_t *ino){
+    if (!name || !ino) return (int)fail(EINVAL, "Invalid argument");
+    return (int)guarded([&]()->int64_t{
+        OrbisFSInode_t dir = img->img->getInodeForID(parent);
+        if (!S_ISDIR(dir.fileMode)) return fail(ENOTDIR, "Parent is not a directory");
+        *ino = img->img->getInodeInFolder(parent, name).inodeNum;
+        return 0;
+    });
+}
+
+int orbisfs_resolve(orbisfs_image *img, const char *path, uint32_t *ino){
+    if (!path || !ino) return (int)fail(EINVAL, "Invalid argument");
+    return (int)guarded([&]()->int64_t{
+        *ino = img->img->getInodeForPath(path).inodeNum;
+        return 0;
+    });
+}
+
+int orbisfs_stat_ino(orbisfs_image *img, uint32_t ino, orbisfs_stat *st){
+    if (!st) return (int)fail(EINVAL, "Invalid argument");
+    return (int)guarded([&]()->int64_t{
+        fillStat(img->img->getInodeForID(ino), st);
+        return 0;
+    });
+}
+
+int orbisfs_readdir(orbisfs_image *img, uint32_t ino, orbisfs_readdir_cb cb, void *ctx){
+    if (!cb) return (int)fail(EINVAL, "Invalid argument");
+    return (int)guarded([&]()->int64_t{
+        OrbisFSInode_t dir = img->img->getInodeForID(ino);
+        if (!S_ISDIR(dir.fileMode)) return fail(ENOTDIR, "Not a directory");
+        orbisfs_stat st = {};
+        for (auto &e : img->img->listFilesInFolder(ino)) {
+            fillStat(e.second, &st);
+            if (int stop = cb(ctx, e.first.c_str(), &st)) return stop;
+        }
+        return 0;
+    });
+}
+
+int64_t orbisfs_pread(orbisfs_image *img, uint32_t ino, void *buf, size_t len, uint64_t offset){
+    if (!buf && len) return fail(EINVAL, "Invalid argument");
+    return guarded([&]()->int64_t{
+        OrbisFSInode_t node = img->img->getInodeForID(ino);
+        if (S_ISDIR(node.fileMode)) return fail(EISDIR, "Is a directory");
+        if (!S_ISREG(node.fileMode)) return fail(EINVAL, "Not a regular file");
+        auto f = img->img->openFileID(ino);
+        size_t didRead = 0;
+        size_t curRead = 0;
+        while (didRead < len && (curRead = f->pread((uint8_t*)buf+didRead, len-didRead, offset+didRead))) {
+            didRead += curRead;
+        }
+        return (int64_t)didRead;
+    });
+}
+
+int64_t orbisfs_extents(orbisfs_image *img, uint32_t ino, uint64_t offset, uint64_t len, orbisfs_extent *extents, size_t maxExtents){
+    if (!extents && maxExtents) return fail(EINVAL, "Invalid argument");
+    return guarded([&]()->int64_t{
+        OrbisFSInode_t node = img->img->getInodeForID(ino);
+        if (S_ISDIR(node.fileMode)) return fail(EISDIR, "Is a directory");
+        if (!S_ISREG(node.fileMode)) return fail(EINVAL, "Not a regular file");
+        if (img->img->isCompressed()) return fail(ENOTSUP, "Compressed images have no physical extents");
+        auto phys = img->img->openFileID(ino)->getPhysicalExtents(offset, len);
+        const uint64_t fdOffset = img->img->getFdOffset();
+        uint64_t logical = offset;
+        for (size_t i=0; i<phys.size() && i<maxExtents; i++) {
+            extents[i].logical = logical;
+            extents[i].physical = fdOffset + phys[i].first;
+            extents[i].length = phys[i].second;
+            logical += phys[i].second;
+        }
+        return (int64_t)phys.size();
+    });
+}
@@ -6,7 +6,19 @@
 //
 
 #include "OrbisFSImage.hpp"
+#include "OrbisFSDaemon.hpp"
+#include "OrbisFSDedup.hpp"
+#include "OrbisFSDiff.hpp"
+#include "OrbisFSDumper.hpp"
+#include "OrbisFSImageBuilder.hpp"
+#include "OrbisFSManifest.hpp"
+#include "OrbisFSExtractor.hpp"
+#include "OrbisFSFind.hpp"
+#include "OrbisFSListWriter.hpp"
+#include "OrbisFSStats.hpp"
 #include "OrbisFSFuse.hpp"
+#include "OrbisFSTarWriter.hpp"
+#include "OrbisFSTrace.hpp"
 #include "utils.hpp"
 
 #include <libgeneral/macros.h>
@@ -18,6 +30,7 @@
 
 #include <getopt.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -36,12 +49,33 @@ static struct option longopts[] = {
     { "verbose",            no_argument,        NULL, 'v' },
     { "writeable",          no_argument,        NULL, 'w' },
 
+    { "cache-timeout",      required_argument,  NULL,  0  },
     { "check",              no_argument,        NULL,  0  },
+    { "compress",           no_argument,        NULL,  0  },
+    { "create-image",       required_argument,  NULL,  0  },
+    { "dedup",              required_argument,  NULL,  0  },
+    { "diff",               required_argument,  NULL,  0  },
+    { "dump-image",         no_argument,        NULL,  0  },
+    { "export-tar",         required_argument,  NULL,  0  },
     { "extract-resource",   no_argument,        NULL,  0  },
+    { "fast-hash",          no_argument,        NULL,  0  },
+    { "find",               required_argument,  NULL,  0  },
+    { "frame-blocks",       required_argument,  NULL,  0  },
+    { "hash-blocks",        no_argument,        NULL,  0  },
+    { "hash-manifest",      no_argument,        NULL,  0  },
+    { "image-size",         required_argument,  NULL,  0  },
     { "inode",              required_argument,  NULL,  0  },
+    { "list-format",        required_argument,  NULL,  0  },
     { "mount",              required_argument,  NULL,  0  },
     { "offset",             required_argument,  NULL,  0  },
+    { "physical-order",     no_argument,        NULL,  0  },
     { "resize-file",        required_argument,  NULL,  0  },
+    { "serve",              required_argument,  NULL,  0  },
+    { "serve-image",        required_argument,  NULL,  0  },
+    { "stats",              no_argument,        NULL,  0  },
+    { "threads",            required_argument,  NULL,  0  },
+    { "trace",              required_argument,  NULL,  0  },
+    { "verify-manifest",    required_argument,  NULL,  0  },
 
     //advanced debugging
     { "dump-inode",         no_argument,        NULL,  0  },
@@ -53,7 +87,7 @@ void cmd_help(){
            "Usage: orbisFSTool [OPTIONS]\n"
            "Work with orbisFS disk images\n\n"
            "  -h, --help\t\t\tprints usage information\n"
-           "  -e, --extract [path]\t\textract path from image)\n"
+           "  -e, --extract [path]\t\textract path from image (directories need -r)\n"
            "  -i, --input <path>\t\tinput file (or blockdevice)\n"
            "  -l, --list [path]\t\tlist files at path\n"
            "  -o, --output <path>\t\toutput path\n"
@@ -61,12 +95,34 @@ void cmd_help(){
            "  -r, --recursive\t\tperform operation recursively\n"
            "  -v, --verbose\t\t\tincrease logging output\n"
            "  -w, --writeable\t\topen image in write mode\n"
+           "      --cache-timeout <sec>\tkernel attribute/entry cache timeout for --mount\n"
            "      --check\tperform some checks on the image\n"
+           "      --compress\t\twrite --dump-image as seekable zstd (can be opened with -i again)\n"
+           "      --create-image <dir>\tcreate a new image at -o from a host directory\n"
+           "      --dedup <image>\t\tanalyze duplicate blocks across -i and <image> (repeatable)\n"
+           "      --diff <image>\t\tlist files added (A), removed (D) or modified (M) in <image> to stdout (or -o)\n"
+           "      --dump-image\t\tcopy only the used blocks of the image to a sparse image at -o\n"
+           "      --export-tar <path>\t\tstream path as tar archive to stdout (or -o)\n"
            "      --extract-resource\textract file resource instead of file contents\n"
+           "      --image-size <size>\tsize of the image created by --create-image\n"
+           "      --fast-hash\t\tonly use xxh64 for --hash-manifest\n"
+           "      --find <pred>\t\tprint paths below path matching all predicates (repeatable),\n"
+           "                   \t\te.g. name=*.sfo, type=f, size>1M, mtime>=2020-01-01, uid=0, maxdepth=2, prune=*trash*\n"
+           "      --frame-blocks <num>\tblocks per zstd frame for --dump-image --compress (default: 16)\n"
+           "      --hash-blocks\t\talso hash every block in --hash-manifest\n"
+           "      --hash-manifest\t\twrite hashes of all files below path to stdout (or -o)\n"
            "      --inode <num>\t\tspecify file by Inode instead of path\n"
+           "      --list-format <fmt>\t\tprint -l listing as 'ndjson' or 'csv' to stdout (or -o)\n"
            "      --mount <path>\t\tpath to mount\n"
            "      --offset <cnt>\t\toffset inside image\n"
+           "      --physical-order\t\tread files in on-disk order when extracting recursively (faster on HDDs)\n"
            "      --resize-file <size>\t\tresize file inside image\n"
+           "      --serve <socket>\t\tkeep the image open and serve requests on a Unix socket\n"
+           "      --serve-image <image>\talso serve <image> with --serve (repeatable)\n"
+           "      --stats\t\t\tprint operation counters and latencies on exit (also /.orbisfs_stats with --mount)\n"
+           "      --threads <num>\t\tnumber of worker threads (default: all cores)\n"
+           "      --trace <file>\t\twrite a Chrome trace of all operations to file on exit (or on SIGUSR1)\n"
+           "      --verify-manifest <file>\tverify the image against a hash manifest\n"
            "\n"
            //advanced debugging
            "      --dump-inode\t\tdump inode structure\n"
@@ -74,6 +130,47 @@ void cmd_help(){
            );
 }
 
+static OrbisFSDaemon *gDaemon = NULL;
+
+static void stopDaemon(int sig){
+    if (gDaemon) gDaemon->stop();
+}
+
+/*
+    Writes out to the streaming output and empties it
+ */
+static void flushOut(int fd, std::string &out){
+    writeAll(fd, out.data(), out.size());
+    out.clear();
+}
+
+/*
+    Streaming outputs take over stdout once options are parsed, so the banner printed
+    before parsing has to know up front whether it may go there
+ */
+static bool streamOwnsStdout(int argc, const char * argv[]){
+    static const char *streamOpts[] = {"export-tar", "hash-manifest", "verify-manifest", "find", "diff", "list-format"};
+    bool streaming = false;
+    for (int i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-') continue;
+        if (arg[1] == '-') {
+            size_t len = strcspn(arg+2, "=");
+            if (!len) break; //"--" ends the options
+            if (strncmp(arg+2, "output", len) == 0) return false;
+            for (const char *o : streamOpts) {
+                if (strncmp(arg+2, o, len) == 0) streaming = true;
+            }
+        }else{
+            /*
+                -o may follow flags in a cluster like -rvo, any other letter takes the rest as its argument
+             */
+            if (arg[1+strspn(arg+1, "hrvw")] == 'o') return false;
+        }
+    }
+    return streaming;
+}
+
 uint64_t parseNum(const char *num){
     bool isHex = false;
     int64_t ret = 0;
@@ -112,7 +209,6 @@ uint64_t parseNum(const char *num){
 
 MAINFUNCTION
 int main_r(int argc, const char * argv[]) {
-    info("%s",VERSION_STRING);
     
     int optindex = 0;
     int opt = 0;
@@ -120,45 +216,114 @@ int main_r(int argc, const char * argv[]) {
     const char *infile = NULL;
     const char *outfile = NULL;
     const char *mountPath = NULL;
+    const char *exportTarPath = NULL;
+    const char *createImageFrom = NULL;
+    const char *diffImage = NULL;
+    const char *verifyManifestPath = NULL;
+    const char *listFormat = NULL;
+    const char *tracePath = NULL;
+    const char *servePath = NULL;
+    std::vector<const char *> dedupImages;
+    std::vector<const char *> serveImages;
+    std::vector<std::string> findPredicates;
     
     std::string imagePath;
 
     uint64_t offset = 0;
     uint64_t newFileSize = 0;
+    uint64_t imageSize = 0;
     uint32_t iNode = 0;
+    uint32_t frameBlocks = 16;
+    unsigned threads = 0;
+    double cacheTimeout = -1;
     
     int verbosity = 0;
     
     bool writeable = false;
     bool recursive = false;
+    bool physicalOrder = false;
 
     bool doList = false;
     bool doExtract = false;
     bool doExtractResource = false;
     bool doCheck = false;
     bool doResizeFile = false;
+    bool doHashManifest = false;
+    bool hashBlocks = false;
+    bool fastHash = false;
+    bool doStats = false;
+    bool doDumpImage = false;
+    bool compress = false;
     
     bool dumpInode = false;
     
+    if (streamOwnsStdout(argc, argv)) {
+        fprintf(stderr, "%s\n", VERSION_STRING);
+    }else{
+        info("%s",VERSION_STRING);
+    }
+
     while ((opt = getopt_long(argc, (char* const *)argv, "he::i:l::o:p:rvw", longopts, &optindex)) >= 0) {
         switch (opt) {
             case 0: //long opts
             {
                 std::string curopt = longopts[optindex].name;
 
-                if (curopt == "check") {
+                if (curopt == "cache-timeout") {
+                    cacheTimeout = atof(optarg);
+                }else if (curopt == "check") {
                     doCheck = true;
+                }else if (curopt == "compress") {
+                    compress = true;
+                }else if (curopt == "create-image"){
+                    createImageFrom = optarg;
+                }else if (curopt == "dedup"){
+                    dedupImages.push_back(optarg);
+                }else if (curopt == "diff"){
+                    diffImage = optarg;
+                }else if (curopt == "dump-image"){
+                    doDumpImage = true;
+                }else if (curopt == "export-tar"){
+                    exportTarPath = optarg;
+                }else if (curopt == "fast-hash"){
+                    fastHash = true;
+                }else if (curopt == "find"){
+                    findPredicates.push_back(optarg);
+                }else if (curopt == "frame-blocks"){
+                    frameBlocks = (uint32_t)parseNum(optarg);
+                }else if (curopt == "hash-blocks"){
+                    hashBlocks = true;
+                }else if (curopt == "hash-manifest"){
+                    doHashManifest = true;
                 }else if (curopt == "extract-resource"){
                     doExtractResource = true;
+                }else if (curopt == "image-size"){
+                    imageSize = parseNum(optarg);
                 }else if (curopt == "inode"){
                     iNode = atoi(optarg);
+                }else if (curopt == "list-format"){
+                    listFormat = optarg;
                 }else if (curopt == "mount"){
                     mountPath = optarg;
                 }else if (curopt == "offset"){
                     offset = parseNum(optarg);
+                }else if (curopt == "physical-order"){
+                    physicalOrder = true;
                 }else if (curopt == "resize-file"){
                     doResizeFile = true;
                     newFileSize = parseNum(optarg);
+                }else if (curopt == "serve"){
+                    servePath = optarg;
+                }else if (curopt == "serve-image"){
+                    serveImages.push_back(optarg);
+                }else if (curopt == "stats"){
+                    doStats = true;
+                }else if (curopt == "threads"){
+                    threads = (unsigned)parseNum(optarg);
+                }else if (curopt == "trace"){
+                    tracePath = optarg;
+                }else if (curopt == "verify-manifest"){
+                    verifyManifestPath = optarg;
 
                 }else if (curopt == "dump-inode"){
                     dumpInode = true;
@@ -220,6 +385,43 @@ int main_r(int argc, const char * argv[]) {
         }
     }
     
+    if (doStats) OrbisFSStats::enable();
+    if (tracePath) OrbisFSTrace::enable(tracePath);
+
+    int streamfd = -1;
+    cleanup([&]{
+        if (doStats) info("Statistics:\n%s",OrbisFSStats::report().c_str());
+        if (tracePath) {
+            try {
+                OrbisFSTrace::write();
+            } catch (tihmstar::exception &e) {
+                e.dump();
+            }
+        }
+        safeClose(streamfd);
+    });
+    if (exportTarPath || doHashManifest || verifyManifestPath || findPredicates.size() || diffImage || (doList && listFormat)) {
+        if (outfile) {
+            retassure((streamfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to open outfile '%s'",outfile);
+        }else{
+            /*
+                The output owns stdout, all logging goes to stderr from here on
+             */
+            retassure(!exportTarPath || !isatty(STDOUT_FILENO), "Refusing to write tar archive to a terminal, redirect stdout or use -o");
+            retassure((streamfd = dup(STDOUT_FILENO)) != -1, "Failed to dup stdout");
+            fflush(stdout);
+            retassure(dup2(STDERR_FILENO, STDOUT_FILENO) != -1, "Failed to redirect stdout");
+        }
+    }
+
+    if (createImageFrom) {
+        retassure(outfile, "No outputpath specified");
+        OrbisFSImageBuilder builder(createImageFrom, imageSize);
+        builder.writeImage(outfile);
+        info("Created image '%s' from '%s'",outfile,createImageFrom);
+        return 0;
+    }
+
     if (!infile){
         error("No inputfile specified");
         cmd_help();
@@ -230,7 +432,7 @@ int main_r(int argc, const char * argv[]) {
     
     if (doCheck) {
         info("Performing image check");
-        retassure(img->check(), "image check failed!");
+        retassure(img->check(threads), "image check failed!");
         info("Image check succeeded!");
     }
     
@@ -240,7 +442,83 @@ int main_r(int argc, const char * argv[]) {
         imagePath = buf;
     }
     
-    if (doExtract) {
+    if (doDumpImage) {
+        retassure(outfile, "No outputpath specified");
+        OrbisFSDumper dumper(img.get(), threads);
+        if (compress) {
+            dumper.dumpCompressed(outfile, frameBlocks);
+        }else{
+            dumper.dumpSparse(outfile);
+        }
+    } else if (dedupImages.size()) {
+        std::vector<std::shared_ptr<OrbisFSImage>> others;
+        OrbisFSDedup dedup(threads);
+        dedup.addImage(img.get(), infile);
+        for (auto path : dedupImages) {
+            others.push_back(std::make_shared<OrbisFSImage>(path, false, offset));
+            dedup.addImage(others.back().get(), path);
+        }
+        dedup.analyze(verbosity ? SIZE_MAX : 20);
+    } else if (diffImage) {
+        std::shared_ptr<OrbisFSImage> other = std::make_shared<OrbisFSImage>(diffImage, false, offset);
+        OrbisFSDiff differ(img.get(), other.get(), threads);
+        auto changes = differ.diff(imagePath.size() ? imagePath : "/");
+        std::string out;
+        for (auto &c : changes) {
+            out += (char)c.type;
+            out += " " + c.path;
+            if (c.metadata.size()) out += " (" + c.metadata + ")";
+            for (size_t i=0; i<c.ranges.size(); i++) {
+                char buf[0x40] = {};
+                snprintf(buf, sizeof(buf), "%c0x%llx-0x%llx", i ? ',' : ' ', c.ranges[i].first, c.ranges[i].first + c.ranges[i].second);
+                out += buf;
+            }
+            out += '\n';
+            if (out.size() >= 0x10000) flushOut(streamfd, out);
+        }
+        flushOut(streamfd, out);
+    } else if (doHashManifest) {
+        uint32_t algos = fastHash ? OrbisFSHash::kHashXXH64 : OrbisFSHash::availableAlgos();
+        if (!(OrbisFSHash::availableAlgos() & OrbisFSHash::kHashSHA256)) info("Built without OpenSSL, only using xxh64");
+        OrbisFSManifest manifest(img.get(), threads);
+        manifest.create(imagePath.size() ? imagePath : "/", streamfd, algos, hashBlocks);
+    } else if (findPredicates.size()) {
+        OrbisFSFind finder(img.get(), threads);
+        for (auto &p : findPredicates) finder.addPredicate(p);
+        auto matches = finder.find(imagePath.size() ? imagePath : "/");
+        if (listFormat) {
+            OrbisFSListWriter writer(streamfd, OrbisFSListWriter::formatForName(listFormat));
+            for (auto &m : matches) writer.addEntry(m.first, m.second);
+            writer.flush();
+        }else{
+            std::string out;
+            for (auto &m : matches) {
+                out += m.first;
+                out += '\n';
+                if (out.size() >= 0x10000) flushOut(streamfd, out);
+            }
+            flushOut(streamfd, out);
+        }
+    } else if (verifyManifestPath) {
+        OrbisFSManifest manifest(img.get(), threads);
+        retassure(manifest.verify(verifyManifestPath, streamfd), "Manifest verification failed");
+        info("Manifest verification succeeded");
+    } else if (exportTarPath) {
+        OrbisFSTarWriter tar(streamfd);
+        tar.addTree(img.get(), exportTarPath);
+        tar.finish();
+        info("Exported '%s' as tar (%llu bytes)",exportTarPath,tar.bytesWritten());
+    } else if (doExtract && imagePath.size() && !doExtractResource && S_ISDIR(img->getInodeForPath(imagePath).fileMode)) {
+        retassure(outfile, "No outputpath specified");
+        retassure(recursive, "'%s' is a directory, use -r to extract it recursively",imagePath.c_str());
+        OrbisFSExtractor extractor(img.get(), threads);
+        if (physicalOrder) {
+            extractor.extractTreePhysicalOrder(imagePath, outfile);
+        }else{
+            extractor.extractTree(imagePath, outfile);
+        }
+        info("Extracted '%s' to '%s'",imagePath.c_str(),outfile);
+    } else if (doExtract) {
         retassure(outfile, "No outputpath specified");
         retassure(imagePath.size(), "No path for extraction specified");
         uint8_t *buf = NULL;
@@ -281,6 +559,15 @@ int main_r(int argc, const char * argv[]) {
                 info("Extracted '%s' to '%s'",imagePath.c_str(),outfile);
             }
         }
+    } else if (doList && listFormat) {
+        if (!imagePath.size()) imagePath = "/";
+        OrbisFSListWriter writer(streamfd, OrbisFSListWriter::formatForName(listFormat));
+        img->iterateOverFilesInFolder(imagePath, recursive, [&](std::string path, OrbisFSInode_t node){
+            if (path.size() > 1 && path.back() == '/') path.pop_back();
+            writer.addEntry(path, node);
+        });
+        writer.flush();
+        info("Listed %llu entries",writer.entries());
     } else if (doList) {
         if (!imagePath.size()) imagePath = "/";
         img->iterateOverFilesInFolder(imagePath, recursive, [&](std::string path, OrbisFSInode_t node){
@@ -374,9 +661,22 @@ int main_r(int argc, const char * argv[]) {
         retassure(imagePath.size(), "No path for resize specified");
         auto f = img->openFilAtPath(imagePath);
         f->resize(newFileSize);
+    }else if (servePath) {
+        std::vector<std::shared_ptr<OrbisFSImage>> images{img};
+        for (auto path : serveImages) {
+            images.push_back(std::make_shared<OrbisFSImage>(path, false, offset));
+        }
+        OrbisFSDaemon daemon(images, servePath, threads);
+        gDaemon = &daemon;
+        signal(SIGINT, stopDaemon);
+        signal(SIGTERM, stopDaemon);
+        daemon.loop();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        gDaemon = NULL;
     }else if (mountPath) {
         info("Mounting disk");
-        OrbisFSFuse off(img, mountPath);
+        OrbisFSFuse off(img, mountPath, cacheTimeout);
         off.loopSession();
     }
 
@@ -0,0 +1,425 @@
+//
+//  orbisFSBench.cpp
+//  orbisFSTool
+//
+//  Created by tihmstar on 18.10.26.
+//
+
+#include "OrbisFSImage.hpp"
+#include "OrbisFSImageBuilder.hpp"
+#include "OrbisFSExtractor.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace orbisFSTool;
+
+static struct option longopts[] = {
+    { "help",               no_argument,        NULL, 'h' },
+    { "input",              required_argument,  NULL, 'i' },
+    { "output",             required_argument,  NULL, 'o' },
+    { "path",               required_argument,  NULL, 'p' },
+
+    { "bench",              required_argument,  NULL,  0  },
+    { "duration",           required_argument,  NULL,  0  },
+    { "extract-to",         required_argument,  NULL,  0  },
+    { "max-threads",        required_argument,  NULL,  0  },
+    { "threads",            required_argument,  NULL,  0  },
+
+    //synthetic image generator
+    { "generate",           required_argument,  NULL,  0  },
+    { "fanout",             required_argument,  NULL,  0  },
+    { "files",              required_argument,  NULL,  0  },
+    { "fragment",           required_argument,  NULL,  0  },
+    { "huge-file",          no_argument,        NULL,  0  },
+    { "large-files",        required_argument,  NULL,  0  },
+    { "max-file-size",      required_argument,  NULL,  0  },
+    { "seed",               required_argument,  NULL,  0  },
+    { NULL, 0, NULL, 0 }
+};
+
+static const char *gAllBenchmarks = "lookup,readdir,seqread,randread,inodescan,check,extract,concurrent";
+
+struct BenchResult {
+    std::string name;
+    unsigned threads;
+    uint64_t ops;
+    uint64_t bytes;
+    double seconds;
+};
+
+static std::vector<BenchResult> gResults;
+
+void cmd_help(){
+    printf(
+           "Usage: orbisFSBench [OPTIONS]\n"
+           "Benchmark orbisFS image operations\n\n"
+           "  -h, --help\t\t\tprints usage information\n"
+           "  -i, --input <path>\t\tinput image\n"
+           "  -o, --output <path>\t\twrite JSON results to path (default: stdout)\n"
+           "  -p, --path <path>\t\tfile inside image used for read benchmarks (default: largest file)\n"
+           "      --bench <list>\t\tcomma separated benchmarks to run (default: %s)\n"
+           "      --duration <sec>\t\tseconds per benchmark run (default: 2)\n"
+           "      --extract-to <dir>\tdirectory for the extract benchmark (default: temporary directory)\n"
+           "      --max-threads <num>\tlargest reader count for concurrent benchmarks (default: 64)\n"
+           "      --threads <num>\t\tworker threads for check and extract (default: all cores)\n"
+           "\n"
+           "Synthetic image generator:\n"
+           "      --generate <path>\t\tcreate a synthetic image at path and benchmark it (unless -i is given)\n"
+           "      --fanout <num>\t\tfiles and subdirectories per directory (default: 16)\n"
+           "      --files <num>\t\tnumber of small files (default: 1000)\n"
+           "      --fragment <blocks>\tinterleave neighbouring files in extents of this many blocks (default: 0, contiguous)\n"
+           "      --huge-file\t\tadd a sparse file which needs three fat stages (>32GiB)\n"
+           "      --large-files <num>\tnumber of files which need two fat stages (default: 0)\n"
+           "      --max-file-size <size>\tlargest small file (default: 1MiB)\n"
+           "      --seed <num>\t\tseed for sizes and contents (default: 0)\n"
+           "\n"
+           ,gAllBenchmarks
+           );
+}
+
+/*
+    Runs op on threads threads for duration seconds.
+    op gets the thread index and a per thread random generator and returns the number of bytes it processed.
+ */
+static void runConcurrent(const char *name, unsigned threads, double duration, std::function<uint64_t(unsigned tid, std::mt19937_64 &rng)> op){
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> ops{0};
+    std::atomic<uint64_t> bytes{0};
+    std::vector<std::thread> workers;
+    
+    auto tstart = std::chrono::steady_clock::now();
+    for (unsigned i=0; i<threads; i++) {
+        workers.emplace_back([&,i]{
+            std::mt19937_64 rng(0x4f726269734653ULL + i);
+            uint64_t myOps = 0;
+            uint64_t myBytes = 0;
+            try {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    myBytes += op(i, rng);
+                    myOps++;
+                }
+            } catch (tihmstar::exception &e) {
+                error("benchmark '%s' thread %d failed: %s",name,i,e.what());
+            }
+            ops += myOps;
+            bytes += myBytes;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for (auto &w : workers) {
+        w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    
+    gResults.push_back({name, threads, ops.load(), bytes.load(), secs});
+    info("%-24s threads=%2u ops/s=%12.0f MB/s=%10.2f",name,threads,ops/secs,bytes/secs/1e6);
+}
+
+/*
+    Runs op once, for benchmarks which are too expensive to loop
+ */
+static void runOnce(const char *name, unsigned threads, std::function<uint64_t()> op){
+    auto tstart = std::chrono::steady_clock::now();
+    uint64_t bytes = op();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+    if (secs <= 0) secs = 1e-9;
+    
+    gResults.push_back({name, threads, 1, bytes, secs});
+    info("%-24s threads=%2u seconds=%10.3f MB/s=%10.2f",name,threads,secs,bytes/secs/1e6);
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw){
+    return remove(path);
+}
+
+static void writeResults(FILE *f, const std::string &image){
+    fprintf(f, "{\n  \"image\": {%s},\n  \"results\": [\n", image.c_str());
+    for (size_t i=0; i<gResults.size(); i++) {
+        auto &r = gResults[i];
+        fprintf(f, "    {\"benchmark\": \"%s\", \"threads\": %u, \"ops\": %llu, \"bytes\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.2f, \"bytes_per_sec\": %.2f}%s\n",
+                r.name.c_str(), r.threads, r.ops, r.bytes, r.seconds, r.ops/r.seconds, r.bytes/r.seconds,
+                i+1 < gResults.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+MAINFUNCTION
+int main_r(int argc, const char * argv[]) {
+    int optindex = 0;
+    int opt = 0;
+    
+    const char *infile = NULL;
+    const char *outfile = NULL;
+    const char *generatePath = NULL;
+    const char *extractTo = NULL;
+    std::string readPath;
+    std::string benchList = gAllBenchmarks;
+    OrbisFSImageBuilder::SyntheticSpec spec;
+    
+    double duration = 2;
+    unsigned maxThreads = 64;
+    unsigned threads = 0;
+    
+    FILE *fout = NULL;
+    cleanup([&]{
+        if (fout) fclose(fout);
+    });
+    
+    while ((opt = getopt_long(argc, (char* const *)argv, "hi:o:p:", longopts, &optindex)) >= 0) {
+        switch (opt) {
+            case 0: //long opts
+            {
+                std::string curopt = longopts[optindex].name;
+                
+                if (curopt == "bench") {
+                    benchList = optarg;
+                }else if (curopt == "duration") {
+                    duration = atof(optarg);
+                }else if (curopt == "extract-to"){
+                    extractTo = optarg;
+                }else if (curopt == "max-threads"){
+                    maxThreads = atoi(optarg);
+                }else if (curopt == "threads"){
+                    threads = atoi(optarg);
+                }else if (curopt == "generate"){
+                    generatePath = optarg;
+                }else if (curopt == "fanout"){
+                    spec.fanout = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "files"){
+                    spec.files = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "fragment"){
+                    spec.fragmentExtent = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "huge-file"){
+                    spec.hugeFile = true;
+                }else if (curopt == "large-files"){
+                    spec.largeFiles = (uint32_t)strtoul(optarg, NULL, 0);
+                }else if (curopt == "max-file-size"){
+                    spec.maxFileSize = strtoull(optarg, NULL, 0);
+                }else if (curopt == "seed"){
+                    spec.seed = strtoull(optarg, NULL, 0);
+                } else {
+                    reterror("unexpected lonopt=%s",curopt.c_str());
+                }
+                break;
+            }
+                
+            case 'h':
+                cmd_help();
+                return 0;
+                
+            case 'i':
+                infile = optarg;
+                break;
+                
+            case 'o':
+                outfile = optarg;
+                break;
+                
+            case 'p':
+                readPath = optarg;
+                break;
+                
+            default:
+                cmd_help();
+                return -1;
+        }
+    }
+    
+    if (outfile && strcmp(outfile, "-")) {
+        retassure(fout = fopen(outfile, "w"), "Failed to open output file '%s'",outfile);
+    }else{
+        /*
+            The JSON results own stdout, all logging goes to stderr from here on
+         */
+        int resultfd = -1;
+        retassure((resultfd = dup(STDOUT_FILENO)) != -1, "Failed to dup stdout");
+        fflush(stdout);
+        if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1 || !(fout = fdopen(resultfd, "w"))) {
+            close(resultfd);
+            reterror("Failed to redirect stdout");
+        }
+    }
+
+    if (generatePath) {
+        OrbisFSImageBuilder builder(spec);
+        builder.writeImage(generatePath);
+        if (!infile) infile = generatePath;
+    }
+    
+    if (!infile){
+        error("No input image specified");
+        cmd_help();
+        return -1;
+    }
+    
+    std::set<std::string> benchmarks;
+    {
+        std::stringstream ss(benchList);
+        std::string name;
+        while (std::getline(ss, name, ',')) {
+            retassure((std::string(",") + gAllBenchmarks + ",").find("," + name + ",") != std::string::npos, "Unknown benchmark '%s'",name.c_str());
+            benchmarks.insert(name);
+        }
+    }
+    
+    std::shared_ptr<OrbisFSImage> img = std::make_shared<OrbisFSImage>(infile, false, 0, false);
+    
+    /*
+        Everything the benchmarks pick from
+     */
+    std::vector<std::string> paths;
+    std::vector<uint32_t> dirs;
+    uint64_t files = 0;
+    uint64_t totalBytes = 0;
+    uint64_t largestFile = 0;
+    bool pickReadPath = !readPath.size();
+    std::set<uint32_t> fatStages;
+    dirs.push_back(img->getInodeForPath("/").inodeNum);
+    img->iterateOverFilesInFolder("/", true, [&](std::string path, OrbisFSInode_t node){
+        if (path.size() > 1 && path.back() == '/') path.pop_back();
+        paths.push_back(path);
+        if (S_ISDIR(node.fileMode)) {
+            dirs.push_back(node.inodeNum);
+            return;
+        }
+        files++;
+        totalBytes += node.filesize;
+        if (node.fatStages) fatStages.insert(node.fatStages);
+        if (pickReadPath && node.filesize > largestFile) {
+            largestFile = node.filesize;
+            readPath = path;
+        }
+    });
+    retassure(paths.size(), "Image is empty");
+    
+    std::string imageDesc;
+    {
+        char buf[0x400] = {};
+        std::string stages;
+        for (uint32_t s : fatStages) stages += (stages.size() ? "," : "") + std::to_string(s);
+        snprintf(buf, sizeof(buf), "\"files\": %llu, \"dirs\": %zu, \"bytes\": %llu, \"fatStages\": [%s]",
+                 files, dirs.size(), totalBytes, stages.c_str());
+        imageDesc = buf;
+        if (generatePath) {
+            snprintf(buf, sizeof(buf), ", \"seed\": %llu, \"fanout\": %u, \"maxFileSize\": %llu, \"largeFiles\": %u, \"hugeFile\": %s, \"fragmentExtent\": %u",
+                     spec.seed, spec.fanout, spec.maxFileSize, spec.largeFiles, spec.hugeFile ? "true" : "false", spec.fragmentExtent);
+            imageDesc += buf;
+        }
+    }
+    
+    retassure(readPath.size(), "No file to read from");
+    const uint64_t fileSize = img->getInodeForPath(readPath).filesize;
+    retassure(fileSize, "file '%s' is empty",readPath.c_str());
+    const unsigned workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    info("Benchmarking %llu files in %zu directories, reading from '%s'",files,dirs.size(),readPath.c_str());
+    
+    if (benchmarks.count("lookup")) {
+        runConcurrent("path_lookup", 1, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            img->getInodeForPath(paths[rng() % paths.size()]);
+            return 0;
+        });
+    }
+    
+    if (benchmarks.count("readdir")) {
+        runConcurrent("readdir", 1, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            return img->listFilesInFolder(dirs[rng() % dirs.size()]).size();
+        });
+    }
+    
+    if (benchmarks.count("seqread")) {
+        auto f = img->openFilAtPath(readPath);
+        std::vector<uint8_t> buf(1024*1024);
+        uint64_t off = 0;
+        runConcurrent("sequential_read", 1, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            if (off >= fileSize) off = 0;
+            size_t didRead = f->pread(buf.data(), buf.size(), off);
+            off += didRead;
+            return didRead;
+        });
+    }
+    
+    if (benchmarks.count("randread")) {
+        auto f = img->openFilAtPath(readPath);
+        runConcurrent("random_read", 1, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            char buf[0x1000];
+            return f->pread(buf, sizeof(buf), rng() % fileSize);
+        });
+    }
+    
+    if (benchmarks.count("inodescan")) {
+        runConcurrent("inode_scan", 1, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            uint64_t cnt = 0;
+            img->iterateOverFilesInFolder("/", true, [&](std::string path, OrbisFSInode_t node){
+                cnt++;
+            });
+            retassure(cnt == paths.size(), "Scan found %llu instead of %zu entries",cnt,paths.size());
+            return 0;
+        });
+    }
+    
+    if (benchmarks.count("check")) {
+        runOnce("check", workers, [&]()->uint64_t{
+            retassure(img->check(threads), "Image check failed");
+            return 0;
+        });
+    }
+    
+    if (benchmarks.count("extract")) {
+        std::string dir;
+        bool isTemp = !extractTo;
+        if (isTemp) {
+            char tmpl[] = "/tmp/orbisFSBench.XXXXXX";
+            retassure(mkdtemp(tmpl), "Failed to create temporary directory");
+            dir = tmpl;
+        }else{
+            dir = extractTo;
+        }
+        cleanup([&]{
+            if (isTemp) nftw(dir.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+        });
+        std::string target = dir + "/extract";
+        runOnce("extract", workers, [&]()->uint64_t{
+            OrbisFSExtractor extractor(img.get(), threads);
+            extractor.extractTree("/", target.c_str());
+            return totalBytes;
+        });
+    }
+    
+    /*
+        Readers resolve the path, open the file and read a random 4KiB chunk,
+        which exercises every shared structure on the read path
+     */
+    for (unsigned threads = 1; benchmarks.count("concurrent") && threads <= maxThreads; threads *= 2) {
+        runConcurrent("concurrent_read", threads, duration, [&](unsigned tid, std::mt19937_64 &rng)->uint64_t{
+            char buf[0x1000];
+            auto f = img->openFilAtPath(readPath);
+            uint64_t off = rng() % fileSize;
+            uint64_t didRead = 0;
+            size_t curRead = 0;
+            while (didRead < sizeof(buf) && (curRead = f->pread(buf+didRead, sizeof(buf)-didRead, off+didRead))) {
+                didRead += curRead;
+            }
+            return didRead;
+        });
+    }
+    
+    writeResults(fout, imageDesc);
+    return 0;
+}
@@ -6,9 +6,12 @@
 //
 
 #include "utils.hpp"
+#include <libgeneral/macros.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
 
 using namespace orbisFSTool;
 
@@ -52,3 +55,30 @@ std::string orbisFSTool::strForDate(time_t date){
     strftime(buf, sizeof(buf), "%Y %b %d %H:%M:%S", timeinfo);
     return buf;
 }
+
+void orbisFSTool::preadAll(int fd, void *buf, size_t len, uint64_t offset){
+    for (size_t didRead = 0; didRead < len;) {
+        ssize_t curRead = pread(fd, (uint8_t*)buf+didRead, len-didRead, offset+didRead);
+        if (curRead < 0 && errno == EINTR) continue;
+        retassure(curRead > 0, "Failed to read at 0x%llx errno=%d (%s)",offset+didRead,errno,curRead ? strerror(errno) : "unexpected EOF");
+        didRead += curRead;
+    }
+}
+
+void orbisFSTool::pwriteAll(int fd, const void *buf, size_t len, uint64_t offset){
+    for (size_t didWrite = 0; didWrite < len;) {
+        ssize_t curWrite = pwrite(fd, (const uint8_t*)buf+didWrite, len-didWrite, offset+didWrite);
+        if (curWrite < 0 && errno == EINTR) continue;
+        retassure(curWrite > 0, "Failed to write at 0x%llx errno=%d (%s)",offset+didWrite,errno,strerror(errno));
+        didWrite += curWrite;
+    }
+}
+
+void orbisFSTool::writeAll(int fd, const void *buf, size_t len){
+    for (size_t didWrite = 0; didWrite < len;) {
+        ssize_t curWrite = write(fd, (const uint8_t*)buf+didWrite, len-didWrite);
+        if (curWrite < 0 && errno == EINTR) continue;
+        retassure(curWrite > 0, "Failed to write errno=%d (%s)",errno,strerror(errno));
+        didWrite += curWrite;
+    }
+}
@@ -20,6 +20,13 @@ void DumpHex(const void* data, size_t size);
 
 std::string strForDate(time_t date);
 
+/*
+    Transfer exactly len bytes, retrying on EINTR and short transfers. Throw on errors and EOF.
+ */
+void preadAll(int fd, void *buf, size_t len, uint64_t offset);
+void pwriteAll(int fd, const void *buf, size_t len, uint64_t offset);
+void writeAll(int fd, const void *buf, size_t len);
+
 }
 
 #endif /* utils_hpp */